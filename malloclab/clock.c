@@ -1,6 +1,6 @@
 /* 
- * clock.c - Routines for using the cycle counters on x86, 
- *           Alpha, and Sparc boxes.
+ * clock.c - Routines for using the cycle counters on x86 and
+ *           AArch64 boxes, and a nanosecond clock elsewhere.
  * 
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
@@ -10,162 +10,175 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/times.h>
+#include <time.h>
 #include "clock.h"
 
 
 /******************************************************* 
  * Machine dependent functions 
  *
- * Note: the constants __i386__ and  __alpha
+ * Each platform provides counter_begin() and counter_end(),
+ * which read its counter so that no instruction before the
+ * read can still be running after it (begin), or no
+ * instruction after the read can have started before it
+ * (end). Timing a region between the two therefore covers
+ * exactly that region. read_counter() is a plain read for
+ * timing single operations, where serializing would cost
+ * more than the operation. counter_freq() is the counter's
+ * rate in Hz if the platform states it, otherwise 0 to have
+ * mhz() calibrate it.
+ *
+ * Note: the constants __i386__, __x86_64__ and __aarch64__
  * are set by GCC when it calls the C preprocessor
  * You can verify this for yourself using gcc -v.
  *******************************************************/
 
-#if defined(__i386__)  
+#if defined(__i386__) || defined(__x86_64__)
 /*******************************************************
- * Pentium versions of start_counter() and get_counter()
+ * x86 versions, using the time-stamp counter. On any recent
+ * CPU it is invariant: it ticks at a constant rate on every
+ * core, regardless of frequency scaling and sleep states.
  *******************************************************/
 
+static const char counter_source[] = "rdtscp";
 
-/* $begin x86cyclecounter */
-/* Initialize the cycle counter */
-static unsigned cyc_hi = 0;
-static unsigned cyc_lo = 0;
-
-
-/* Set *hi and *lo to the high and low order bits  of the cycle counter.  
-   Implementation requires assembly code to use the rdtsc instruction. */
-void access_counter(unsigned *hi, unsigned *lo)
+/* lfence waits for every earlier instruction to complete. */
+static inline unsigned long long counter_begin(void)
 {
-    asm("rdtsc; movl %%edx,%0; movl %%eax,%1"   /* Read cycle counter */
-	: "=r" (*hi), "=r" (*lo)                /* and move results to */
-	: /* No input */                        /* the two outputs */
-	: "%edx", "%eax");
+    unsigned hi, lo;
+
+    asm volatile("lfence; rdtsc" : "=d" (hi), "=a" (lo) : : "memory");
+    return ((unsigned long long) hi << 32) | lo;
 }
 
-/* Record the current value of the cycle counter. */
-void start_counter()
+/* rdtscp waits for earlier instructions itself, and the lfence
+   keeps later ones from starting before the counter is read. */
+static inline unsigned long long counter_end(void)
 {
-    access_counter(&cyc_hi, &cyc_lo);
+    unsigned hi, lo;
+
+    asm volatile("rdtscp; lfence" : "=d" (hi), "=a" (lo) : : "ecx", "memory");
+    return ((unsigned long long) hi << 32) | lo;
 }
 
-/* Return the number of cycles since the last call to start_counter. */
-double get_counter()
+unsigned long long read_counter()
 {
-    unsigned ncyc_hi, ncyc_lo;
-    unsigned hi, lo, borrow;
-    double result;
-
-    /* Get cycle counter */
-    access_counter(&ncyc_hi, &ncyc_lo);
+    unsigned hi, lo;
 
-    /* Do double precision subtraction */
-    lo = ncyc_lo - cyc_lo;
-    borrow = lo > ncyc_lo;
-    hi = ncyc_hi - cyc_hi - borrow;
-    result = (double) hi * (1 << 30) * 4 + lo;
-    if (result < 0) {
-	fprintf(stderr, "Error: counter returns neg value: %.0f\n", result);
-    }
-    return result;
+    asm volatile("rdtsc" : "=d" (hi), "=a" (lo));
+    return ((unsigned long long) hi << 32) | lo;
 }
-/* $end x86cyclecounter */
 
-#elif defined(__alpha)
+/* The TSC rate is not architecturally visible, so calibrate it. */
+static double counter_freq(void)
+{
+    return 0;
+}
 
+#elif defined(__aarch64__)
 /****************************************************
- * Alpha versions of start_counter() and get_counter()
+ * AArch64 versions, using the generic timer's virtual
+ * count, which ticks at the fixed rate in cntfrq_el0.
  ***************************************************/
 
-/* Initialize the cycle counter */
-static unsigned cyc_hi = 0;
-static unsigned cyc_lo = 0;
-
-
-/* Use Alpha cycle timer to compute cycles.  Then use
-   measured clock speed to compute seconds 
-*/
-
-/*
- * counterRoutine is an array of Alpha instructions to access 
- * the Alpha's processor cycle counter. It uses the rpcc 
- * instruction to access the counter. This 64 bit register is 
- * divided into two parts. The lower 32 bits are the cycles 
- * used by the current process. The upper 32 bits are wall 
- * clock cycles. These instructions read the counter, and 
- * convert the lower 32 bits into an unsigned int - this is the 
- * user space counter value.
- * NOTE: The counter has a very limited time span. With a 
- * 450MhZ clock the counter can time things for about 9 
- * seconds. */
-static unsigned int counterRoutine[] =
+static const char counter_source[] = "cntvct_el0";
+
+/* isb waits for every earlier instruction to complete. */
+static inline unsigned long long counter_begin(void)
 {
-    0x601fc000u,
-    0x401f0000u,
-    0x6bfa8001u
-};
+    unsigned long long val;
 
-/* Cast the above instructions into a function. */
-static unsigned int (*counter)(void)= (void *)counterRoutine;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r" (val) : : "memory");
+    return val;
+}
 
+/* The second isb keeps later instructions from starting early. */
+static inline unsigned long long counter_end(void)
+{
+    unsigned long long val;
 
-void start_counter()
+    asm volatile("isb; mrs %0, cntvct_el0; isb" : "=r" (val) : : "memory");
+    return val;
+}
+
+unsigned long long read_counter()
 {
-    /* Get cycle counter */
-    cyc_hi = 0;
-    cyc_lo = counter();
+    unsigned long long val;
+
+    asm volatile("mrs %0, cntvct_el0" : "=r" (val));
+    return val;
 }
 
-double get_counter()
+static double counter_freq(void)
 {
-    unsigned ncyc_hi, ncyc_lo;
-    unsigned hi, lo, borrow;
-    double result;
-    ncyc_lo = counter();
-    ncyc_hi = 0;
-    lo = ncyc_lo - cyc_lo;
-    borrow = lo > ncyc_lo;
-    hi = ncyc_hi - cyc_hi - borrow;
-    result = (double) hi * (1 << 30) * 4 + lo;
-    if (result < 0) {
-	fprintf(stderr, "Error: Cycle counter returning negative value: %.0f\n", result);
-    }
-    return result;
+    unsigned long long freq;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+    return (double) freq;
 }
 
 #else
 
 /****************************************************************
- * All the other platforms for which we haven't implemented cycle
- * counter routines. Newer models of sparcs (v8plus) have cycle
- * counters that can be accessed from user programs, but since there
- * are still many sparc boxes out there that don't support this, we
- * haven't provided a Sparc version here.
+ * All the other platforms, for which we haven't implemented a
+ * cycle counter, count nanoseconds of CLOCK_MONOTONIC_RAW, which
+ * is never slewed by NTP. The system call is its own barrier.
  ***************************************************************/
 
-void start_counter()
+static const char counter_source[] = "CLOCK_MONOTONIC_RAW";
+
+unsigned long long read_counter()
 {
-    printf("ERROR: You are trying to use a start_counter routine in clock.c\n");
-    printf("that has not been implemented yet on this platform.\n");
-    printf("Please choose another timing package in config.h.\n");
-    exit(1);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-double get_counter() 
+static inline unsigned long long counter_begin(void)
 {
-    printf("ERROR: You are trying to use a get_counter routine in clock.c\n");
-    printf("that has not been implemented yet on this platform.\n");
-    printf("Please choose another timing package in config.h.\n");
-    exit(1);
+    return read_counter();
 }
-#endif
 
+static inline unsigned long long counter_end(void)
+{
+    return read_counter();
+}
 
+static double counter_freq(void)
+{
+    return 1e9;
+}
+#endif
 
 
 /*******************************
  * Machine-independent functions
  ******************************/
+
+/* $begin cyclecounter */
+/* Initialize the cycle counter */
+static unsigned long long cyc_start = 0;
+
+/* Record the current value of the cycle counter. */
+void start_counter()
+{
+    cyc_start = counter_begin();
+}
+
+/* Return the number of cycles since the last call to start_counter. */
+double get_counter()
+{
+    return (double) (counter_end() - cyc_start);
+}
+/* $end cyclecounter */
+
+/* Name the counter that start_counter() and get_counter() read. */
+const char *counter_name()
+{
+    return counter_source;
+}
+
 double ovhd()
 {
     /* Do it twice to eliminate cache effects */
@@ -179,6 +192,35 @@ double ovhd()
     return result;
 }
 
+/* Read CLOCK_MONOTONIC_RAW in nanoseconds */
+static unsigned long long raw_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Measure the counter rate in MHz against CLOCK_MONOTONIC_RAW over
+   at least nsecs nanoseconds, spinning if spin is set (so that the
+   core stays awake) and otherwise sleeping */
+static double measure_mhz(unsigned long long nsecs, int spin)
+{
+    unsigned long long t0, t1, c0, c1;
+
+    t0 = raw_nsecs();
+    c0 = counter_begin();
+    if (!spin) {
+	struct timespec ts = {nsecs / 1000000000ULL, nsecs % 1000000000ULL};
+	nanosleep(&ts, NULL);
+    }
+    do {
+	c1 = counter_end();
+	t1 = raw_nsecs();
+    } while (t1 - t0 < nsecs);
+    return (c1 - c0) * 1e3 / (t1 - t0);
+}
+
 /* $begin mhz */
 /* Estimate the clock rate by measuring the cycles that elapse */ 
 /* while sleeping for sleeptime seconds */
@@ -186,19 +228,38 @@ double mhz_full(int verbose, int sleeptime)
 {
     double rate;
 
-    start_counter();
-    sleep(sleeptime);
-    rate = get_counter() / (1e6*sleeptime);
+    rate = measure_mhz(sleeptime * 1000000000ULL, 0);
     if (verbose) 
 	printf("Processor clock rate ~= %.1f MHz\n", rate);
     return rate;
 }
 /* $end mhz */
 
-/* Version using a default sleeptime */
+#define CALIBRATE_ROUNDS 5
+#define CALIBRATE_NSECS 20000000 /* 20 ms */
+
+/* Return the counter rate in MHz: the rate the platform states, or
+   else the median of CALIBRATE_ROUNDS short spinning measurements,
+   which rejects rounds disturbed by preemption */
 double mhz(int verbose)
 {
-    return mhz_full(verbose, 2);
+    double rates[CALIBRATE_ROUNDS], rate;
+    int i, j;
+
+    rate = counter_freq() / 1e6;
+    if (rate == 0) {
+	for (i = 0; i < CALIBRATE_ROUNDS; i++) {
+	    rate = measure_mhz(CALIBRATE_NSECS, 1);
+	    /* Insertion sort */
+	    for (j = i; j > 0 && rates[j-1] > rate; j--)
+		rates[j] = rates[j-1];
+	    rates[j] = rate;
+	}
+	rate = rates[CALIBRATE_ROUNDS / 2];
+    }
+    if (verbose) 
+	printf("Counter %s rate ~= %.1f MHz\n", counter_source, rate);
+    return rate;
 }
 
 /** Special counters that compensate for timer interrupt overhead */
@@ -6,10 +6,18 @@ void start_counter();
 /* Get # cycles since counter started */
 double get_counter();
 
+/* Read the raw cycle counter (nanoseconds where there is none), e.g. to
+   time single operations without disturbing start_counter() */
+unsigned long long read_counter();
+
+/* Name the counter in use (e.g. "rdtscp") */
+const char *counter_name();
+
 /* Measure overhead for counter */
 double ovhd();
 
-/* Determine clock rate of processor (using a default sleeptime) */
+/* Determine the counter rate in MHz (stated by the platform, or
+   calibrated against CLOCK_MONOTONIC_RAW) */
 double mhz(int verbose);
 
 /* Determine clock rate of processor, having more control over accuracy */
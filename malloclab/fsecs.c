@@ -21,12 +21,15 @@ void init_fsecs(void)
 
 #if USE_FCYC
     if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
+	printf("Measuring performance with a cycle counter (%s).\n",
+	       counter_name());
 
-    /* set key parameters for the fcyc package */
+    /* set key parameters for the fcyc package; samples hit by timer
+       interrupts or preemption lose out in the K-best scheme, so
+       there is no need to compensate for ticks */
     set_fcyc_maxsamples(20); 
     set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
+    set_fcyc_compensate(0);
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
     Mhz = mhz(verbose > 0);
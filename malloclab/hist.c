@@ -0,0 +1,81 @@
+/*
+ * hist.c - Log-scale histograms of non-negative integer samples
+ *
+ * Values below 1 << HIST_SUB_BITS get a bucket each. Above that, every
+ * power of two is split into 1 << HIST_SUB_BITS equally wide buckets, so
+ * a bucket is never wider than a quarter of the values it holds and
+ * recording a sample is a bit scan and an increment.
+ */
+#include <string.h>
+
+#include "hist.h"
+
+#define SUB_BUCKETS (1 << HIST_SUB_BITS)
+
+/* 
+ * bucket - Return the bucket that holds value
+ */
+static int bucket(unsigned long long value)
+{
+    int msb;
+
+    if (value < SUB_BUCKETS)
+	return (int) value;
+    msb = 63 - __builtin_clzll(value);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 
+	(int) ((value >> (msb - HIST_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* 
+ * bucket_max - Return the largest value that falls into bucket b
+ */
+static double bucket_max(int b)
+{
+    int shift;
+
+    if (b < SUB_BUCKETS)
+	return b;
+    shift = (b >> HIST_SUB_BITS) - 1;
+    return (double) (SUB_BUCKETS + (b & (SUB_BUCKETS - 1)) + 1) * 
+	(double) (1ULL << shift) - 1;
+}
+
+/* 
+ * hist_clear - Empty the histogram 
+ */
+void hist_clear(hist_t *h)
+{
+    memset(h, 0, sizeof(hist_t));
+}
+
+/* 
+ * hist_add - Record one sample 
+ */
+void hist_add(hist_t *h, unsigned long long value)
+{
+    h->counts[bucket(value)]++;
+    h->total++;
+}
+
+/*
+ * hist_percentile - Return the upper end of the bucket that holds the
+ *     sample of rank p*total, i.e. a bound that at least a fraction p of
+ *     the samples do not exceed. Returns 0 for an empty histogram.
+ */
+double hist_percentile(hist_t *h, double p)
+{
+    unsigned long rank, seen = 0;
+    int b;
+
+    if (h->total == 0)
+	return 0;
+    rank = (unsigned long) (p * h->total);
+    if (rank == 0)
+	rank = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+	seen += h->counts[b];
+	if (seen >= rank)
+	    return bucket_max(b);
+    }
+    return bucket_max(HIST_BUCKETS - 1);
+}
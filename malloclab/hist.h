@@ -0,0 +1,22 @@
+/*
+ * hist.h - prototypes for the log-scale histograms in hist.c, used to
+ *     record per-operation latencies
+ */
+
+/* Each power of two is split into 1 << HIST_SUB_BITS buckets */
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+    unsigned long counts[HIST_BUCKETS]; /* number of samples per bucket */
+    unsigned long total;                /* number of samples overall */
+} hist_t;
+
+/* Empty the histogram */
+void hist_clear(hist_t *h);
+
+/* Record one sample */
+void hist_add(hist_t *h, unsigned long long value);
+
+/* Return an upper bound on the p-th fraction (0 < p <= 1) of the samples */
+double hist_percentile(hist_t *h, double p);
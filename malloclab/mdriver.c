@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,12 +15,23 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <math.h>
 #include <time.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "hist.h"
+#include "perfctr.h"
+#include "tracefmt.h"
 #include "config.h"
 
 /**********************
@@ -30,36 +42,122 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXTHREADS    64 /* max number of replay threads for -j */
+#define MAXWORKERS    64 /* max number of worker processes for -w */
+#define STREAM_WINDOW 4096 /* requests per window of a streamed trace (-s) */
+#define MT_REPS       10 /* number of timed multithreaded replays per trace */
+#define LAT_REPS      10 /* number of instrumented replays per trace for -L */
+#define NUM_OPTYPES    5 /* number of request types (ALLOC, ..., BATCH_FREE) */
+#define PERF_REPS      3 /* number of counted replays per trace for -p */
+#define MAXREPS      100 /* max number of timed runs per trace for -r */
+#define COMPARE_REPS   5 /* default number of timed runs for --compare */
+#define NOISE_FLOOR 0.02 /* smallest relative Kops change flagged by --compare */
+#define NOISE_SIGMAS   3 /* std deviations of noise tolerated by --compare */
+#define UTIL_SLACK 0.001 /* largest util drop not flagged by --compare */
+#define STATS_SAMPLES 200 /* mm_stats samples per trace for --stats */
+#define SNAP_SAMPLES  10 /* default heap snapshots per trace for --snapshot */
+#define MAXSNAPS      64 /* max number of ops given to --snap-at */
+#define EVAL_CHECK   0x1 /* evaluate a trace's correctness and util... */
+#define EVAL_TIME    0x2 /* ... and/or its speed (see eval_mm_trace) */
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
-typedef struct range_t {
+/* Records the extent of each block's payload, as a node of a range set */
+typedef struct {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    int left;              /* subtree of lower ranges (or next unused node) */
+    int right;             /* subtree of higher ranges */
+    unsigned prio;         /* random priority, larger than its children's */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* 
+ * The extents of all allocated payloads of a trace, as a treap ordered by
+ * lo. The nodes come from one pool that grows by doubling and are named
+ * by their index in it, with -1 for none.
+ */
+typedef struct {
+    range_t *nodes;        /* the node pool */
+    int capacity;          /* number of nodes the pool has room for */
+    int used;              /* number of pool nodes handed out so far */
+    int unused;            /* list of released nodes, linked by left */
+    int root;              /* root of the treap */
+    unsigned seed;         /* state of the priority generator */
+} rangeset_t;
+
+/* 
+ * Characterizes a single trace operation (allocator request). A batch
+ * request covers the count ids from index on, which BATCH_ALLOC gives
+ * blocks of size bytes each with mm_malloc_batch and BATCH_FREE frees
+ * with mm_free_batch.
+ */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, BATCH_ALLOC, BATCH_FREE} type; 
+                                      /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int count;                        /* number of ids (1 unless a batch) */
 } traceop_t;
 
+/* Holds one window of requests read ahead from a streamed trace */
+typedef struct {
+    traceop_t ops[STREAM_WINDOW];
+    int num_ops;         /* number of requests (fewer only in the last) */
+    int max_index;       /* largest id of the requests, or -1 */
+} window_t;
+
+/* 
+ * Holds the state of a streamed trace (-s). A reader thread parses the
+ * file into the two windows in turn while the replay consumes the other
+ * one, so at most 2*STREAM_WINDOW requests are ever held in memory. A
+ * window belongs to the reader until it is ready and to the replay
+ * until the replay hands it back.
+ */
+typedef struct {
+    FILE *file;          /* the trace file... */
+    char *path;          /* ... its name, for error messages ... */
+    int binary;          /* ... whether it is in the binary format ... */
+    long data_start;     /* ... and the file offset of its first request */
+    window_t windows[2];
+    int ready[2];        /* is window filled and owned by the replay? */
+    int stop;            /* set to make the reader thread give up */
+    int running;         /* is there a reader thread to join? */
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signaled whenever ready[] or stop changes */
+} stream_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
-    int num_ids;         /* number of alloc/realloc ids */
-    int num_ops;         /* number of distinct requests */
+    int num_ids;         /* number of alloc/realloc ids (slots in blocks) */
+    int num_ops;         /* number of distinct requests (for a streamed
+			    trace, known only once it has been replayed) */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests (NULL for a binary trace) */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    unsigned char *map;  /* mapping of a binary trace file, or NULL... */
+    size_t map_size;     /* ... its length in bytes ... */
+    const unsigned char *packed; /* ... and its first packed request */
+    stream_t *stream;    /* state of a streamed trace, or NULL */
 } trace_t;
 
+/* 
+ * Walks the requests of a trace in order. Text traces are read from ops[],
+ * binary traces are decoded straight out of the mapped file, and streamed
+ * traces are read from the windows filled by the reader thread.
+ */
+typedef struct {
+    trace_t *trace;
+    int next;                 /* index of the next request in ops[] */
+    const unsigned char *p;   /* the next packed request */
+    int w;                    /* window of a streamed trace being read... */
+    int base;                 /* ... and the number of requests before it */
+} opcursor_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -67,27 +165,79 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;  
-    range_t *ranges;
+    rangeset_t *ranges;
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
-    double ops;      /* number of ops (malloc/free/realloc) in the trace */
+    double ops;      /* number of ops (malloc/free/realloc) in the trace,
+			counting a batch request as one */
     int valid;       /* was the trace processed correctly by the allocator? */
-    double secs;     /* number of secs needed to run the trace */
+    double secs;     /* number of secs needed to run the trace (the
+			median of the -r timed runs) */
+    double secs_rsd; /* relative std deviation of those runs' secs */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only for multithreaded replays of the mm package (-j) */
+    int threads;     /* number of replay threads (0 if not replayed) */
+    double mt_secs;  /* wall-clock secs for all threads to replay the trace */
+    double op_nsecs; /* mean per-op latency seen by a replay thread (ns) */
+
+    /* defined only for instrumented replays of the mm package (-L),
+       indexed by request type, in cycles; 0 if the trace has none */
+    double lat_p50[NUM_OPTYPES];  /* median latency */
+    double lat_p99[NUM_OPTYPES];  /* 99th percentile latency */
+    double lat_p999[NUM_OPTYPES]; /* 99.9th percentile latency */
+
+    /* defined only for counted replays of the mm package (-p), indexed
+       by perf event: the fewest events seen in one replay, or -1 if the
+       event could not be counted */
+    double perf[NUM_PERF_EVENTS];
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * Holds the share of a trace replayed by one thread in -j mode. Each
+ * thread gets the ops of the ids that are congruent to its number modulo
+ * the thread count, in trace order, so no two threads touch the same id.
+ */
+typedef struct {
+    trace_t *trace;            /* trace whose blocks[] array is shared */
+    traceop_t *ops;            /* this thread's ops */
+    int num_ops;               /* number of them */
+    pthread_barrier_t *start;  /* released once all threads are ready */
+    double begin, end;         /* wall-clock times around this thread's ops */
+} mt_thread_t;
+
+/* The results of one trace in a baseline read back for --compare */
+typedef struct {
+    char file[MAXLINE];  /* trace file name the results are keyed by */
+    int valid;
+    double util;
+    double kops;
+    double secs_rsd;
+} baseline_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int nthreads = 1;/* number of replay threads for -j */
+static int workers = 0; /* number of worker processes for -w, 0 if unset */
+static int latency = 0; /* if set, record per-op latency histograms (-L) */
+static int streaming = 0; /* if set, stream traces instead of loading them */
+static int perfctrs = 0;  /* if set, count hardware events per op (-p) */
+static int reps = 0;      /* number of timed runs per trace (-r), 0 if unset */
+static int check_every = 0; /* check the whole heap every n ops (-c) */
+static FILE *stats_fp = NULL; /* where mm_stats samples go (--stats) */
+static FILE *snap_fp = NULL;  /* where heap snapshots go (--snapshot) */
+static int snap_ops[MAXSNAPS];/* sorted ops to snapshot after (--snap-at) */
+static int num_snap_ops = 0;
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -103,15 +253,43 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate range sets */
+static int add_range(rangeset_t *ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(rangeset_t *ranges, char *lo);
+static void clear_ranges(rangeset_t *ranges);
+static void free_ranges(rangeset_t *ranges);
+static void split_ranges(rangeset_t *ranges, int t, char *lo, 
+			 int *lower, int *higher);
+static int merge_ranges(rangeset_t *ranges, int lower, int higher);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static void read_binary_trace(trace_t *trace, char *path);
+static void open_stream(trace_t *trace, FILE *file, char *path, int binary,
+			tracehdr_t *hdr);
+static void restart_stream(stream_t *s);
+static void stop_stream(stream_t *s);
+static void *fill_windows(void *ptr);
+static int read_op(stream_t *s, traceop_t *op);
+static void wait_window(stream_t *s, int w);
+static void grow_blocks(trace_t *trace, int index);
+static void start_ops(trace_t *trace, opcursor_t *c);
+static int next_window(opcursor_t *c);
+static inline int next_op(opcursor_t *c, traceop_t *op);
+
+/* Routines for evaluating whole traces, in worker processes with -w */
+static void eval_libc_trace(char *file, int tracenum, stats_t *stats, 
+			    int parts);
+static void eval_mm_trace(char *file, int tracenum, stats_t *stats, 
+			  rangeset_t *ranges, int parts);
+static void eval_parallel(int n, char **files, stats_t *libc_stats, 
+			  stats_t *mm_stats, rangeset_t *ranges);
+static void run_workers(int num_workers, int *cpus, int parts, int n, 
+			char **files, stats_t *libc_stats, stats_t *mm_stats, 
+			rangeset_t *ranges);
+static stats_t *alloc_stats(int n);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -119,16 +297,39 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, rangeset_t *ranges);
+static int check_fill(const char *p, int c, int n);
+static int check_huge(int tracenum, int opnum);
+static double eval_mm_util(trace_t *trace, int tracenum, rangeset_t *ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_speed_mt(trace_t *trace, stats_t *stats);
+static void *eval_mm_thread(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static void eval_mm_perf(speed_t *params, stats_t *stats);
+
+/* Routines for machine-readable results and regression checks */
+static void write_json(char *path, int n, char **files, stats_t *stats, 
+		       double perfindex);
+static void write_csv(char *path, int n, char **files, stats_t *stats);
+static void write_sample(int tracenum, int opnum, int payload);
+static void parse_snap_ops(char *list);
+static void write_snapshot(int tracenum, int opnum);
+static FILE *open_output(char *path);
+static int read_baseline(char *path, baseline_t **base);
+static int json_field(const char *obj, const char *end, const char *key,
+		      double *val);
+static int compare_results(char *path, int n, char **files, stats_t *stats);
+static double time_trace(fsecs_test_funct f, speed_t *params, double *rsd);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatencies(int n, stats_t *stats);
+static void printperf(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
+static double wall_secs(void);
 
 /**************
  * Main routine
@@ -136,17 +337,30 @@ static void app_error(char *msg);
 int main(int argc, char **argv)
 {
     int i;
-    char c;
+    int c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+    rangeset_t ranges = {NULL, 0, 0, -1, -1, 1}; /* block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    char *json_path = NULL;    /* write results as JSON here (--json) */
+    char *csv_path = NULL;     /* write results as CSV here (--csv) */
+    char *baseline_path = NULL;/* compare results to this JSON (--compare) */
+    int regressions = 0;       /* number of traces --compare flagged */
+    size_t max_heap = 0;       /* bytes of the simulated heap (-m), 0 if unset */
+    int mem_options = 0;       /* how memlib backs the heap (-H, -P) */
+    static struct option long_options[] = {
+	{"json", required_argument, NULL, 'J'},
+	{"csv", required_argument, NULL, 'C'},
+	{"compare", required_argument, NULL, 'B'},
+	{"stats", required_argument, NULL, 'S'},
+	{"snapshot", required_argument, NULL, 'N'},
+	{"snap-at", required_argument, NULL, 'A'},
+	{NULL, 0, NULL, 0}
+    };
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -159,7 +373,8 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt_long(argc, argv, "f:t:j:w:r:c:k:m:hvVgalLspHP", 
+			    long_options, NULL)) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -179,6 +394,80 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 'j': /* Also replay each trace on this many threads */
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1 || nthreads > MAXTHREADS) {
+		fprintf(stderr, "ERROR: -j takes 1 to %d threads\n", MAXTHREADS);
+		exit(1);
+	    }
+	    break;
+	case 'w': /* Evaluate this many traces at once */
+	    workers = atoi(optarg);
+	    if (workers < 1 || workers > MAXWORKERS) {
+		fprintf(stderr, "ERROR: -w takes 1 to %d workers\n", MAXWORKERS);
+		exit(1);
+	    }
+	    break;
+	case 'L': /* Record per-op latency histograms */
+	    latency = 1;
+	    break;
+	case 's': /* Stream traces through a bounded window */
+	    streaming = 1;
+	    break;
+	case 'p': /* Count hardware events per op */
+	    perfctrs = 1;
+	    break;
+	case 'r': /* Time each trace this many times */
+	    reps = atoi(optarg);
+	    if (reps < 1 || reps > MAXREPS) {
+		fprintf(stderr, "ERROR: -r takes 1 to %d runs\n", MAXREPS);
+		exit(1);
+	    }
+	    break;
+	case 'c': /* Check the heap every n ops of the validity run */
+	    if ((check_every = atoi(optarg)) < 1) {
+		fprintf(stderr, "ERROR: -c takes a positive number of ops\n");
+		exit(1);
+	    }
+	    break;
+	case 'k': /* Check a window of the heap every n ops of every run */
+	    if (atoi(optarg) < 1) {
+		fprintf(stderr, "ERROR: -k takes a positive number of ops\n");
+		exit(1);
+	    }
+	    mm_check_sample(atoi(optarg), 0);
+	    break;
+	case 'm': /* Size of the simulated heap in MB */
+	    if (atoi(optarg) < 1) {
+		fprintf(stderr, "ERROR: -m takes a positive number of MB\n");
+		exit(1);
+	    }
+	    max_heap = (size_t) atoi(optarg) << 20;
+	    break;
+	case 'H': /* Back the heap with huge pages */
+	    mem_options |= MEM_HUGETLB;
+	    break;
+	case 'P': /* Fault the heap in before any run */
+	    mem_options |= MEM_PREFAULT;
+	    break;
+	case 'J': /* Write the results as JSON */
+	    json_path = optarg;
+	    break;
+	case 'C': /* Write the results as CSV */
+	    csv_path = optarg;
+	    break;
+	case 'S': /* Sample mm_stats over the course of each trace */
+	    stats_fp = open_output(optarg);
+	    break;
+	case 'N': /* Write heap snapshots over the course of each trace */
+	    snap_fp = open_output(optarg);
+	    break;
+	case 'A': /* ... after these ops */
+	    parse_snap_ops(optarg);
+	    break;
+	case 'B': /* Check the results against a baseline */
+	    baseline_path = optarg;
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
@@ -234,35 +523,68 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* Workers would write their samples over each other's */
+    if (workers > 0 && (stats_fp != NULL || snap_fp != NULL)) {
+	fprintf(stderr, "ERROR: -w cannot be used with --stats or --snapshot\n");
+	exit(1);
+    }
+
+    /* A comparison needs an estimate of the noise */
+    if (reps == 0)
+	reps = baseline_path ? COMPARE_REPS : 1;
+
     /* Initialize the timing package */
     init_fsecs();
+    if (perfctrs && perf_open() == 0)
+	printf("Warning: no hardware events can be counted here "
+	       "(see /proc/sys/kernel/perf_event_paranoid)\n");
+
+    /* Allocate the stats arrays, with one stats_t struct per tracefile
+       for each package */
+    libc_stats = alloc_stats(num_tracefiles);
+    mm_stats = alloc_stats(num_tracefiles);
+
+    /* Initialize the simulated memory system in memlib.c, faulting in
+       the heap (with -P) before anything is timed. With -w, every worker
+       initializes a heap of its own instead, and this one only shows
+       how they are backed. */
+    mem_config(max_heap, mem_options);
+    mem_init(); 
+    if (verbose > 1) {
+	printf("Heap of %lu MB", (unsigned long) (mem_max_heapsize() >> 20));
+	if (mem_backing_flags() & MEM_HUGETLB)
+	    printf(", reserved huge pages");
+	else if (mem_backing_flags() & MEM_THP)
+	    printf(", transparent huge pages");
+	if (mem_backing_flags() & MEM_PREFAULT)
+	    printf(", prefaulted");
+	printf("\n");
+    }
+    else if ((mem_options & MEM_HUGETLB) && 
+	     !(mem_backing_flags() & (MEM_HUGETLB | MEM_THP)))
+	fprintf(stderr, "Warning: no huge pages for the heap\n");
+    if (workers > 0)
+	mem_deinit();
 
     /*
-     * Optionally run and evaluate the libc malloc package 
+     * Evaluate all the traces in worker processes, several at once, or
+     * else run and evaluate the libc malloc package first
      */
-    if (verbose > 1)
-	printf("\nTesting libc malloc\n");
-    
-    /* Allocate libc stats array, with one stats_t struct per tracefile */
-    libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (libc_stats == NULL)
-	unix_error("libc_stats calloc in main failed");
-    
-    /* Evaluate the libc malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	libc_stats[i].ops = trace->num_ops;
+    if (workers > 0) {
 	if (verbose > 1)
-	    printf("Checking libc malloc for correctness, ");
-	libc_stats[i].valid = eval_libc_valid(trace, i);
-	if (libc_stats[i].valid) {
-		    speed_params.trace = trace;
-		    if (verbose > 1)
-			    printf("and performance.\n");
-		    libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-	    }
-	free_trace(trace);
+	    printf("\nTesting libc and mm malloc in %d workers\n", workers);
+	eval_parallel(num_tracefiles, tracefiles, libc_stats, mm_stats, 
+		      &ranges);
+    }
+    else {
+	if (verbose > 1)
+	    printf("\nTesting libc malloc\n");
+	/* Evaluate the libc malloc package using the K-best scheme */
+	for (i=0; i < num_tracefiles; i++)
+	    eval_libc_trace(tracefiles[i], i, &libc_stats[i], 
+			    EVAL_CHECK | EVAL_TIME);
     }
+
     /* Display the libc results in a compact table */
     if (verbose) {
 	printf("\nResults for libc malloc:\n");
@@ -272,43 +594,31 @@ int main(int argc, char **argv)
     /*
      * Always run and evaluate the student's mm package
      */
-    if (verbose > 1)
-	printf("\nTesting mm malloc\n");
-
-    /* Allocate the mm stats array, with one stats_t struct per tracefile */
-    mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
-	unix_error("mm_stats calloc in main failed");
-    
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
-
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+    if (workers == 0) {
 	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+	    printf("\nTesting mm malloc\n");
+	/* Evaluate student's mm malloc package using the K-best scheme */
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracefiles[i], i, &mm_stats[i], &ranges, 
+			  EVAL_CHECK | EVAL_TIME);
     }
 
     /* Display the mm results in a compact table */
-    if (verbose) {
+    if (verbose || nthreads > 1 || latency || perfctrs) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (latency) {
+	printf("Per-op latencies for mm malloc (cycles):\n");
+	printlatencies(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (perfctrs) {
+	printf("Per-op hardware events for mm malloc:\n");
+	printperf(num_tracefiles, mm_stats);
+	printf("\n");
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -361,6 +671,17 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    /* 
+     * Write the machine-readable results and compare them to a baseline
+     */
+    if (json_path)
+	write_json(json_path, num_tracefiles, tracefiles, mm_stats, perfindex);
+    if (csv_path)
+	write_csv(csv_path, num_tracefiles, tracefiles, mm_stats);
+    if (baseline_path)
+	regressions = compare_results(baseline_path, num_tracefiles, 
+				      tracefiles, mm_stats);
+
     // clear up allocated memory used in the program
     if (using_default_traces == 0)
     {
@@ -374,32 +695,43 @@ int main(int argc, char **argv)
         }
         free(tracefiles);
     }
-    free(libc_stats);
-    free(mm_stats);
-    mem_deinit();
-    clear_ranges(&ranges);
-
-    exit(0);
+    if (stats_fp != NULL && stats_fp != stdout)
+	fclose(stats_fp);
+    if (snap_fp != NULL && snap_fp != stdout)
+	fclose(snap_fp);
+    munmap(libc_stats, num_tracefiles * sizeof(stats_t));
+    munmap(mm_stats, num_tracefiles * sizeof(stats_t));
+    perf_close();
+    if (workers == 0)
+	mem_deinit();
+    free_ranges(&ranges);
+
+    exit(regressions ? 2 : 0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range set, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks. As the payloads
+ * in the set never overlap, a new payload overlaps one of them exactly 
+ * when the payload with the highest lo not above the new hi ends at or
+ * after the new lo. Inserts, deletes and that overlap query each take
+ * expected O(log n) time in the number n of live payloads.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range set. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(rangeset_t *ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p = NULL;
+    int t, lower, higher;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -412,9 +744,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a
+       region obtained from mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, size)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -422,62 +756,134 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    for (t = ranges->root;  t != -1; ) {
+	if (ranges->nodes[t].lo <= hi) {
+	    p = &ranges->nodes[t];
+	    t = p->right;
+	}
+	else
+	    t = ranges->nodes[t].left;
+    }
+    if (p != NULL && p->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by taking a range struct from the pool and adding it the range set.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
-    p->lo = lo;
-    p->hi = hi;
-    *ranges = p;
+    if (ranges->unused != -1) {
+	t = ranges->unused;
+	ranges->unused = ranges->nodes[t].left;
+    }
+    else {
+	if (ranges->used == ranges->capacity) {
+	    ranges->capacity = (ranges->capacity == 0) ? 1024 : 2*ranges->capacity;
+	    if ((ranges->nodes = (range_t *)realloc(ranges->nodes, 
+		     ranges->capacity * sizeof(range_t))) == NULL)
+		unix_error("realloc error in add_range");
+	}
+	t = ranges->used++;
+    }
+    ranges->seed = ranges->seed * 1103515245 + 12345;
+    ranges->nodes[t].lo = lo;
+    ranges->nodes[t].hi = hi;
+    ranges->nodes[t].left = -1;
+    ranges->nodes[t].right = -1;
+    ranges->nodes[t].prio = ranges->seed;
+    split_ranges(ranges, ranges->root, lo, &lower, &higher);
+    ranges->root = merge_ranges(ranges, merge_ranges(ranges, lower, t), higher);
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(rangeset_t *ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-   // int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-    //        size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    int *link = &ranges->root;
+    int t;
+
+    while ((t = *link) != -1) {
+	if (ranges->nodes[t].lo == lo) {
+	    *link = merge_ranges(ranges, ranges->nodes[t].left, 
+				 ranges->nodes[t].right);
+	    ranges->nodes[t].left = ranges->unused;
+	    ranges->unused = t;
+	    break;
+	}
+	link = (lo < ranges->nodes[t].lo) ? 
+	    &ranges->nodes[t].left : &ranges->nodes[t].right;
     }
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - release all of the range records for a trace, keeping
+ *     the pool for the next one
+ */
+static void clear_ranges(rangeset_t *ranges)
+{
+    ranges->used = 0;
+    ranges->unused = -1;
+    ranges->root = -1;
+}
+
+/*
+ * free_ranges - free the pool of range records
+ */
+static void free_ranges(rangeset_t *ranges)
+{
+    free(ranges->nodes);
+    ranges->nodes = NULL;
+    ranges->capacity = 0;
+    clear_ranges(ranges);
+}
+
+/*
+ * split_ranges - split the subtree t into the ranges below lo (*lower)
+ *     and the ranges at or above lo (*higher)
  */
-static void clear_ranges(range_t **ranges)
+static void split_ranges(rangeset_t *ranges, int t, char *lo, 
+			 int *lower, int *higher)
 {
-    range_t *p;
-    range_t *pnext;
+    if (t == -1) {
+	*lower = *higher = -1;
+    }
+    else if (ranges->nodes[t].lo < lo) {
+	split_ranges(ranges, ranges->nodes[t].right, lo, 
+		     &ranges->nodes[t].right, higher);
+	*lower = t;
+    }
+    else {
+	split_ranges(ranges, ranges->nodes[t].left, lo, 
+		     lower, &ranges->nodes[t].left);
+	*higher = t;
+    }
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*
+ * merge_ranges - join two subtrees where every range in lower lies below
+ *     every range in higher, and return the root of the result
+ */
+static int merge_ranges(rangeset_t *ranges, int lower, int higher)
+{
+    if (lower == -1)
+	return higher;
+    if (higher == -1)
+	return lower;
+    if (ranges->nodes[lower].prio > ranges->nodes[higher].prio) {
+	ranges->nodes[lower].right = 
+	    merge_ranges(ranges, ranges->nodes[lower].right, higher);
+	return lower;
+    }
+    else {
+	ranges->nodes[higher].left = 
+	    merge_ranges(ranges, lower, ranges->nodes[higher].left);
+	return higher;
     }
-    *ranges = NULL;
 }
 
 
@@ -494,9 +900,11 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, count;
     unsigned max_index = 0;
     unsigned op_index;
+    char magic[sizeof(tracehdr_t)];
+    int binary;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -504,6 +912,9 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
+    trace->map = NULL;
+    trace->packed = NULL;
+    trace->stream = NULL;
 	
     /* Read the trace file header */
     strcpy(path, tracedir);
@@ -512,6 +923,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+
+    /* Binary traces are mapped rather than parsed */
+    binary = fread(magic, 1, sizeof(magic), tracefile) == sizeof(magic) &&
+	is_binary_trace(magic, sizeof(magic));
+    if (streaming) {
+	open_stream(trace, tracefile, path, binary, (tracehdr_t *) magic);
+	return trace;
+    }
+    if (binary) {
+	fclose(tracefile);
+	read_binary_trace(trace, path);
+	return trace;
+    }
+    rewind(tracefile);
+
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
@@ -536,6 +962,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
+	trace->ops[op_index].count = 1;
 	switch(type[0]) {
 	case 'a':
 	    fscanf(tracefile, "%u %u", &index, &size);
@@ -556,6 +983,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
+	case 'A':
+	    fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    trace->ops[op_index].type = BATCH_ALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    trace->ops[op_index].size = size;
+	    max_index = (index + count - 1 > max_index) ? 
+		index + count - 1 : max_index;
+	    break;
+	case 'F':
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    trace->ops[op_index].type = BATCH_FREE;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
@@ -577,12 +1019,449 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
+    if (trace->stream != NULL) {
+	stop_stream(trace->stream);
+	fclose(trace->stream->file);
+	pthread_mutex_destroy(&trace->stream->lock);
+	pthread_cond_destroy(&trace->stream->cond);
+	free(trace->stream->path);
+	free(trace->stream);
+    }
+    if (trace->map != NULL)
+	munmap(trace->map, trace->map_size);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * read_binary_trace - Map the binary trace file at path into memory and
+ *     fill in trace from its header. The requests are decoded once here
+ *     to check them, so that next_op can later decode them unchecked.
+ */
+static void read_binary_trace(trace_t *trace, char *path)
+{
+    int fd;
+    struct stat st;
+    tracehdr_t hdr;
+    const unsigned char *p, *end;
+    unsigned index, size, count;
+    unsigned max_index = 0;
+    unsigned op_index;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	sprintf(msg, "Could not open %s in read_binary_trace", path);
+	unix_error(msg);
+    }
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in read_binary_trace");
+    close(fd);
+    madvise(trace->map, trace->map_size, MADV_SEQUENTIAL);
+
+    memcpy(&hdr, trace->map, sizeof(hdr));
+    trace->sugg_heapsize = hdr.sugg_heapsize; /* not used */
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->weight = hdr.weight;                 /* not used */
+    trace->ops = NULL;
+    trace->packed = trace->map + sizeof(hdr);
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in read_binary_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in read_binary_trace");
+
+    /* Check every packed request, the way read_trace checks text ones */
+    p = trace->packed;
+    end = trace->map + trace->map_size;
+    for (op_index = 0; p < end; op_index++) {
+	count = 1;
+	switch (*p++) {
+	case 'a':
+	case 'r':
+	    if ((p = get_varint(p, end, &index)) == NULL ||
+		(p = get_varint(p, end, &size)) == NULL) {
+		printf("Truncated request in tracefile %s\n", path);
+		exit(1);
+	    }
+	    break;
+	case 'f':
+	    if ((p = get_varint(p, end, &index)) == NULL) {
+		printf("Truncated request in tracefile %s\n", path);
+		exit(1);
+	    }
+	    break;
+	case 'A':
+	    if ((p = get_varint(p, end, &index)) == NULL ||
+		(p = get_varint(p, end, &count)) == NULL ||
+		(p = get_varint(p, end, &size)) == NULL) {
+		printf("Truncated request in tracefile %s\n", path);
+		exit(1);
+	    }
+	    break;
+	case 'F':
+	    if ((p = get_varint(p, end, &index)) == NULL ||
+		(p = get_varint(p, end, &count)) == NULL) {
+		printf("Truncated request in tracefile %s\n", path);
+		exit(1);
+	    }
+	    break;
+	default:
+	    printf("Bogus type character (%c) in tracefile %s\n", 
+		   p[-1], path);
+	    exit(1);
+	}
+	max_index = (index + count - 1 > max_index) ? 
+	    index + count - 1 : max_index;
+    }
+    assert(max_index == trace->num_ids - 1);
+    assert(trace->num_ops == op_index);
+}
+
+/*
+ * open_stream - Set trace up to be streamed from file, whose header has
+ *     not been parsed yet. If file is a binary trace, hdr holds its header.
+ *     Only the blocks arrays are allocated here; requests are read by
+ *     the thread that start_ops starts.
+ */
+static void open_stream(trace_t *trace, FILE *file, char *path, int binary,
+			tracehdr_t *hdr)
+{
+    stream_t *s;
+
+    if ((s = (stream_t *) malloc(sizeof(stream_t))) == NULL)
+	unix_error("malloc failed in open_stream");
+    s->file = file;
+    s->path = strdup(path);
+    s->binary = binary;
+    s->running = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (binary) {
+	trace->sugg_heapsize = hdr->sugg_heapsize; /* not used */
+	trace->num_ids = hdr->num_ids;
+	trace->weight = hdr->weight;                 /* not used */
+	fseek(file, sizeof(tracehdr_t), SEEK_SET);
+    }
+    else {
+	rewind(file);
+	fscanf(file, "%d", &(trace->sugg_heapsize)); /* not used */
+	fscanf(file, "%d", &(trace->num_ids));     
+	fscanf(file, "%d", &(trace->num_ops));       /* not trusted */
+	fscanf(file, "%d", &(trace->weight));        /* not used */
+    }
+    s->data_start = ftell(file);
+    trace->num_ops = 0;
+    trace->ops = NULL;
+    trace->stream = s;
+
+    /* The blocks arrays grow if the header is short of ids */
+    if (trace->num_ids < 1)
+	trace->num_ids = 1;
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in open_stream");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in open_stream");
+}
+
+/*
+ * restart_stream - Stop any reader thread of s and start a new one at the
+ *     first request of the trace
+ */
+static void restart_stream(stream_t *s)
+{
+    stop_stream(s);
+    fseek(s->file, s->data_start, SEEK_SET);
+    s->ready[0] = s->ready[1] = 0;
+    s->stop = 0;
+    if (pthread_create(&s->tid, NULL, fill_windows, s) != 0)
+	unix_error("pthread_create failed in restart_stream");
+    s->running = 1;
+}
+
+/*
+ * stop_stream - Make the reader thread of s, if any, give up and wait
+ *     for it to exit
+ */
+static void stop_stream(stream_t *s)
+{
+    if (!s->running)
+	return;
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->tid, NULL);
+    s->running = 0;
+}
+
+/*
+ * fill_windows - The reader thread of a streamed trace. It fills the two
+ *     windows in turn, each as soon as the replay hands it back, until
+ *     the trace runs out in a short window or it is told to stop.
+ */
+static void *fill_windows(void *ptr)
+{
+    stream_t *s = (stream_t *) ptr;
+    window_t *win;
+    traceop_t *op;
+    int w = 0;
+
+    do {
+	pthread_mutex_lock(&s->lock);
+	while (s->ready[w] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	if (s->stop)
+	    break;
+
+	win = &s->windows[w];
+	win->max_index = -1;
+	for (win->num_ops = 0; win->num_ops < STREAM_WINDOW; win->num_ops++) {
+	    op = &win->ops[win->num_ops];
+	    if (!read_op(s, op))
+		break;
+	    if (op->index + op->count - 1 > win->max_index)
+		win->max_index = op->index + op->count - 1;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->ready[w] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	w ^= 1;
+    } while (win->num_ops == STREAM_WINDOW);
+    return NULL;
+}
+
+/*
+ * read_op - Read the next request of s into op and return 1, or return 0
+ *     at the end of the trace
+ */
+static int read_op(stream_t *s, traceop_t *op)
+{
+    char type[MAXLINE];
+    unsigned index, size, count = 1;
+    int ch;
+
+    if (s->binary) {
+	if ((ch = getc(s->file)) == EOF)
+	    return 0;
+	type[0] = ch;
+	if ((type[0] == 'a' || type[0] == 'r') &&
+	    (!read_varint(s->file, &index) || !read_varint(s->file, &size)))
+	    type[0] = 0;
+	else if (type[0] == 'f' && !read_varint(s->file, &index))
+	    type[0] = 0;
+	else if (type[0] == 'A' && 
+		 (!read_varint(s->file, &index) || 
+		  !read_varint(s->file, &count) || 
+		  !read_varint(s->file, &size)))
+	    type[0] = 0;
+	else if (type[0] == 'F' && 
+		 (!read_varint(s->file, &index) || 
+		  !read_varint(s->file, &count)))
+	    type[0] = 0;
+    }
+    else {
+	if (fscanf(s->file, "%s", type) == EOF)
+	    return 0;
+	if ((type[0] == 'a' || type[0] == 'r') &&
+	    fscanf(s->file, "%u %u", &index, &size) != 2)
+	    type[0] = 0;
+	else if (type[0] == 'f' && fscanf(s->file, "%u", &index) != 1)
+	    type[0] = 0;
+	else if (type[0] == 'A' && 
+		 fscanf(s->file, "%u %u %u", &index, &count, &size) != 3)
+	    type[0] = 0;
+	else if (type[0] == 'F' && 
+		 fscanf(s->file, "%u %u", &index, &count) != 2)
+	    type[0] = 0;
+    }
+
+    switch (type[0]) {
+    case 'a':
+	op->type = ALLOC;
+	op->size = size;
+	break;
+    case 'r':
+	op->type = REALLOC;
+	op->size = size;
+	break;
+    case 'f':
+	op->type = FREE;
+	break;
+    case 'A':
+	op->type = BATCH_ALLOC;
+	op->size = size;
+	break;
+    case 'F':
+	op->type = BATCH_FREE;
+	break;
+    case 0:
+	printf("Truncated request in tracefile %s\n", s->path);
+	exit(1);
+    default:
+	printf("Bogus type character (%c) in tracefile %s\n", 
+	       type[0], s->path);
+	exit(1);
+    }
+    op->index = index;
+    op->count = count;
+    return 1;
+}
+
+/*
+ * wait_window - Wait for the reader thread of s to fill window w
+ */
+static void wait_window(stream_t *s, int w)
+{
+    pthread_mutex_lock(&s->lock);
+    while (!s->ready[w])
+	pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * grow_blocks - Make sure the blocks arrays of trace have a slot for id
+ *     index, doubling them as needed
+ */
+static void grow_blocks(trace_t *trace, int index)
+{
+    int num_ids = trace->num_ids;
+
+    if (index < num_ids)
+	return;
+    while (index >= num_ids)
+	num_ids *= 2;
+    if ((trace->blocks = (char **) 
+	 realloc(trace->blocks, num_ids * sizeof(char *))) == NULL)
+	unix_error("realloc 3 failed in grow_blocks");
+    if ((trace->block_sizes = (size_t *)
+	 realloc(trace->block_sizes, num_ids * sizeof(size_t))) == NULL)
+	unix_error("realloc 4 failed in grow_blocks");
+    trace->num_ids = num_ids;
+}
+
+/*
+ * start_ops - Point c at the first request of trace. A streamed trace is
+ *     reread from the start, and this waits for its first window.
+ */
+static void start_ops(trace_t *trace, opcursor_t *c)
+{
+    stream_t *s = trace->stream;
+
+    c->trace = trace;
+    c->next = 0;
+    c->p = trace->packed;
+    if (s != NULL) {
+	restart_stream(s);
+	c->w = 0;
+	c->base = 0;
+	wait_window(s, 0);
+	grow_blocks(trace, s->windows[0].max_index);
+    }
+}
+
+/*
+ * next_window - Hand the window that c has finished back to the reader
+ *     thread and move c to the next one. Return 0, recording the length
+ *     of the trace, if the finished window was the last.
+ */
+static int next_window(opcursor_t *c)
+{
+    trace_t *trace = c->trace;
+    stream_t *s = trace->stream;
+    window_t *win = &s->windows[c->w];
+
+    c->base += win->num_ops;
+    if (win->num_ops < STREAM_WINDOW) {
+	trace->num_ops = c->base;
+	return 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->ready[c->w] = 0;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    c->w ^= 1;
+    c->next = 0;
+    wait_window(s, c->w);
+    grow_blocks(trace, s->windows[c->w].max_index);
+    return 1;
+}
+
+/*
+ * next_op - Store the request at c in op, advance c past it and return 1,
+ *     or return 0 if c is at the end of its trace
+ */
+static inline int next_op(opcursor_t *c, traceop_t *op)
+{
+    const unsigned char *end;
+    unsigned v;
+    window_t *win;
+
+    if (c->trace->stream != NULL) {
+	win = &c->trace->stream->windows[c->w];
+	while (c->next == win->num_ops) { /* the last window may be empty */
+	    if (!next_window(c))
+		return 0;
+	    win = &c->trace->stream->windows[c->w];
+	}
+	*op = win->ops[c->next++];
+	return 1;
+    }
+
+    if (c->next == c->trace->num_ops)
+	return 0;
+    if (c->p == NULL) {
+	*op = c->trace->ops[c->next++];
+	return 1;
+    }
+    c->next++;
+
+    /* Packed requests were checked by read_binary_trace */
+    end = c->trace->map + c->trace->map_size;
+    switch (*c->p++) {
+    case 'a':
+	op->type = ALLOC;
+	break;
+    case 'r':
+	op->type = REALLOC;
+	break;
+    case 'A':
+	op->type = BATCH_ALLOC;
+	break;
+    case 'F':
+	op->type = BATCH_FREE;
+	break;
+    default:
+	op->type = FREE;
+	break;
+    }
+    c->p = get_varint(c->p, end, &v);
+    op->index = v;
+    op->count = 1;
+    if (op->type == BATCH_ALLOC || op->type == BATCH_FREE) {
+	c->p = get_varint(c->p, end, &v);
+	op->count = v;
+    }
+    if (op->type != FREE && op->type != BATCH_FREE) {
+	c->p = get_varint(c->p, end, &v);
+	op->size = v;
+    }
+    return 1;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -591,7 +1470,7 @@ void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, rangeset_t *ranges) 
 {
     int i, j;
     int index;
@@ -600,8 +1479,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *newp;
     char *oldp;
     char *p;
+    opcursor_t c;
+    traceop_t op;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range set */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -612,11 +1493,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    start_ops(trace, &c);
+    for (i = 0;  next_op(&c, &op);  i++) {
+	index = op.index;
+	size = op.size;
 
-        switch (trace->ops[i].type) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -628,7 +1510,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range set if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -655,10 +1537,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range set */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range set */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -669,14 +1551,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
-	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	    if (!check_fill(newp, index & 0xFF, oldsize)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
-	      }
 	    }
-	    memset(newp, index & 0xFF, size);
+	    memset(newp + oldsize, index & 0xFF, size - oldsize);
 
 	    /* Remember region */
 	    trace->blocks[index] = newp;
@@ -685,54 +1565,161 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from set and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
 	    mm_free(p);
 	    break;
 
-	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
-        }
+        case BATCH_ALLOC: /* mm_malloc_batch */
 
+	    /* The blocks go straight into their slots, and each one is
+	       checked and filled as if it came from mm_malloc */
+	    if (mm_malloc_batch(size, op.count, 
+				(void **) &trace->blocks[index]) != op.count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = index; j < index + op.count; j++) {
+		p = trace->blocks[j];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, j & 0xFF, size);
+		trace->block_sizes[j] = size;
+	    }
+	    break;
+
+        case BATCH_FREE: /* mm_free_batch */
+
+	    /* mm_free_batch reorders the slots, which are all dead after */
+	    for (j = index; j < index + op.count; j++)
+		remove_range(ranges, trace->blocks[j]);
+	    mm_free_batch((void **) &trace->blocks[index], op.count);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_valid");
+        }
+
+	/* Check the whole heap every check_every ops (-c) */
+	if (check_every && (i + 1) % check_every == 0 && mm_checkheap(0) < 0) {
+	    malloc_error(tracenum, i, "mm_checkheap found the heap inconsistent.");
+	    return 0;
+	}
     }
 
+    /* Requests no memory can hold must fail rather than wrap around */
+    if (!check_huge(tracenum, i))
+	return 0;
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
 
+/*
+ * check_huge - Return true if mm_malloc, mm_malloc_batch and mm_realloc
+ *     all fail for sizes within a page of the largest size_t, which no
+ *     heap or mapping can hold. Both a small block and one large enough
+ *     to be mapped are reallocated. Errors are reported as op opnum.
+ */
+static int check_huge(int tracenum, int opnum)
+{
+    size_t huge[] = {(size_t) -1, (size_t) -1 - 8, (size_t) -1 - 4096};
+    size_t sizes[] = {64, 1 << 20};
+    void *ptrs[4];
+    char *p;
+    int j, k;
+
+    for (j = 0; j < (int) (sizeof(huge) / sizeof(huge[0])); j++) {
+	if (mm_malloc(huge[j]) != NULL) {
+	    malloc_error(tracenum, opnum, "mm_malloc of a huge size succeeded.");
+	    return 0;
+	}
+	if (mm_malloc_batch(huge[j], 4, ptrs) != 0) {
+	    malloc_error(tracenum, opnum, 
+			 "mm_malloc_batch of a huge size succeeded.");
+	    return 0;
+	}
+	/* A failed realloc keeps the old block, freed here */
+	for (k = 0; k < (int) (sizeof(sizes) / sizeof(sizes[0])); k++) {
+	    if ((p = mm_malloc(sizes[k])) == NULL) {
+		malloc_error(tracenum, opnum, "mm_malloc failed.");
+		return 0;
+	    }
+	    if (mm_realloc(p, huge[j]) != NULL) {
+		malloc_error(tracenum, opnum, 
+			     "mm_realloc to a huge size succeeded.");
+		return 0;
+	    }
+	    mm_free(p);
+	}
+    }
+    return 1;
+}
+
+/*
+ * check_fill - Return true if all n bytes at p hold the byte c. They are
+ *     compared a word at a time, as the data of every realloc is
+ *     checked this way.
+ */
+static int check_fill(const char *p, int c, int n)
+{
+    unsigned long pattern = 0x0101010101010101UL * (unsigned char) c;
+    unsigned long word;
+    int j = 0;
+
+    for (; j + (int) sizeof(word) <= n; j += sizeof(word)) {
+	memcpy(&word, p + j, sizeof(word));
+	if (word != pattern)
+	    return 0;
+    }
+    for (; j < n; j++)
+	if ((unsigned char) p[j] != (unsigned char) c)
+	    return 0;
+    return 1;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest size in bytes the heap reached while running the student's
+ *   malloc package on the trace. mem_sbrk() lets the package decrement
+ *   the brk pointer, so its final value need not be the high water
+ *   mark of the heap. With --stats, mm_stats is sampled STATS_SAMPLES
+ *   times over the course of the trace, and once more at its end. With
+ *   --snapshot, the heap is written out after each op given to --snap-at,
+ *   or SNAP_SAMPLES times over the trace if there are none.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, rangeset_t *ranges)
 {   
-    int i;
+    int i, j;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    int interval = trace->num_ops / STATS_SAMPLES + 1;
+    int snap_interval = trace->num_ops / SNAP_SAMPLES + 1;
+    int snap_next = 0; /* the first of snap_ops not yet passed */
+    opcursor_t c;
+    traceop_t op;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    start_ops(trace, &c);
+    for (i = 0;  next_op(&c, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op.index;
+	    size = op.size;
 
 	    if ((p = mm_malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
@@ -751,8 +1738,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
@@ -773,7 +1760,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
@@ -785,13 +1772,46 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+	case BATCH_ALLOC: /* mm_malloc_batch */
+	    index = op.index;
+	    size = op.size;
+
+	    if (mm_malloc_batch(size, op.count, 
+				(void **) &trace->blocks[index]) != op.count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = index; j < index + op.count; j++)
+		trace->block_sizes[j] = size;
+
+	    total_size += size * op.count;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+	case BATCH_FREE: /* mm_free_batch */
+	    index = op.index;
+	    for (j = index; j < index + op.count; j++)
+		total_size -= trace->block_sizes[j];
+	    mm_free_batch((void **) &trace->blocks[index], op.count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	if (stats_fp != NULL && i % interval == 0)
+	    write_sample(tracenum, i, total_size);
+	if (snap_fp != NULL && num_snap_ops == 0 && 
+	    (i + 1) % snap_interval == 0)
+	    write_snapshot(tracenum, i);
+	for (; snap_next < num_snap_ops && snap_ops[snap_next] <= i; snap_next++)
+	    if (snap_fp != NULL && snap_ops[snap_next] == i)
+		write_snapshot(tracenum, i);
     }
+    if (stats_fp != NULL)
+	write_sample(tracenum, i, total_size);
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -804,6 +1824,8 @@ static void eval_mm_speed(void *ptr)
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    opcursor_t c;
+    traceop_t op;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
@@ -811,20 +1833,21 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    start_ops(trace, &c);
+    for (i = 0;  next_op(&c, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op.index;
+            size = op.size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = op.index;
+            newsize = op.size;
 	    oldp = trace->blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
@@ -832,14 +1855,271 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op.index;
             block = trace->blocks[index];
             mm_free(block);
             break;
 
+	case BATCH_ALLOC: /* mm_malloc_batch */
+	    index = op.index;
+	    if (mm_malloc_batch(op.size, op.count, 
+				(void **) &trace->blocks[index]) != op.count)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+	    break;
+
+	case BATCH_FREE: /* mm_free_batch */
+	    index = op.index;
+	    mm_free_batch((void **) &trace->blocks[index], op.count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+}
+
+/*
+ * eval_mm_speed_mt - Replay the trace on nthreads threads at once and
+ *    record the aggregate wall-clock time and the per-thread latency in
+ *    stats. The ids of the trace are partitioned round-robin between the
+ *    threads. Like fsecs, the replay is repeated MT_REPS times on a fresh
+ *    heap and the times are averaged. Only the replay itself is timed: the
+ *    aggregate time runs from the first thread starting its ops, after all
+ *    of them have been created, to the last one finishing. The ids of a
+ *    batch request may belong to different threads, so batches are split
+ *    into single mallocs and frees of their ids.
+ */
+static void eval_mm_speed_mt(trace_t *trace, stats_t *stats)
+{
+    int i, j, t, rep, num_ops = 0;
+    pthread_t tids[MAXTHREADS];
+    mt_thread_t threads[MAXTHREADS];
+    pthread_barrier_t start;
+    double begin, end, mt_secs = 0, thread_nsecs = 0;
+    opcursor_t c;
+    traceop_t op;
+
+    /* Give each thread the ops of its own ids */
+    start_ops(trace, &c);
+    while (next_op(&c, &op))
+	num_ops += op.count;
+    for (t = 0; t < nthreads; t++) {
+	threads[t].trace = trace;
+	threads[t].num_ops = 0;
+	threads[t].start = &start;
+	if ((threads[t].ops = 
+	     (traceop_t *)malloc(num_ops * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc failed in eval_mm_speed_mt");
+    }
+    start_ops(trace, &c);
+    for (i = 0; next_op(&c, &op); i++) {
+	if (op.type == BATCH_ALLOC)
+	    op.type = ALLOC;
+	else if (op.type == BATCH_FREE)
+	    op.type = FREE;
+	for (j = 0; j < op.count; j++) {
+	    t = (op.index + j) % nthreads;
+	    threads[t].ops[threads[t].num_ops] = op;
+	    threads[t].ops[threads[t].num_ops].index = op.index + j;
+	    threads[t].ops[threads[t].num_ops++].count = 1;
+	}
+    }
+
+    for (rep = 0; rep < MT_REPS; rep++) {
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_mm_speed_mt");
+
+	/* No thread starts its ops before all of them exist */
+	pthread_barrier_init(&start, NULL, nthreads);
+	for (t = 0; t < nthreads; t++)
+	    if (pthread_create(&tids[t], NULL, eval_mm_thread, &threads[t]) != 0)
+		unix_error("pthread_create failed in eval_mm_speed_mt");
+	for (t = 0; t < nthreads; t++)
+	    pthread_join(tids[t], NULL);
+	pthread_barrier_destroy(&start);
+
+	/* Aggregate time, and per-op latency averaged over the threads */
+	begin = threads[0].begin;
+	end = threads[0].end;
+	for (t = 0; t < nthreads; t++) {
+	    begin = (threads[t].begin < begin) ? threads[t].begin : begin;
+	    end = (threads[t].end > end) ? threads[t].end : end;
+	    if (threads[t].num_ops > 0)
+		thread_nsecs += 1e9 * (threads[t].end - threads[t].begin) / 
+		    threads[t].num_ops / nthreads;
+	}
+	mt_secs += end - begin;
+    }
+
+    stats->threads = nthreads;
+    stats->mt_secs = mt_secs / MT_REPS;
+    stats->op_nsecs = thread_nsecs / MT_REPS;
+
+    for (t = 0; t < nthreads; t++)
+	free(threads[t].ops);
+}
+
+/*
+ * eval_mm_thread - Replay one thread's share of a trace with the mm
+ *    malloc package, timing it from the moment all threads are ready.
+ */
+static void *eval_mm_thread(void *ptr)
+{
+    mt_thread_t *thread = (mt_thread_t *)ptr;
+    traceop_t *ops = thread->ops;
+    trace_t *trace = thread->trace;
+    int i, index;
+    char *p;
+
+    pthread_barrier_wait(thread->start);
+    thread->begin = wall_secs();
+    for (i = 0;  i < thread->num_ops;  i++) {
+	index = ops[i].index;
+        switch (ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(ops[i].size)) == NULL)
+		app_error("mm_malloc error in eval_mm_thread");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(trace->blocks[index], ops[i].size)) == NULL)
+		app_error("mm_realloc error in eval_mm_thread");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(trace->blocks[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_thread");
+        }
+    }
+    thread->end = wall_secs();
+    return NULL;
+}
+
+/*
+ * eval_mm_latency - Replay the trace LAT_REPS times on a fresh heap,
+ *    reading the cycle counter around every mm_malloc, mm_free,
+ *    mm_realloc, mm_malloc_batch and mm_free_batch call, and record
+ *    the percentiles of each request type's log-scale latency
+ *    histogram in stats. The cost of reading the counter itself,
+ *    estimated as the fastest of a few back-to-back reads, is
+ *    subtracted from every sample.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, rep, type, index, n;
+    unsigned long long start, stop, ovhd = ~0ULL;
+    hist_t hists[NUM_OPTYPES];
+    char *p;
+    opcursor_t c;
+    traceop_t op;
+
+    /* Estimate the overhead of a counter read */
+    for (i = 0; i < 100; i++) {
+	start = read_counter();
+	stop = read_counter();
+	if (stop - start < ovhd)
+	    ovhd = stop - start;
+    }
+
+    for (type = 0; type < NUM_OPTYPES; type++)
+	hist_clear(&hists[type]);
+
+    for (rep = 0; rep < LAT_REPS; rep++) {
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_mm_latency");
+	
+	/* Interpret and time each trace request */
+	start_ops(trace, &c);
+	for (i = 0;  next_op(&c, &op);  i++) {
+	    index = op.index;
+	    switch (op.type) {
+
+	    case ALLOC: /* mm_malloc */
+		start = read_counter();
+		p = mm_malloc(op.size);
+		stop = read_counter();
+		if (p == NULL)
+		    app_error("mm_malloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		start = read_counter();
+		p = mm_realloc(trace->blocks[index], op.size);
+		stop = read_counter();
+		if (p == NULL)
+		    app_error("mm_realloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+
+	    case FREE: /* mm_free */
+		start = read_counter();
+		mm_free(trace->blocks[index]);
+		stop = read_counter();
+		break;
+
+	    case BATCH_ALLOC: /* mm_malloc_batch */
+		start = read_counter();
+		n = mm_malloc_batch(op.size, op.count, 
+				    (void **) &trace->blocks[index]);
+		stop = read_counter();
+		if (n != op.count)
+		    app_error("mm_malloc_batch error in eval_mm_latency");
+		break;
+
+	    case BATCH_FREE: /* mm_free_batch */
+		start = read_counter();
+		mm_free_batch((void **) &trace->blocks[index], op.count);
+		stop = read_counter();
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_latency");
+		return;
+	    }
+	    hist_add(&hists[op.type], 
+		     (stop - start > ovhd) ? stop - start - ovhd : 0);
+	}
+    }
+
+    for (type = 0; type < NUM_OPTYPES; type++) {
+	stats->lat_p50[type] = hist_percentile(&hists[type], 0.5);
+	stats->lat_p99[type] = hist_percentile(&hists[type], 0.99);
+	stats->lat_p999[type] = hist_percentile(&hists[type], 0.999);
+    }
+}
+
+/*
+ * eval_mm_perf - Replay the trace PERF_REPS times through eval_mm_speed,
+ *    counting hardware events around each replay, and record the fewest
+ *    of each event seen in one replay in stats. Like the K-best scheme
+ *    of fcyc, taking the minimum discards replays that were disturbed.
+ */
+static void eval_mm_perf(speed_t *params, stats_t *stats)
+{
+    int rep, e;
+    double counts[NUM_PERF_EVENTS];
+
+    for (e = 0; e < NUM_PERF_EVENTS; e++)
+	stats->perf[e] = -1;
+    for (rep = 0; rep < PERF_REPS; rep++) {
+	perf_start();
+	eval_mm_speed(params);
+	perf_stop(counts);
+	for (e = 0; e < NUM_PERF_EVENTS; e++)
+	    if (counts[e] >= 0 && (stats->perf[e] < 0 || counts[e] < stats->perf[e]))
+		stats->perf[e] = counts[e];
+    }
 }
 
 /*
@@ -850,32 +2130,48 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, j, newsize;
     char *p, *newp, *oldp;
+    opcursor_t c;
+    traceop_t op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    start_ops(trace, &c);
+    for (i = 0;  next_op(&c, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op.size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op.index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op.size;
+	    oldp = trace->blocks[op.index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op.index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op.index]);
+	    break;
+
+	case BATCH_ALLOC: /* one malloc per id */
+	    for (j = op.index; j < op.index + op.count; j++)
+		if ((trace->blocks[j] = malloc(op.size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+	    break;
+
+	case BATCH_FREE: /* one free per id */
+	    for (j = op.index; j < op.index + op.count; j++)
+		free(trace->blocks[j]);
 	    break;
 
 	default:
@@ -897,20 +2193,23 @@ static void eval_libc_speed(void *ptr)
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    opcursor_t c;
+    traceop_t op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    start_ops(trace, &c);
+    for (i = 0;  next_op(&c, &op);  i++) {
+        switch (op.type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op.index;
+	    size = op.size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
@@ -919,14 +2218,611 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+	case BATCH_ALLOC: /* one malloc per id */
+	    for (index = op.index; index < op.index + op.count; index++)
+		if ((trace->blocks[index] = malloc(op.size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+	    break;
+
+	case BATCH_FREE: /* one free per id */
+	    for (index = op.index; index < op.index + op.count; index++)
+		free(trace->blocks[index]);
+	    break;
 	}
     }
 }
 
+/*****************************************************************
+ * The following routines evaluate whole traces, either one after
+ * another in this process, or several at once in worker processes
+ * (-w). Each worker is a fork of the driver that evaluates a single
+ * trace on a heap of its own and stores its results straight into
+ * the stats arrays, which are mapped shared for this reason.
+ ****************************************************************/
+
+/*
+ * eval_libc_trace - Evaluate libc malloc on the trace in file and store
+ *     the results in stats. With EVAL_CHECK in parts, the trace is
+ *     checked, and with EVAL_TIME it is timed, if it was found valid.
+ */
+static void eval_libc_trace(char *file, int tracenum, stats_t *stats, 
+			    int parts)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, file);
+    if (parts & EVAL_CHECK) {
+	if (verbose > 1)
+	    printf("Checking libc malloc for correctness, ");
+	stats->valid = eval_libc_valid(trace, tracenum);
+	stats->ops = trace->num_ops; /* known now even if streamed */
+    }
+    if ((parts & EVAL_TIME) && stats->valid) {
+	speed_params.trace = trace;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = time_trace(eval_libc_speed, &speed_params,
+				 &stats->secs_rsd);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_trace - Evaluate the mm malloc package on the trace in file
+ *     and store the results in stats. With EVAL_CHECK in parts, the
+ *     trace is checked for correctness and its utilization measured,
+ *     and with EVAL_TIME, a valid trace is timed, and replayed for -j,
+ *     -L and -p. The heap must have been initialized with mem_init.
+ */
+static void eval_mm_trace(char *file, int tracenum, stats_t *stats, 
+			  rangeset_t *ranges, int parts)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, file);
+    if (parts & EVAL_CHECK) {
+	if (verbose > 1)
+	    printf("Checking mm_malloc for correctness, ");
+	stats->valid = eval_mm_valid(trace, tracenum, ranges);
+	stats->ops = trace->num_ops; /* known now even if streamed */
+	if (stats->valid) {
+	    if (verbose > 1)
+		printf("efficiency, ");
+	    stats->util = eval_mm_util(trace, tracenum, ranges);
+	}
+    }
+    if ((parts & EVAL_TIME) && stats->valid) {
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = time_trace(eval_mm_speed, &speed_params,
+				 &stats->secs_rsd);
+	if (nthreads > 1) {
+	    if (verbose > 1)
+		printf("Replaying on %d threads.\n", nthreads);
+	    eval_mm_speed_mt(trace, stats);
+	}
+	if (latency) {
+	    if (verbose > 1)
+		printf("Recording per-op latencies.\n");
+	    eval_mm_latency(trace, stats);
+	}
+	if (perfctrs) {
+	    if (verbose > 1)
+		printf("Counting hardware events.\n");
+	    eval_mm_perf(&speed_params, stats);
+	}
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_parallel - Evaluate the n traces in files with both packages in
+ *     up to workers processes at once (-w). Checking is not timed, so
+ *     all the traces are first checked by as many workers as were asked
+ *     for, each worker taking on the next trace as soon as it is done.
+ *     The valid traces are then timed with at most one worker per CPU
+ *     that the driver may run on, each pinned to a CPU of its own, so
+ *     that no two timed replays ever share a CPU or migrate.
+ */
+static void eval_parallel(int n, char **files, stats_t *libc_stats, 
+			  stats_t *mm_stats, rangeset_t *ranges)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu, num_cpus = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+	unix_error("sched_getaffinity failed in eval_parallel");
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	if (CPU_ISSET(cpu, &allowed))
+	    cpus[num_cpus++] = cpu;
+
+    run_workers(workers, NULL, EVAL_CHECK, n, files, 
+		libc_stats, mm_stats, ranges);
+    run_workers((workers < num_cpus) ? workers : num_cpus, cpus, EVAL_TIME, 
+		n, files, libc_stats, mm_stats, ranges);
+}
+
+/*
+ * run_workers - Evaluate the given parts of the n traces in files,
+ *     keeping num_workers worker processes busy until all are done. If
+ *     cpus is not NULL, the worker in slot s is pinned to cpus[s]. A
+ *     trace is only timed if it was found valid for either package.
+ *     The errors that each worker found are added to the driver's.
+ */
+static void run_workers(int num_workers, int *cpus, int parts, int n, 
+			char **files, stats_t *libc_stats, stats_t *mm_stats, 
+			rangeset_t *ranges)
+{
+    pid_t pids[MAXWORKERS];  /* worker running in each slot, or 0 */
+    int traces[MAXWORKERS];  /* ... and the trace it is evaluating */
+    int next = 0, running = 0, slot, status;
+    cpu_set_t set;
+    pid_t pid;
+
+    memset(pids, 0, sizeof(pids));
+    while (next < n || running > 0) {
+	/* Start the next traces in the free slots */
+	for (slot = 0; slot < num_workers; slot++) {
+	    if (pids[slot] != 0)
+		continue;
+	    while (next < n && !(parts & EVAL_CHECK) && 
+		   !libc_stats[next].valid && !mm_stats[next].valid)
+		next++;
+	    if (next == n)
+		break;
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in run_workers");
+	    if (pid == 0) {
+		/* The worker counts its own errors and hardware events,
+		   on its own heap */
+		errors = 0;
+		if (cpus != NULL) {
+		    CPU_ZERO(&set);
+		    CPU_SET(cpus[slot], &set);
+		    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			unix_error("sched_setaffinity failed in run_workers");
+		}
+		if (perfctrs && (parts & EVAL_TIME)) {
+		    perf_close();
+		    perf_open();
+		}
+		eval_libc_trace(files[next], next, &libc_stats[next], parts);
+		mem_init();
+		eval_mm_trace(files[next], next, &mm_stats[next], ranges, 
+			      parts);
+		mem_deinit();
+		exit(errors < 255 ? errors : 255);
+	    }
+	    pids[slot] = pid;
+	    traces[slot] = next++;
+	    running++;
+	}
+	if (running == 0)
+	    break;
+
+	/* Wait for any of the workers to finish */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in run_workers");
+	for (slot = 0; slot < num_workers && pids[slot] != pid; slot++)
+	    ;
+	if (slot == num_workers)
+	    continue;
+	pids[slot] = 0;
+	running--;
+	if (WIFEXITED(status))
+	    errors += WEXITSTATUS(status);
+	else {
+	    printf("ERROR: the worker for trace %d (%s) was killed by "
+		   "signal %d\n", traces[slot], files[traces[slot]], 
+		   WTERMSIG(status));
+	    libc_stats[traces[slot]].valid = mm_stats[traces[slot]].valid = 0;
+	    errors++;
+	}
+    }
+}
+
+/*
+ * alloc_stats - Return a zeroed array of n stats_t structs, mapped
+ *     shared, so that the worker processes of -w can fill it in
+ */
+static stats_t *alloc_stats(int n)
+{
+    stats_t *stats;
+
+    stats = mmap(NULL, n * sizeof(stats_t), PROT_READ | PROT_WRITE, 
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+	unix_error("mmap failed in alloc_stats");
+    return stats;
+}
+
+/*****************************************************************
+ * The following routines write the results in machine-readable
+ * form and compare them against the JSON written by an earlier run,
+ * so that different builds of the allocator can be tracked over time.
+ * Throughput is only flagged as regressed when it drops by more than
+ * the timing noise both runs measured, which is why every trace can
+ * be timed repeatedly (-r).
+ ****************************************************************/
+
+/*
+ * time_trace - Time f on the trace in params reps times with fsecs, 
+ *     and return the median time. The relative standard deviation of
+ *     the times is stored in *rsd (0 for a single run).
+ */
+static double time_trace(fsecs_test_funct f, speed_t *params, double *rsd)
+{
+    double secs[MAXREPS], mean = 0, var = 0, t;
+    int i, j;
+
+    for (i = 0; i < reps; i++) {
+	t = fsecs(f, params);
+	/* Insertion sort */
+	for (j = i; j > 0 && secs[j-1] > t; j--)
+	    secs[j] = secs[j-1];
+	secs[j] = t;
+	mean += t;
+    }
+    mean /= reps;
+    for (i = 0; i < reps; i++)
+	var += (secs[i] - mean) * (secs[i] - mean);
+    *rsd = (reps > 1 && mean > 0) ? sqrt(var / (reps - 1)) / mean : 0;
+    if (reps % 2)
+	return secs[reps/2];
+    return (secs[reps/2 - 1] + secs[reps/2]) / 2;
+}
+
+/*
+ * open_output - Open path for writing, where "-" stands for stdout
+ */
+static FILE *open_output(char *path)
+{
+    FILE *fp;
+
+    if (!strcmp(path, "-"))
+	return stdout;
+    if ((fp = fopen(path, "w")) == NULL) {
+	sprintf(msg, "Could not open %s for writing", path);
+	unix_error(msg);
+    }
+    return fp;
+}
+
+/*
+ * write_json - Write the stats of the n traces, named by files, and the
+ *     performance index to path as a JSON object. Every trace is one
+ *     flat object with a "file" key, which is how --compare matches
+ *     traces up. The latency and event fields are only present if -L
+ *     and -p were given; an event that could not be counted is null.
+ */
+static void write_json(char *path, int n, char **files, stats_t *stats, 
+		       double perfindex)
+{
+    FILE *fp = open_output(path);
+    char *names[NUM_OPTYPES] = {"malloc", "free", "realloc", 
+				"malloc_batch", "free_batch"};
+    char *f;
+    int i, type, e;
+
+    fprintf(fp, "{\n  \"perfindex\": %.1f,\n  \"reps\": %d,\n", 
+	    perfindex, reps);
+    fprintf(fp, "  \"traces\": [\n");
+    for (i = 0; i < n; i++) {
+	fprintf(fp, "    {\"trace\": %d, \"file\": \"", i);
+	for (f = files[i]; *f; f++) {
+	    if (*f == '"' || *f == '\\')
+		fputc('\\', fp);
+	    fputc(*f, fp);
+	}
+	fprintf(fp, "\", \"valid\": %d, \"util\": %.6f, \"ops\": %.0f, "
+		"\"secs\": %.9f, \"secs_rsd\": %.6f, \"kops\": %.3f",
+		stats[i].valid, stats[i].util, stats[i].ops, stats[i].secs,
+		stats[i].secs_rsd, 
+		stats[i].valid ? (stats[i].ops/1e3)/stats[i].secs : 0);
+	if (stats[i].threads)
+	    fprintf(fp, ", \"threads\": %d, \"mt_kops\": %.3f, "
+		    "\"op_nsecs\": %.3f", stats[i].threads, 
+		    (stats[i].ops/1e3)/stats[i].mt_secs, stats[i].op_nsecs);
+	if (latency)
+	    for (type = 0; type < NUM_OPTYPES; type++)
+		fprintf(fp, ", \"%s_p50\": %.0f, \"%s_p99\": %.0f, "
+			"\"%s_p999\": %.0f",
+			names[type], stats[i].lat_p50[type],
+			names[type], stats[i].lat_p99[type],
+			names[type], stats[i].lat_p999[type]);
+	if (perfctrs)
+	    for (e = 0; e < NUM_PERF_EVENTS; e++) {
+		if (stats[i].perf[e] >= 0 && stats[i].ops > 0)
+		    fprintf(fp, ", \"%s_per_op\": %.3f", perf_names[e],
+			    stats[i].perf[e]/stats[i].ops);
+		else
+		    fprintf(fp, ", \"%s_per_op\": null", perf_names[e]);
+	    }
+	fprintf(fp, "}%s\n", (i < n - 1) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    if (fp != stdout)
+	fclose(fp);
+}
+
+/*
+ * write_csv - Write the stats of the n traces, named by files, to path
+ *     as CSV, with a header row and the same fields as write_json.
+ *     Values that were not measured are left empty.
+ */
+static void write_csv(char *path, int n, char **files, stats_t *stats)
+{
+    FILE *fp = open_output(path);
+    char *names[NUM_OPTYPES] = {"malloc", "free", "realloc", 
+				"malloc_batch", "free_batch"};
+    int i, type, e;
+
+    fprintf(fp, "trace,file,valid,util,ops,secs,secs_rsd,kops");
+    if (nthreads > 1)
+	fprintf(fp, ",threads,mt_kops,op_nsecs");
+    if (latency)
+	for (type = 0; type < NUM_OPTYPES; type++)
+	    fprintf(fp, ",%s_p50,%s_p99,%s_p999", 
+		    names[type], names[type], names[type]);
+    if (perfctrs)
+	for (e = 0; e < NUM_PERF_EVENTS; e++)
+	    fprintf(fp, ",%s_per_op", perf_names[e]);
+    fprintf(fp, "\n");
+    for (i = 0; i < n; i++) {
+	fprintf(fp, "%d,\"%s\",%d", i, files[i], stats[i].valid);
+	if (stats[i].valid)
+	    fprintf(fp, ",%.6f,%.0f,%.9f,%.6f,%.3f", stats[i].util, 
+		    stats[i].ops, stats[i].secs, stats[i].secs_rsd,
+		    (stats[i].ops/1e3)/stats[i].secs);
+	else
+	    fprintf(fp, ",,,,,");
+	if (nthreads > 1) {
+	    if (stats[i].threads)
+		fprintf(fp, ",%d,%.3f,%.3f", stats[i].threads,
+			(stats[i].ops/1e3)/stats[i].mt_secs, 
+			stats[i].op_nsecs);
+	    else
+		fprintf(fp, ",,,");
+	}
+	if (latency)
+	    for (type = 0; type < NUM_OPTYPES; type++) {
+		if (stats[i].valid && stats[i].lat_p50[type] > 0)
+		    fprintf(fp, ",%.0f,%.0f,%.0f", stats[i].lat_p50[type],
+			    stats[i].lat_p99[type], stats[i].lat_p999[type]);
+		else
+		    fprintf(fp, ",,,");
+	    }
+	if (perfctrs)
+	    for (e = 0; e < NUM_PERF_EVENTS; e++) {
+		if (stats[i].valid && stats[i].perf[e] >= 0)
+		    fprintf(fp, ",%.3f", stats[i].perf[e]/stats[i].ops);
+		else
+		    fprintf(fp, ",");
+	    }
+	fprintf(fp, "\n");
+    }
+    if (fp != stdout)
+	fclose(fp);
+}
+
+/*
+ * parse_snap_ops - Read the comma-separated op indices of --snap-at into
+ *     snap_ops, in increasing order
+ */
+static void parse_snap_ops(char *list)
+{
+    char *end;
+    int i, j, op;
+
+    for (num_snap_ops = 0; *list != '\0'; list = end + (*end == ',')) {
+	op = (int) strtol(list, &end, 10);
+	if (end == list || op < 0 || (*end != ',' && *end != '\0') ||
+	    num_snap_ops == MAXSNAPS) {
+	    fprintf(stderr, "ERROR: --snap-at takes up to %d op indices\n", 
+		    MAXSNAPS);
+	    exit(1);
+	}
+	/* Insertion sort, as there are only a few */
+	for (i = num_snap_ops++; i > 0 && snap_ops[i-1] > op; i--)
+	    snap_ops[i] = snap_ops[i-1];
+	snap_ops[i] = op;
+    }
+    /* Drop duplicates */
+    for (i = j = 0; i < num_snap_ops; i++)
+	if (j == 0 || snap_ops[j-1] != snap_ops[i])
+	    snap_ops[j++] = snap_ops[i];
+    num_snap_ops = j;
+}
+
+/*
+ * write_snapshot - Append a snapshot of the heap, taken after op opnum
+ *     of trace tracenum, to the --snapshot file (see snapfmt.h)
+ */
+static void write_snapshot(int tracenum, int opnum)
+{
+    fflush(snap_fp);
+    if (mm_snapshot(fileno(snap_fp), tracenum, opnum) < 0)
+	unix_error("mm_snapshot failed in write_snapshot");
+}
+
+/*
+ * write_sample - Write a line of mm_stats, taken after op opnum of
+ *     trace tracenum with payload bytes allocated, to the --stats
+ *     file. The first line written is the CSV header. frag is the
+ *     share of free bytes outside the largest free block.
+ */
+static void write_sample(int tracenum, int opnum, int payload)
+{
+    static int header = 0;
+    mm_stats_t st;
+    int class;
+
+    mm_stats(&st);
+    if (!header) {
+	fprintf(stats_fp, "trace,op,payload,heap_bytes,mapped_bytes,"
+		"live_bytes,free_bytes,free_blocks,largest_free,quick_bytes,"
+		"frag,splits,coalesces,extends,fit_searches,fit_steps,"
+		"realloc_inplace,realloc_copies");
+	for (class = 0; class < st.num_classes; class++)
+	    fprintf(stats_fp, ",free_%lu", (unsigned long) st.class_min[class]);
+	fprintf(stats_fp, "\n");
+	header = 1;
+    }
+    fprintf(stats_fp, "%d,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.4f,"
+	    "%lu,%lu,%lu,%lu,%lu,%lu,%lu", tracenum, opnum, payload,
+	    (unsigned long) st.heap_bytes, (unsigned long) st.mapped_bytes,
+	    (unsigned long) st.live_bytes, (unsigned long) st.free_bytes,
+	    (unsigned long) st.free_blocks, (unsigned long) st.largest_free,
+	    (unsigned long) st.quick_bytes, st.free_bytes ?
+	    1.0 - (double) st.largest_free / st.free_bytes : 0.0,
+	    st.splits, st.coalesces, st.extends, st.fit_searches,
+	    st.fit_steps, st.realloc_inplace, st.realloc_copies);
+    for (class = 0; class < st.num_classes; class++)
+	fprintf(stats_fp, ",%lu", (unsigned long) st.class_bytes[class]);
+    fprintf(stats_fp, "\n");
+}
+
+/*
+ * json_field - Find the numeric field key in the flat JSON object
+ *     between obj and end and store it in *val. Returns 1 if the
+ *     field is there and not null, otherwise 0.
+ */
+static int json_field(const char *obj, const char *end, const char *key,
+		      double *val)
+{
+    char pattern[MAXLINE];
+    const char *p;
+    char *q;
+
+    sprintf(pattern, "\"%s\":", key);
+    if ((p = strstr(obj, pattern)) == NULL || p >= end)
+	return 0;
+    *val = strtod(p + strlen(pattern), &q);
+    return q != p + strlen(pattern);
+}
+
+/*
+ * read_baseline - Read back the traces of the JSON results that
+ *     write_json wrote to path into a new array *base, and return how
+ *     many there are. Only the fields --compare needs are kept.
+ */
+static int read_baseline(char *path, baseline_t **base)
+{
+    FILE *fp;
+    char *buf, *p, *end, *q;
+    long size;
+    int n = 0;
+    double val;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open baseline %s", path);
+	unix_error(msg);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    if ((buf = malloc(size + 1)) == NULL)
+	unix_error("malloc failed in read_baseline");
+    if (fread(buf, 1, size, fp) != size)
+	unix_error("fread failed in read_baseline");
+    buf[size] = '\0';
+    fclose(fp);
+
+    *base = NULL;
+    if ((p = strstr(buf, "\"traces\"")) == NULL)
+	app_error("The baseline has no \"traces\" array");
+    /* traces are flat, so each one runs from a '{' to the next '}' */
+    while ((p = strchr(p, '{')) != NULL && (end = strchr(p, '}')) != NULL) {
+	if ((*base = realloc(*base, (n + 1) * sizeof(baseline_t))) == NULL)
+	    unix_error("realloc failed in read_baseline");
+	memset(&(*base)[n], 0, sizeof(baseline_t));
+	if ((q = strstr(p, "\"file\": \"")) != NULL && q < end) {
+	    int len = 0;
+	    for (q += strlen("\"file\": \""); *q != '"' && q < end; q++) {
+		if (*q == '\\')
+		    q++;
+		if (len < MAXLINE - 1)
+		    (*base)[n].file[len++] = *q;
+	    }
+	}
+	if (json_field(p, end, "valid", &val))
+	    (*base)[n].valid = (int) val;
+	json_field(p, end, "util", &(*base)[n].util);
+	json_field(p, end, "kops", &(*base)[n].kops);
+	json_field(p, end, "secs_rsd", &(*base)[n].secs_rsd);
+	n++;
+	p = end + 1;
+    }
+    free(buf);
+    return n;
+}
+
+/*
+ * compare_results - Compare the stats of the n traces, named by files,
+ *     against the baseline JSON at path, trace by trace, matching them
+ *     by file name. A trace is flagged if its utilization dropped by
+ *     more than UTIL_SLACK, or if its throughput dropped by more than
+ *     its noise threshold: NOISE_SIGMAS times the combined relative
+ *     standard deviation of both runs' times, but at least NOISE_FLOOR.
+ *     Prints a table of the comparison and returns the number of
+ *     traces flagged.
+ */
+static int compare_results(char *path, int n, char **files, stats_t *stats)
+{
+    baseline_t *base;
+    int nbase = read_baseline(path, &base);
+    int i, j, flagged = 0;
+    double kops, change, noise;
+
+    printf("\nComparison with baseline %s (%d runs per trace):\n", 
+	   path, reps);
+    printf("%5s%6s%6s%9s%9s%8s%7s\n", 
+	   "trace", "util", "base", "Kops", "base", "change", "noise");
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < nbase && strcmp(base[j].file, files[i]); j++)
+	    ;
+	if (j == nbase || !base[j].valid || !stats[i].valid || 
+	    base[j].kops <= 0) {
+	    printf("%2d   %6s%6s%9s%9s%8s%7s  (%s)\n", i, "-", "-", "-", "-", 
+		   "-", "-", (j == nbase) ? "not in baseline" : "invalid");
+	    continue;
+	}
+	kops = (stats[i].ops/1e3)/stats[i].secs;
+	change = kops/base[j].kops - 1;
+	noise = NOISE_SIGMAS * sqrt(stats[i].secs_rsd * stats[i].secs_rsd +
+				    base[j].secs_rsd * base[j].secs_rsd);
+	if (noise < NOISE_FLOOR)
+	    noise = NOISE_FLOOR;
+	printf("%2d   %5.0f%%%5.0f%%%9.0f%9.0f%+7.1f%%%6.1f%%", i,
+	       stats[i].util*100.0, base[j].util*100.0, kops, base[j].kops,
+	       change*100.0, noise*100.0);
+	if (stats[i].util < base[j].util - UTIL_SLACK || change < -noise) {
+	    printf("  REGRESSION (%s)", 
+		   (stats[i].util < base[j].util - UTIL_SLACK) ? 
+		   (change < -noise ? "util, Kops" : "util") : "Kops");
+	    flagged++;
+	}
+	printf("\n");
+    }
+    if (flagged)
+	printf("%d trace(s) regressed beyond noise\n", flagged);
+    else
+	printf("No regressions beyond noise\n");
+    free(base);
+    return flagged;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -938,55 +2834,184 @@ static void eval_libc_speed(void *ptr)
 static void printresults(int n, stats_t *stats) 
 {
     int i;
+    int threads = 0;
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double mt_secs = 0;
+    double op_nsecs = 0;
+
+    /* Multithreaded columns are shown if any trace was replayed with -j */
+    for (i=0; i < n; i++)
+	if (stats[i].threads > threads)
+	    threads = stats[i].threads;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s  %6s\n", 
+    printf("%5s%7s %5s%8s%10s  %6s", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
+    if (threads)
+	printf("  %3s%8s%8s%6s", "thr", "mtKops", "ns/op", "eff");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f  %6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f  %6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (threads)
+		printf("  %3d%8.0f%8.0f%5.0f%%",
+		       stats[i].threads,
+		       (stats[i].ops/1e3)/stats[i].mt_secs,
+		       stats[i].op_nsecs,
+		       100.0*stats[i].secs/(stats[i].threads*stats[i].mt_secs));
+	    printf("\n");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    mt_secs += stats[i].mt_secs;
+	    op_nsecs += stats[i].op_nsecs;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s  %6s\n", 
+	    printf("%2d%10s%6s%8s%10s  %6s", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
 		   "-");
+	    if (threads)
+		printf("  %3s%8s%8s%6s", "-", "-", "-", "-");
+	    printf("\n");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f  %6.0f\n", 
+	printf("%12s%5.0f%%%8.0f%10.6f  %6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (threads)
+	    printf("  %3d%8.0f%8.0f%5.0f%%",
+		   threads,
+		   (ops/1e3)/mt_secs,
+		   op_nsecs/n,
+		   100.0*secs/(threads*mt_secs));
+	printf("\n");
     }
     else {
-	printf("%12s%6s%8s%10s  %6s\n", 
+	printf("%12s%6s%8s%10s  %6s", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
 	       "-");
+	if (threads)
+	    printf("  %3s%8s%8s%6s", "-", "-", "-", "-");
+	printf("\n");
+    }
+
+}
+
+/*
+ * printlatencies - prints the per-op latency percentiles recorded by
+ *     eval_mm_latency, one row per trace, in the same order as
+ *     printresults
+ */
+static void printlatencies(int n, stats_t *stats)
+{
+    int i, type;
+    /* Columns are in request type order: ALLOC, FREE, REALLOC, ... */
+    char *names[NUM_OPTYPES] = {"malloc", "free", "realloc", 
+				"malloc_batch", "free_batch"};
+
+    printf("%5s", "");
+    for (type = 0; type < NUM_OPTYPES; type++)
+	printf("  %21s", names[type]);
+    printf("\n%5s", "trace");
+    for (type = 0; type < NUM_OPTYPES; type++)
+	printf("  %7s%7s%7s", "p50", "p99", "p999");
+    printf("\n");
+    for (i=0; i < n; i++) {
+	printf("%2d   ", i);
+	for (type = 0; type < NUM_OPTYPES; type++) {
+	    if (stats[i].valid && stats[i].lat_p50[type] > 0)
+		printf("  %7.0f%7.0f%7.0f",
+		       stats[i].lat_p50[type],
+		       stats[i].lat_p99[type],
+		       stats[i].lat_p999[type]);
+	    else
+		printf("  %7s%7s%7s", "-", "-", "-");
+	}
+	printf("\n");
     }
+}
+
+/*
+ * printperf - prints the hardware events counted by eval_mm_perf, per
+ *     op, one row per trace, in the same order as printresults, plus
+ *     instructions per cycle. The total row divides the events of all
+ *     traces by all their ops.
+ */
+static void printperf(int n, stats_t *stats)
+{
+    int i, e;
+    double ops = 0;
+    double totals[NUM_PERF_EVENTS];
+
+    printf("%5s", "trace");
+    for (e = 0; e < NUM_PERF_EVENTS; e++)
+	printf("%9s", perf_names[e]);
+    printf("%7s\n", "IPC");
+    for (e = 0; e < NUM_PERF_EVENTS; e++)
+	totals[e] = 0;
+    for (i = 0; i <= n; i++) {
+	double *counts = (i < n) ? stats[i].perf : totals;
+	double num_ops = (i < n) ? stats[i].ops : ops;
+
+	if (i < n)
+	    printf("%2d   ", i);
+	else
+	    printf("%5s", "Total");
+	if (i < n && !stats[i].valid) {
+	    for (e = 0; e < NUM_PERF_EVENTS; e++)
+		printf("%9s", "-");
+	    printf("%7s\n", "-");
+	    continue;
+	}
+	for (e = 0; e < NUM_PERF_EVENTS; e++) {
+	    if (counts[e] >= 0 && num_ops > 0)
+		printf("%9.1f", counts[e]/num_ops);
+	    else
+		printf("%9s", "-");
+	    /* an event missing from any trace is missing from the total */
+	    if (i < n)
+		totals[e] = (counts[e] >= 0 && totals[e] >= 0) ?
+		    totals[e] + counts[e] : -1;
+	}
+	if (counts[PERF_CYCLES] > 0 && counts[PERF_INSTRUCTIONS] >= 0)
+	    printf("%7.2f\n", counts[PERF_INSTRUCTIONS]/counts[PERF_CYCLES]);
+	else
+	    printf("%7s\n", "-");
+	if (i < n)
+	    ops += stats[i].ops;
+    }
+}
+
+/*
+ * wall_secs - Return the current wall-clock time in seconds
+ */
+static double wall_secs(void)
+{
+    struct timespec ts;
 
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
 }
 
 /* 
@@ -1021,14 +3046,39 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLspHP] [-f <file>] [-t <dir>] [-j <n>] [-r <n>]\n");
+    fprintf(stderr, "               [-c <n>] [-k <n>] [-m <MB>] [-w <n>]\n");
+    fprintf(stderr, "               [--json <file>] [--csv <file>] [--compare <file>]\n");
+    fprintf(stderr, "               [--stats <file>] [--snapshot <file>] [--snap-at <ops>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-c <n>     Check the heap every n ops when checking correctness.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> (.rep or rep2bin output) as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Back the heap with huge pages, if there are any.\n");
+    fprintf(stderr, "\t-j <n>     Also replay each trace on n threads.\n");
+    fprintf(stderr, "\t-k <n>     Check a few heap blocks every n ops of each thread.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print per-op latency percentiles.\n");
+    fprintf(stderr, "\t-m <MB>    Make the heap MB megabytes (default %d).\n", 
+	    (int) (MAX_HEAP >> 20));
+    fprintf(stderr, "\t-p         Print per-op hardware event counts.\n");
+    fprintf(stderr, "\t-P         Fault the heap in before timing anything.\n");
+    fprintf(stderr, "\t-r <n>     Time each trace n times and report the median.\n");
+    fprintf(stderr, "\t-s         Stream traces instead of loading them.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
+    fprintf(stderr, "\t-w <n>     Evaluate up to n traces at once in worker processes,\n");
+    fprintf(stderr, "\t           timing them on one pinned CPU each.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t--json <file>     Write the results as JSON (- for stdout).\n");
+    fprintf(stderr, "\t--csv <file>      Write the results as CSV (- for stdout).\n");
+    fprintf(stderr, "\t--compare <file>  Flag regressions against earlier --json\n");
+    fprintf(stderr, "\t                  results (implies -r %d).\n", COMPARE_REPS);
+    fprintf(stderr, "\t--stats <file>    Write mm_stats samples over each trace as\n");
+    fprintf(stderr, "\t                  CSV (- for stdout).\n");
+    fprintf(stderr, "\t--snapshot <file> Write heap snapshots for mmsnap (%d\n", SNAP_SAMPLES);
+    fprintf(stderr, "\t                  per trace unless --snap-at is given).\n");
+    fprintf(stderr, "\t--snap-at <ops>   Take them after these comma-separated ops.\n");
 }
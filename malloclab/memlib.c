@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,24 +15,127 @@
 #include "memlib.h"
 #include "config.h"
 
+/* size of a huge page, which heaps backed by huge pages are aligned to */
+#define HUGE_PAGE_SIZE (2 * (1 << 20))
+
 /* private variables */
+static size_t mem_max_heap = MAX_HEAP; /* size of the heap region */
+static int mem_options = 0;  /* MEM_ flags asked for with mem_config */
+static int mem_backing = 0;  /* ... and those mem_init could honor */
+static char *mem_region;     /* the mapping holding the heap region */
+static size_t mem_region_size;
+static size_t mem_unit;      /* smallest part of the heap mem_discard frees */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_mapped;    /* bytes in regions handed out by mem_map */
+static size_t mem_peak;      /* largest heap size plus mapped bytes so far */
+
+/* the regions handed out by mem_map, sorted by start */
+typedef struct {
+    char *start;
+    size_t size;
+} region_t;
+static region_t *mem_regions;
+static int mem_num_regions;
+static int mem_max_regions;
+
+static void mem_update_peak(void);
+static int mem_find_region(void *addr);
+static void mem_insert_region(void *start, size_t size);
+static void mem_remove_region(int i);
+
+/*
+ * mem_config - set up how the next mem_init models the heap: max_heap
+ *    bytes of storage (MAX_HEAP if 0), with the MEM_ flags of options.
+ *    MEM_HUGETLB backs the heap with reserved huge pages, and falls back
+ *    to MEM_THP if the system has none to spare, which asks for
+ *    transparent huge pages instead. MEM_PREFAULT touches every page of
+ *    the heap in mem_init, and keeps the pages when the heap shrinks, so
+ *    that no page faults are taken while the heap is in use.
+ */
+void mem_config(size_t max_heap, int options)
+{
+    mem_max_heap = (max_heap != 0) ? max_heap : MAX_HEAP;
+    mem_options = options;
+}
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. The storage is 
+ *    reserved straight from the system rather than with malloc, so that
+ *    memlib also works underneath a malloc built on the mm package, and
+ *    pages are only committed as they are touched, unless mem_config
+ *    asked for them to be faulted in here. A heap of huge pages starts
+ *    on a huge page boundary.
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    size_t pagesize = mem_pagesize();
+    char *p;
+
+    /* reserve the storage we will use to model the available VM */
+    mem_backing = mem_options;
+    mem_unit = pagesize;
+    mem_region = (char *)MAP_FAILED;
+    if (mem_backing & MEM_HUGETLB) {
+	/* reserved up front, as touching a huge page the system cannot
+	   provide raises SIGBUS */
+	mem_region_size = (mem_max_heap + HUGE_PAGE_SIZE - 1) & 
+	    ~(size_t)(HUGE_PAGE_SIZE - 1);
+	mem_region = (char *)mmap(NULL, mem_region_size, 
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				  -1, 0);
+	if (mem_region != (char *)MAP_FAILED)
+	    mem_unit = HUGE_PAGE_SIZE;
+	else
+	    mem_backing = (mem_backing & ~MEM_HUGETLB) | MEM_THP;
+    }
+    if (mem_region == (char *)MAP_FAILED) {
+	mem_region_size = mem_max_heap + 
+	    ((mem_backing & MEM_THP) ? HUGE_PAGE_SIZE : 0);
+	mem_region = (char *)mmap(NULL, mem_region_size, 
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				  -1, 0);
+    }
+    if (mem_region == (char *)MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = mem_region;
+    if (mem_backing & MEM_THP) {
+	mem_start_brk = (char *)(((size_t)mem_region + HUGE_PAGE_SIZE - 1) &
+				 ~(size_t)(HUGE_PAGE_SIZE - 1));
+	if (madvise(mem_start_brk, mem_max_heap, MADV_HUGEPAGE) < 0)
+	    mem_backing &= ~MEM_THP;
+    }
+    if (mem_backing & MEM_PREFAULT)
+	for (p = mem_start_brk; p < mem_start_brk + mem_max_heap; p += pagesize)
+	    *(volatile char *)p = 0;
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_addr = mem_start_brk + mem_max_heap; /* max legal heap address */
+    mem_brk = mem_start_brk;                     /* heap is empty initially */
+    mem_mapped = 0;
+    mem_peak = 0;
+}
+
+/*
+ * mem_backing_flags - return the MEM_ flags mem_init could honor: those
+ *    given to mem_config, except MEM_HUGETLB or MEM_THP if the system
+ *    would not provide them, and MEM_THP if MEM_HUGETLB had to fall back
+ */
+int mem_backing_flags(void)
+{
+    return mem_backing;
+}
+
+/*
+ * mem_max_heapsize - return the number of bytes the heap can grow to
+ */
+size_t mem_max_heapsize(void)
+{
+    return mem_max_heap;
 }
 
 /* 
@@ -39,7 +143,11 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_region, mem_region_size);
+    if (mem_regions != NULL)
+	munmap(mem_regions, mem_max_regions * sizeof(region_t));
+    mem_regions = NULL;
+    mem_num_regions = mem_max_regions = 0;
 }
 
 /*
@@ -48,26 +156,129 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_peak = mem_mapped;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap instead, and the pages it gives
+ *    back are discarded as by mem_discard, unless the heap is prefaulted.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && (mem_brk + incr) < mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+	return (void *)-1;
+    }
+    if ((mem_brk + incr) > mem_max_addr) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (incr < 0 && !(mem_backing & MEM_PREFAULT))
+	mem_discard(mem_brk, -incr);
+    else
+	mem_update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - get a fresh region of size bytes, a multiple of the page
+ *    size, from the system, outside the heap. Returns its start, which
+ *    is page aligned, or (void *)-1 if there is no memory for it.
+ */
+void *mem_map(size_t size)
+{
+    void *start = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (start == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    mem_insert_region(start, size);
+    mem_mapped += size;
+    mem_update_peak();
+    return start;
+}
+
+/*
+ * mem_remap - resize the region of old_size bytes at start, which came
+ *    from mem_map, to new_size bytes, moving it if need be. Returns the
+ *    new start of the region, or (void *)-1 if it is left unchanged.
+ */
+void *mem_remap(void *start, size_t old_size, size_t new_size)
+{
+    void *new_start = mremap(start, old_size, new_size, MREMAP_MAYMOVE);
+    int i;
+
+    if (new_start == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    i = mem_find_region(start);
+    assert(i >= 0 && mem_regions[i].start == start);
+    /* a region that moved may belong elsewhere in the table */
+    if (new_start == start)
+	mem_regions[i].size = new_size;
+    else {
+	mem_remove_region(i);
+	mem_insert_region(new_start, new_size);
+    }
+
+    mem_mapped += new_size - old_size;
+    mem_update_peak();
+    return new_start;
+}
+
+/*
+ * mem_unmap - give the region of size bytes at start, which came from 
+ *    mem_map, back to the system
+ */
+void mem_unmap(void *start, size_t size)
+{
+    int i = mem_find_region(start);
+
+    assert(i >= 0 && mem_regions[i].start == start);
+    mem_remove_region(i);
+    munmap(start, size);
+    mem_mapped -= size;
+}
+
+/*
+ * mem_is_mapped - return true if the len bytes at lo lie within a single
+ *    region handed out by mem_map
+ */
+int mem_is_mapped(void *lo, size_t len)
+{
+    int i = mem_find_region(lo);
+
+    return i >= 0 && 
+	(char *)lo + len <= mem_regions[i].start + mem_regions[i].size;
+}
+
+/*
+ * mem_discard - tell the system that the contents of the len bytes at
+ *    lo are no longer needed, so that it can reclaim the whole pages
+ *    among them. They read back as zeros. A heap of reserved huge pages
+ *    can only be reclaimed a whole huge page at a time.
+ */
+void mem_discard(void *lo, size_t len)
+{
+    size_t pagesize = ((char *)lo >= mem_start_brk && 
+		       (char *)lo < mem_max_addr) ? mem_unit : mem_pagesize();
+    char *start = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *end = (char *)(((size_t)lo + len) & ~(pagesize - 1));
+
+    if (start < end)
+	madvise(start, end - start, MADV_DONTNEED);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +303,99 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_mapsize() - returns the number of bytes in mapped regions
+ */
+size_t mem_mapsize() 
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest number of bytes the heap and
+ *    the mapped regions have taken up together since the heap was last
+ *    reset
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak;
+}
+
+/*
+ * mem_find_region - return the index in mem_regions of the last mapped
+ *    region that starts at or below addr, or -1 if there is none. It is
+ *    the only region that can hold addr, found by a binary search.
+ */
+static int mem_find_region(void *addr)
+{
+    int lo = 0, hi = mem_num_regions;
+
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+
+	if (mem_regions[mid].start <= (char *)addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo - 1;
+}
+
+/*
+ * mem_insert_region - record the region of size bytes at start in
+ *    mem_regions, which is kept in memory from the system, like the
+ *    heap, and grown as needed
+ */
+static void mem_insert_region(void *start, size_t size)
+{
+    int i;
+
+    if (mem_num_regions == mem_max_regions) {
+	size_t old_size = mem_max_regions * sizeof(region_t);
+	void *regions;
+
+	mem_max_regions = mem_max_regions ? 2*mem_max_regions : 256;
+	regions = (mem_regions == NULL) ?
+	    mmap(NULL, mem_max_regions * sizeof(region_t), 
+		 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+	    mremap(mem_regions, old_size, mem_max_regions * sizeof(region_t), 
+		   MREMAP_MAYMOVE);
+	if (regions == MAP_FAILED) {
+	    fprintf(stderr, "mem_map: mremap error\n");
+	    exit(1);
+	}
+	mem_regions = (region_t *)regions;
+    }
+    i = mem_find_region(start) + 1;
+    memmove(&mem_regions[i + 1], &mem_regions[i], 
+	    (mem_num_regions - i) * sizeof(region_t));
+    mem_regions[i].start = start;
+    mem_regions[i].size = size;
+    mem_num_regions++;
+}
+
+/*
+ * mem_remove_region - drop entry i of mem_regions
+ */
+static void mem_remove_region(int i)
+{
+    mem_num_regions--;
+    memmove(&mem_regions[i], &mem_regions[i + 1], 
+	    (mem_num_regions - i) * sizeof(region_t));
+}
+
+/*
+ * mem_update_peak - raise mem_peak to the current footprint if that is
+ *    any larger
+ */
+static void mem_update_peak(void)
+{
+    size_t size = mem_heapsize() + mem_mapped;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,26 @@
 #include <unistd.h>
 
+/* how mem_init backs the heap (see mem_config) */
+#define MEM_HUGETLB  0x1 /* with reserved huge pages */
+#define MEM_THP      0x2 /* with transparent huge pages */
+#define MEM_PREFAULT 0x4 /* with every page faulted in up front */
+
+void mem_config(size_t max_heap, int options);
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void mem_discard(void *lo, size_t len);
+void *mem_map(size_t size);
+void *mem_remap(void *start, size_t old_size, size_t new_size);
+void mem_unmap(void *start, size_t size);
+int mem_is_mapped(void *lo, size_t len);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peak_heapsize(void);
+size_t mem_max_heapsize(void);
+int mem_backing_flags(void);
 size_t mem_pagesize(void);
 
@@ -1,13 +1,21 @@
 /*
- * mm.c - a dynamic memory allocator based on a single free list
+ * mm.c - a dynamic memory allocator based on segregated free lists
  *
  * This package replaces the functionality of libc's malloc, free, and realloc
  * functions with `mm_malloc`, `mm_free`, and `mm_realloc` respectivly. In order
  * to do so, programs must first initialize the program heap by first calling
- * `mm_init`. This dynamic memory allocator features a single free list ordered
- * by a LIFO method. Free blocks are allocated with a first-fit method, and are
- * coalesced immediately. Similar to libc's malloc, allocated blocks are algined
- * to 16 bytes.
+ * `mm_init`. This dynamic memory allocator features segregated free lists, one
+ * per size class, each ordered by a LIFO method. Its placement and coalescing
+ * strategies are chosen at build time in mmpolicy.h. By default (FIT_SEGLIST
+ * with PLACE_FIRST), a request takes the first free block that fits within the
+ * smallest class that can satisfy it. FIT_LIST, FIT_TREE and FIT_INDEX instead
+ * keep a single list, a best-fit tree, or the classes in compact arrays, and
+ * PLACE_BEST takes the smallest block of a list rather than the first. By
+ * default (COALESCE_DEFERRED), freed blocks of up to QUICK_MAX bytes wait on
+ * quick lists and are only coalesced once the free lists run dry, while with
+ * COALESCE_IMMEDIATE every block is coalesced as soon as it is freed. Similar
+ * to libc's malloc, allocated blocks are algined to 16 bytes. The package may
+ * be used from several threads at once.
  *
  * The anatomy of a each block:
  *
@@ -22,28 +30,128 @@
  * |          ...          | /
  * |                       |/
  * |-----------------------|
- * |         FOOTER        |
+ * |  FOOTER (FREE BLOCKS) |
  * |-----------------------|
  *
- * Each block, whether it is allocated or not, has a header and an identical
- * footer. For allocated blocks, this is not necessary, however it chosen as a
- * simple method to check whether or not a block is truly a block -- if a block
- * has a footer identical to its header, then it is _probably_ a true block. For
- * free blocks, both the header and footer are explicitly necessary in order to
- * do boundary tag coalescing. Both the header and footer is 8 bytes.
+ * Free blocks have both a header and a footer, which are explicitly necessary
+ * in order to do boundary tag coalescing. Both the header and footer is 8
+ * bytes. The low bits of the header hold two flags: bit 0 marks the block
+ * itself as allocated, and bit 1 marks the adjacently previous block as
+ * allocated. Because of that second bit, coalescing never needs to read the
+ * footer of an allocated block, so with FOOTER_ELISION set (the default)
+ * allocated blocks carry no footer at all and their payload extends over the
+ * space the footer would have taken. Without FOOTER_ELISION, allocated blocks
+ * also get a footer holding their size and allocation bit, which is a cheap
+ * extra check that a pointer really is a block. The top byte of every header
+ * holds the index of the arena the block belongs to (see below).
+ *
+ * Whether a pointer handed to mm_free or mm_realloc is an allocated block is
+ * checked without any footer: the block must lie aligned inside the heap, be
+ * marked allocated, and the header of the block after it must agree that its
+ * previous block is allocated. Random pointers rarely pass both header tests.
  *
  * Free blocks also store two pointers in the payload area of the block. The
- * first points the previous free block in the free list, and the second points
- * to the next free block in the free list. Each of these pointers is also 8
- * bytes, so the minimum block size possible for a normal block is 32 bytes.
- *
- * There are two special blocks -- the prologue and epilogue blocks. As their
- * respective names suggest, the prologue block is the first block, and the
- * epilogue block is the last block. Both of these blocks are marked as
- * allocated. The prologue block serves as a sentinel for the end of the free
- * list because it is the only allocated block in the free list. The epilogue
- * block is not entirely necessary, but it ensures the structural integrity of
- * the heap itself.
+ * first points the previous free block in its size class list, and the second
+ * points to the next free block in that list. Each of these pointers is also 8
+ * bytes, so the minimum block size possible for a normal block is 32 bytes:
+ * every allocated block must be able to become a free block again. Footer
+ * elision instead pays off in the payload, which for an allocated block is its
+ * size less one word rather than two, so e.g. a 24-byte request fits a 32-byte
+ * block instead of a 48-byte one.
+ *
+ * Free blocks are segregated into NUM_CLASSES size classes. Every size up to
+ * EXACT_CLASS_MAX has a class of its own (one per 16 bytes), so any block in
+ * such a class fits a request of that size exactly. Above that, each power of
+ * two is split into 1 << CLASS_SPLIT_BITS classes, and the last class holds
+ * everything larger. The bitmap flist_bitmap has bit i set exactly when the
+ * list of class i is non-empty. A request first searches its own class, and if
+ * nothing there fits, takes the head of the nearest non-empty larger class,
+ * found with a single bit scan of the bitmap. Every block in a larger class is
+ * big enough, so no further walking is needed. Each hop of such a list is a
+ * load from a block anywhere in the heap, so the walk prefetches the next
+ * node's header while it looks at the current one.
+ *
+ * With FIT_POLICY set to FIT_INDEX, the same classes are kept in compact
+ * arrays instead: per class, one array of free block addresses and one of
+ * their sizes, mapped straight from the system. A search scans the sizes
+ * sequentially, newest first, prefetching INDEX_PREFETCH entries ahead, and
+ * touches the heap only for the block it takes. A free block then stores just
+ * its slot in the arrays, and is removed by moving the last entry into it.
+ * With LINE_ALIGN, requests of at least CACHE_LINE bytes are served like
+ * mm_memalign(CACHE_LINE, size), so small hot objects span as few cache lines
+ * as possible.
+ *
+ * The heap is divided between NUM_ARENAS arenas, each with its own lock, its
+ * own size class lists and its own segments. A segment is a piece of memory
+ * obtained from mem_sbrk on behalf of a single arena:
+ *
+ * ----------------------------------------------------------
+ * | link | header | ...blocks of this arena... | epilogue |
+ * ----------------------------------------------------------
+ *
+ * The link word points to the arena's previous segment, so that mm_checkheap
+ * can find every block. The first block of a segment is marked as having an
+ * allocated predecessor and the epilogue is a zero-sized allocated block, so no
+ * coalescing ever crosses into another arena's memory. When an arena grows and
+ * nobody else has called mem_sbrk since its last growth, the new space simply
+ * extends its last segment. The very first segment of arena 0 starts with the
+ * prologue block, which is allocated as well.
+ *
+ * Requests of MMAP_THRESHOLD bytes or more never touch the arenas. Each one is
+ * given a page-aligned region of its own from mem_map, whose header is marked
+ * MAPPED, and the region is unmapped when the block is freed. Such blocks are
+ * resized with mem_remap, so they grow without copying.
+ *
+ * In front of the arenas, every thread has a small cache (tcache) of recently
+ * freed blocks, one singly-linked bin per block size up to TCACHE_MAX. Cached
+ * blocks stay marked as allocated, so mm_malloc and mm_free can serve them
+ * without taking any lock. mm_malloc otherwise uses the arena the thread was
+ * assigned on its first call, round-robin. A full bin is flushed in a batch:
+ * half of its blocks are returned to their owning arenas, found through the
+ * header's arena index, taking each owner's lock only once. Larger blocks are
+ * freed straight into their owning arena. Slab objects are cached the same
+ * way, in a bin per slab class, which takes TCACHE_SLAB_COUNT / 2 objects
+ * from the slabs under a single lock whenever it runs dry, so small requests
+ * only lock their arena once per batch. A thread's cache is flushed when the
+ * thread exits, and forgotten when mm_init resets the heap. Every lock is
+ * taken around a fork, so that the child, which only has the forking thread,
+ * finds none of them held.
+ *
+ * Coalescing is deferred as well. A block of up to QUICK_MAX bytes returned to
+ * its arena, whether flushed from a tcache or freed directly, is pushed onto
+ * the arena's quick list for its exact size and stays marked as allocated, so
+ * neither its tags nor its neighbors are touched. mm_malloc pops a block of the
+ * right size from there before searching the free lists. Only when the free
+ * lists have no fit, and before the heap is extended, does consolidate free
+ * every quick block for real, coalescing them in one pass.
+ *
+ * mm_memalign hands out blocks whose payload is aligned to any power of two,
+ * including huge ones, from the arenas. The space in front of the first
+ * aligned payload that leaves room for a block is split off and stays free,
+ * so it can be used by later requests. mm_calloc relies on memory that mem_sbrk
+ * hands out for the first time being zero. Each arena remembers in clean the
+ * address from which its most recent segment has never been handed out, so
+ * that everything there but the tags of the free block spanning it is still
+ * zero, and only the part of a block below that mark is cleared.
+ *
+ * The heap shrinks again through a negative mem_sbrk, which only works at its
+ * top. Whenever freeing leaves a free block of at least TRIM_THRESHOLD bytes
+ * at the end of the segment that ends the heap, all but TRIM_PAD bytes of it
+ * are given back, and mm_trim does the same on request. With DISCARD_THRESHOLD
+ * set, large free blocks elsewhere also have their interior pages discarded
+ * with mem_discard, so that the resident size follows the live data.
+ *
+ * mm_malloc_batch hands out many blocks of one size at once, carving them back
+ * to back out of a single free block under one lock, and mm_free_batch frees
+ * an array of blocks in address order, merging blocks that are neighbors into
+ * one before it is coalesced with the rest of the heap.
+ *
+ * mm_stats reports how fragmented the heap is from counters kept as it changes,
+ * and mm_snapshot writes out the whole block map (see snapfmt.h), which mmsnap
+ * renders offline.
+ *
+ * The strategies for placement, splitting, coalescing and heap growth are
+ * picked at build time in mmpolicy.h, and are compiled in with #if.
  *
  * Please see the function declaration comments for specific details on what
  * each function returns and/or does.
@@ -53,9 +161,17 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "mmpolicy.h"
+#include "snapfmt.h"
 
 /* CONSTANTS AND MACROS */
 
@@ -63,55 +179,348 @@
 #define WORD 8
 #define DWORD 16
 #define MIN_BLOCK_SIZE 32
-#define CHUNKSIZE (1 << 12)
+
+//drop the footers of allocated blocks (see the header comment)
+#ifndef FOOTER_ELISION
+#define FOOTER_ELISION 1
+#endif
+
+//bytes of boundary tags an allocated block carries around its payload
+#if FOOTER_ELISION
+#define ALLOC_OVERHEAD WORD
+#else
+#define ALLOC_OVERHEAD DWORD
+#endif
+
+//the fit, split, coalesce and growth strategies are chosen in mmpolicy.h
+#if SPLIT_MIN < MIN_BLOCK_SIZE || SPLIT_MIN % DWORD != 0
+#error "SPLIT_MIN must be a multiple of DWORD of at least MIN_BLOCK_SIZE"
+#endif
+#if GROW_MAX < CHUNKSIZE
+#error "GROW_MAX must be at least CHUNKSIZE"
+#endif
+
+//segregated free list size classes (a single list is a single class)
+#if FIT_POLICY == FIT_SEGLIST || FIT_POLICY == FIT_INDEX
+#define NUM_CLASSES 64
+#else
+#define NUM_CLASSES 1
+#endif
+#if NUM_CLASSES > MM_STATS_CLASSES
+#error "mm_stats_t has too few classes"
+#endif
+#define EXACT_CLASS_MAX 512
+#define EXACT_CLASSES ((EXACT_CLASS_MAX - MIN_BLOCK_SIZE) / DWORD + 1)
+#define CLASS_SPLIT_BITS 2
+
+//number of independently locked arenas (at most 256)
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 4
+#endif
+
+//per-thread cache: largest cached block size and blocks kept per bin
+#define TCACHE_MAX 256
+#define TCACHE_BINS ((TCACHE_MAX - MIN_BLOCK_SIZE) / DWORD + 1)
+#define TCACHE_COUNT 7
+//objects kept per slab class in the cache, half of which are taken from the
+//slabs at once when the class runs dry
+#define TCACHE_SLAB_COUNT 16
+
+//quick lists of blocks returned to an arena, one per size up to QUICK_MAX
+#define QUICK_BINS (QUICK_MAX ? (QUICK_MAX - MIN_BLOCK_SIZE) / DWORD + 1 : 1)
+
+//a free block of at least TRIM_THRESHOLD ending the heap is trimmed back to
+//TRIM_PAD bytes when freed (0 never trims)
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1 << 17)
+#endif
+#define TRIM_PAD (1 << 16)
+
+//free blocks of at least DISCARD_THRESHOLD bytes have their interior pages
+//handed back to the system (0 never discards)
+#ifndef DISCARD_THRESHOLD
+#define DISCARD_THRESHOLD 0
+#endif
+
+//requests of at least MMAP_THRESHOLD bytes get a mapped region of their own
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 17)
+#endif
+//bytes of a mapped region in front of its block's payload
+#define MAPPED_OVERHEAD DWORD
+
+//requests of up to SLAB_MAX bytes are served from slabs of SLAB_SIZE bytes,
+//one slab list per DWORD of object size; SLAB_MAP_PAGES slab-sized pages of
+//the heap can hold slabs
+#define SLAB_MAX 128
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define SLAB_CLASSES (SLAB_MAX / DWORD)
+#define SLAB_MAP_PAGES (1 << 16)
+
+//mm_checkheap matches the free blocks in the heap against those on the lists
+//one by one in a bitmap, instead of only counting them
+#ifndef CHECK_SHADOW
+#define CHECK_SHADOW 0
+#endif
+//blocks checked by each sampled check unless told otherwise (see
+//mm_check_sample)
+#define CHECK_WINDOW 32
+
+//mm_realloc copies at least COPY_STREAM_MIN bytes into memory that has been
+//touched before with non-temporal stores, which bypass the cache
+#ifndef COPY_STREAM_MIN
+#define COPY_STREAM_MIN (1 << 16)
+#endif
+
+//bytes mm_snapshot buffers on the stack between writes
+#define SNAP_BUFSIZE 4096
 
 //returns the larger of two values
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+//returns the smaller of two values
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
-//packs size and allocation bit
-#define PACK(size, alloc) ((size) | (alloc))
+//packs size, allocation bit and previous block's allocation bit
+#define PACK(size, alloc, prev_alloc) ((size) | (alloc) | ((prev_alloc) << 1))
+
+//arena index kept in the top byte of a header
+#define ARENA_SHIFT 56
+#define ARENA_TAG(index) ((unsigned long)(index) << ARENA_SHIFT)
 
 //access word at address p
 #define GET(p) (*(unsigned long *)(p))
 #define SET(p, val) (*(unsigned long *)(p) = (val))
 
-//get size and allocated bit from address p
-#define GET_SIZE(p) (GET(p) & ~0x0F)
+//get size, allocated bits and owning arena from address p
+#define GET_SIZE(p) (GET(p) & ~0x0F & (ARENA_TAG(1) - 1))
 #define GET_ALLOC(p) (GET(p) & 0x01)
+#define GET_PREV_ALLOC(p) ((GET(p) & 0x02) >> 1)
+#define GET_ARENA(p) (&arenas[GET(p) >> ARENA_SHIFT])
+
+//header bit of a block in a mapped region of its own (see map_block)
+#define MAPPED 0x04
+#define GET_MAPPED(p) (GET(p) & MAPPED)
+
+//set or clear the previous block's allocation bit in bp's header
+#define SET_PREV_ALLOC(bp) SET(HDRP(bp), GET(HDRP(bp)) | 0x02)
+#define CLR_PREV_ALLOC(bp) SET(HDRP(bp), GET(HDRP(bp)) & ~0x02)
 
 //get bp's header and footer
 #define HDRP(bp) ((char *)(bp) - WORD)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DWORD)
 
-//get blocks adjacent to bp in memory
+//get blocks adjacent to bp in memory (PREV_BLKP only if the previous is free)
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DWORD)))
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
 
-//get bp's free and next blocks in flist (only if bp is free)
+//get bp's previous and next blocks in its class list (only if bp is free)
 #define PREV_FREE(bp) (*(void **)(bp))
 #define NEXT_FREE(bp) (*(void **)((char *)(bp) + WORD))
 
+//get bp's slot in its class's index arrays (FIT_INDEX only, if bp is free),
+//the fewest slots an array is mapped with, and how many entries ahead of the
+//one find_fit compares it prefetches
+#define INDEX_SLOT(bp) (*(size_t *)(bp))
+#define INDEX_MIN 256
+#define INDEX_PREFETCH 16
+
+//whether a request of size gets a payload aligned to a cache line
+#define LINE_ALIGNED(size) (LINE_ALIGN && (size) >= CACHE_LINE)
+
+//get the slab page holding address p, relative to the start of the heap, and
+//the first object of slab s
+#define SLAB_PAGE(p) (((size_t)(p) >> SLAB_SHIFT) - ((size_t)mem_heap_lo() >> SLAB_SHIFT))
+#define SLAB_OBJECTS(s) ((char *)(s) + ALIGN(sizeof(slab_t)))
+
+//get the next free object in a slab's list (only if the object is free)
+#define SLAB_NEXT(p) (*(void **)(p))
+
+//get bp's children in its arena's tree, and its fixed pseudo-random priority
+//there, derived from its address (FIT_TREE only)
+#define TREE_LEFT(bp) PREV_FREE(bp)
+#define TREE_RIGHT(bp) NEXT_FREE(bp)
+#define TREE_PRIO(bp) (((unsigned long)(bp) >> 4) * 0x9E3779B97F4A7C15UL)
+
+//get the next block in bp's tcache bin (only if bp is cached)
+#define TCACHE_NEXT(bp) (*(void **)(bp))
+#define TCACHE_BIN(size) (((size) - MIN_BLOCK_SIZE) / DWORD)
+
+//get the next block in bp's quick list (only if bp is on one)
+#define QUICK_NEXT(bp) (*(void **)(bp))
+#define QUICK_BIN(size) (((size) - MIN_BLOCK_SIZE) / DWORD)
+
+/* TYPES */
+
+//an independently locked part of the heap
+typedef struct {
+    //protects everything below and every block tagged with this arena
+    pthread_mutex_t lock;
+    //heads of the segregated free lists (flists), one per size class
+    void *flist_heads[NUM_CLASSES];
+    //bit i is set if and only if flist_heads[i] is non-empty (with FIT_INDEX,
+    //if class i's index is)
+    unsigned long flist_bitmap;
+#if FIT_POLICY == FIT_INDEX
+    //per class, the addresses and sizes of its free blocks in index_count of
+    //index_capacity slots of one mapping, the addresses first
+    void **index_blocks[NUM_CLASSES];
+    size_t *index_sizes[NUM_CLASSES];
+    size_t index_count[NUM_CLASSES];
+    size_t index_capacity[NUM_CLASSES];
+#endif
+    //most recent segment, and the address just past its epilogue
+    void *segments;
+    char *seg_end;
+    //ARENA_TAG of this arena's index, or'ed into every header it writes
+    unsigned long tag;
+    //slabs with free objects, one list per object size
+    void *slabs[SLAB_CLASSES];
+    //blocks whose coalescing is deferred, one list per block size, and how
+    //many there are in all
+    void *quick[QUICK_BINS];
+    size_t quick_count;
+    //start of the zero memory at the end of the most recent segment: nothing
+    //from here up to the free block's footer before the epilogue was written
+    char *clean;
+    //bytes in each class list, free blocks in all of them, bytes on the quick
+    //lists, and events counted since mm_init (see mm_stats)
+    size_t class_bytes[NUM_CLASSES];
+    size_t free_blocks;
+    size_t quick_bytes;
+    unsigned long splits;
+    unsigned long coalesces;
+    unsigned long extends;
+    unsigned long fit_searches;
+    unsigned long fit_steps;
+} arena_t;
+
+//the start of a slab, followed by its objects
+typedef struct slab {
+    //neighbors in the arena's list of slabs of this size with free objects
+    struct slab *prev;
+    struct slab *next;
+    //free objects that have been handed out before
+    void *free;
+    //the arena whose block holds the slab
+    arena_t *arena;
+    //object size, objects handed out, objects that fit, and objects that
+    //were never handed out
+    unsigned size;
+    unsigned used;
+    unsigned capacity;
+    unsigned fresh;
+} slab_t;
+
+//a thread's cache of recently freed small blocks
+typedef struct {
+    void *bins[TCACHE_BINS];
+    int counts[TCACHE_BINS];
+    //slab objects, one bin per slab class, kept the same way
+    void *slab_bins[SLAB_CLASSES];
+    int slab_counts[SLAB_CLASSES];
+    //the arena this thread allocates from
+    arena_t *arena;
+    //value of mm_generation when the cache was last reset
+    unsigned long generation;
+} tcache_t;
+
 /* FUNCTION PROTOTYPES */
 
 //interface functions
-void *mm_malloc(size_t size); 
+void *mm_malloc(size_t size);
 void mm_free(void *ptr);
 void *mm_realloc(void *ptr, size_t size);
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+size_t mm_usable_size(void *ptr);
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+void mm_free_batch(void **ptrs, size_t n);
+int mm_trim(size_t pad);
+void mm_stats(mm_stats_t *stats);
+int mm_snapshot(int fd, unsigned id, unsigned op);
 
 //helper functions
-static void *find_fit(size_t size);
-static void *extend_heap(size_t size);
-static void allocate(void *bp, size_t size);
-static void *coalesce(void *bp);
+static void *alloc_block(arena_t *a, size_t size, char **clean);
+static void *carve_blocks(arena_t *a, size_t size, size_t n);
+static int batch_block(arena_t *a, void *bp);
+static int ptr_order(const void *x, const void *y);
+static void *find_fit(arena_t *a, size_t size);
+static void *grow_heap(arena_t *a, size_t size);
+static void *extend_heap(arena_t *a, size_t size);
+static void allocate(arena_t *a, void *bp, size_t size);
+static void place(arena_t *a, void *bp, size_t block_size, size_t size);
+static void free_block(arena_t *a, void *bp);
+static void *coalesce(arena_t *a, void *bp);
+static int trim(arena_t *a, void *bp, size_t pad);
+static int is_allocated_block(void *bp);
+static void set_allocated(void *bp, size_t size);
+static void *resize_block(void *bp, size_t size);
+static void copy_payload(void *dst, const void *src, size_t n);
+
+//quick list functions
+static void defer_free(arena_t *a, void *bp);
+static int consolidate(arena_t *a);
+
+//slab functions
+static void *allocate_aligned(arena_t *a, size_t align, size_t size);
+static slab_t *slab_of(void *p);
+static void *slab_alloc(arena_t *a, int class);
+static void slab_free(slab_t *s, void *p);
+static slab_t *new_slab(arena_t *a, int class);
+static void slab_link(arena_t *a, slab_t *s);
+static void slab_unlink(arena_t *a, slab_t *s);
+
+//mapped block functions
+static void *map_block(size_t size);
+static void *remap_block(void *bp, size_t size);
+static void unmap_block(void *bp);
 
 //linked list functions
-static void flist_remove(void *bp);
-static void flist_add(void *bp);
+static int size_class(size_t size);
+static size_t class_min(int class);
+static void flist_remove(arena_t *a, void *bp);
+static void flist_add(arena_t *a, void *bp);
+#if FIT_POLICY == FIT_INDEX
+static void index_grow(arena_t *a, int class);
+#endif
+
+//tree functions
+#if FIT_POLICY == FIT_TREE
+static int tree_less(void *x, void *y);
+static void *tree_insert(void *t, void *bp);
+static void *tree_remove(void *t, void *bp);
+static void *tree_merge(void *left, void *right);
+static void *tree_best_fit(void *t, size_t size);
+static size_t tree_check(arena_t *a, void *t, void **prev, size_t depth, unsigned long *shadow);
+#endif
+
+//thread cache functions
+static void mm_once(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+static tcache_t *tcache_get(void);
+static void *tcache_refill(tcache_t *tc, int class);
+static void tcache_put_object(tcache_t *tc, slab_t *s, void *p);
+static void tcache_flush(void **bin, int *counts, int count);
+static void tcache_exit(void *tc);
 
 //checkheap functions
-void mm_checkheap(int verbose);
+int mm_checkheap(int verbose);
+void mm_check_sample(unsigned every, unsigned window);
+static void *check_sample(void *bp);
+static int check_range(void *bp, size_t n);
+static int check_block(arena_t *a, void *bp, size_t prev_alloc);
+static unsigned long *shadow_map(void);
+static int shadow_flip(unsigned long *shadow, void *bp);
 static void print_block(void *bp);
 
+//snapshot functions
+static int snap_put(int fd, char *buf, size_t *len, const void *p, size_t n);
+static int snap_segment(int fd, char *buf, size_t *len, arena_t *a, char *seg, unsigned long *marks);
+
 /* GLOBAL VARIABLES */
 
 //team information
@@ -129,8 +538,30 @@ team_t team = {
 };
 //pointer to the prologue block on the heap
 static void *heap_prologue = NULL;
-//pointer to the head of the free list (flist)
-static void *flist_head = NULL;
+//the arenas, and the next one to hand out to a thread
+static arena_t arenas[NUM_ARENAS];
+static unsigned next_arena = 0;
+//serializes the memlib calls that change the heap or the mapped regions
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+//bytes past the start of the heap that mem_sbrk has ever handed out; the
+//memory beyond has never been written (kept across mm_init)
+static size_t heap_high = 0;
+//bit i is set if and only if slab page i of the heap holds a slab
+static unsigned long slab_map[SLAB_MAP_PAGES / 64];
+//bumped by mm_init so that every thread cache notices the heap was reset
+static unsigned long mm_generation = 0;
+//each thread's cache, and the key whose destructor flushes it
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t mm_once_control = PTHREAD_ONCE_INIT;
+//sampled checking: every check_every-th operation of a thread checks
+//check_window blocks (0 never checks), and each thread's count so far
+static unsigned check_every = 0;
+static unsigned check_window = CHECK_WINDOW;
+static __thread unsigned check_ops;
+//reallocations done without and with copying since mm_init (see mm_stats)
+static unsigned long realloc_inplace = 0;
+static unsigned long realloc_copies = 0;
 
 /* MALLOC FUNCTIONS*/
 
@@ -144,35 +575,69 @@ static void *flist_head = NULL;
  *
  *            /-------------- prologue -------------\
  * --------------------------------------------------------------
- * | padding | header | prev_ptr | next_ptr | footer | epilogue |
+ * |  link   | header | prev_ptr | next_ptr | footer | epilogue |
  * --------------------------------------------------------------
  * ||                |||                   |||                 ||
  *
  * In the diagram above, the space between single bars (|) is 8 bytes wide. By
  * extension, double or triple bars (|| or |||) mark the alignment of the heap.
- * The global variables heap_prologue and flist_head are set to the prologue
- * block. In the case of flist_head, the prologue block is used as a sentinel,
- * as it is the only allocated block allowed in the free list.
+ * This is the first segment of arena 0, and its link is NULL as there are no
+ * segments before it. The global variable heap_prologue is set to the prologue
+ * block. Every other arena starts out without any segment, every size class
+ * list, slab list and quick list starts out empty, and so does each arena's
+ * flist_bitmap and the slab map. Every counter reported by mm_stats starts
+ * over. This function must not run while other threads are using the package.
  */
 int mm_init(void) {
+    pthread_once(&mm_once_control, mm_once);
     //get initial space for the heap
     char *heap_start = (char *)mem_sbrk(3*DWORD);
     //error check
     if (heap_start == (char *)-1)
         return -1;
-    //set heap_prologue and flist_head
+    //set heap_prologue and empty every arena
     heap_prologue = (void *)(heap_start + DWORD);
-    flist_head = heap_prologue;
-    //beginning padding
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        memset(arenas[i].flist_heads, 0, sizeof(arenas[i].flist_heads));
+#if FIT_POLICY == FIT_INDEX
+        //keep the arrays mapped for the next heap
+        memset(arenas[i].index_count, 0, sizeof(arenas[i].index_count));
+#endif
+        memset(arenas[i].slabs, 0, sizeof(arenas[i].slabs));
+        memset(arenas[i].quick, 0, sizeof(arenas[i].quick));
+        arenas[i].quick_count = 0;
+        arenas[i].flist_bitmap = 0;
+        arenas[i].segments = NULL;
+        arenas[i].seg_end = NULL;
+        arenas[i].clean = NULL;
+        arenas[i].tag = ARENA_TAG(i);
+        memset(arenas[i].class_bytes, 0, sizeof(arenas[i].class_bytes));
+        arenas[i].free_blocks = 0;
+        arenas[i].quick_bytes = 0;
+        arenas[i].splits = 0;
+        arenas[i].coalesces = 0;
+        arenas[i].extends = 0;
+        arenas[i].fit_searches = 0;
+        arenas[i].fit_steps = 0;
+    }
+    realloc_inplace = 0;
+    realloc_copies = 0;
+    arenas[0].segments = heap_start;
+    arenas[0].seg_end = arenas[0].clean = heap_start + 3*DWORD;
+    memset(slab_map, 0, sizeof(slab_map));
+    //invalidate every thread cache and start handing out arenas from 0
+    mm_generation++;
+    next_arena = 0;
+    //beginning link
     SET(heap_start, 0);
-    //prologue header and footer
-    SET(HDRP(heap_prologue), PACK(MIN_BLOCK_SIZE, 1));
-    SET(FTRP(heap_prologue), PACK(MIN_BLOCK_SIZE, 1));
+    //prologue header and footer (kept regardless of FOOTER_ELISION)
+    SET(HDRP(heap_prologue), PACK(MIN_BLOCK_SIZE, 1, 1));
+    SET(FTRP(heap_prologue), PACK(MIN_BLOCK_SIZE, 1, 0));
     //prologue pointers
-    PREV_FREE(flist_head) = NULL;
-    NEXT_FREE(flist_head) = NULL;
+    PREV_FREE(heap_prologue) = NULL;
+    NEXT_FREE(heap_prologue) = NULL;
     //epilogue
-    SET(HDRP(NEXT_BLKP(heap_prologue)), PACK(0, 1));
+    SET(HDRP(NEXT_BLKP(heap_prologue)), PACK(0, 1, 1));
     return 0;
 }
 
@@ -182,54 +647,122 @@ int mm_init(void) {
  * Returns a pointer to the allocated block if allocation is successful,
  * otherwise, NULL. Starts by modifying the original size parameter. This is
  * subject to the following:
- * (1) space for the header and footer must be added to the size;
+ * (1) space for the boundary tags (ALLOC_OVERHEAD) must be added to the size;
  * (2) the size must be aligned;
  * (3) and the size must be at least the minimum block size.
- * Once the adjusted size is calculated, the free list is searched for a
- * sufficiently-large free block. If no blocks are found, the heap is extended
- * in order to obtain a free block. Once a free block is found, the block is
- * allocated and finally returned.
+ * Requests of at least MMAP_THRESHOLD bytes skip all of this and get a region
+ * of their own from map_block, and requests of up to SLAB_MAX bytes get an
+ * object of the right size from the thread's cache, which tcache_refill refills
+ * from the slabs of the thread's arena under a single lock when it runs out.
+ * Otherwise, once the adjusted size is calculated, a block of exactly that size
+ * is taken from the thread's cache if there is one. Otherwise the thread's
+ * arena is locked, and alloc_block takes a block from it, which is finally
+ * returned. Blocks from the cache or the arena count towards sampled checking
+ * (see mm_check_sample). With LINE_ALIGN, requests of at least CACHE_LINE bytes
+ * instead get a block whose payload is aligned to a cache line, from the cache
+ * if its first block of that size is, and otherwise from the arena by
+ * allocate_aligned.
  */
 void *mm_malloc(size_t size) {
     //error check
     if (size <= 0)
         return NULL;
+    if (size >= MMAP_THRESHOLD)
+        return map_block(size);
+    tcache_t *tc = tcache_get();
+#if LINE_ALIGN
+    //take an aligned block, cached if the bin's first one happens to be
+    if (LINE_ALIGNED(size)) {
+        size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + ALLOC_OVERHEAD));
+        int bin = TCACHE_BIN(adj_size);
+        void *bp = adj_size <= TCACHE_MAX ? tc->bins[bin] : NULL;
+        if (bp != NULL && (size_t)bp % CACHE_LINE == 0) {
+            tc->bins[bin] = TCACHE_NEXT(bp);
+            tc->counts[bin]--;
+            return check_sample(bp);
+        }
+        arena_t *a = tc->arena;
+        pthread_mutex_lock(&a->lock);
+        bp = allocate_aligned(a, CACHE_LINE, adj_size);
+        pthread_mutex_unlock(&a->lock);
+        return check_sample(bp);
+    }
+#endif
+    //take a cached slab object, unless no slab can be made
+    if (size <= SLAB_MAX) {
+        int class = ALIGN(size) / DWORD - 1;
+        void *p = tc->slab_bins[class];
+        if (p == NULL)
+            p = tcache_refill(tc, class);
+        else {
+            tc->slab_bins[class] = SLAB_NEXT(p);
+            tc->slab_counts[class]--;
+        }
+        if (p != NULL)
+            return p;
+    }
     //calculate the adjusted size
-    size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + DWORD));
-    void *bp = find_fit(adj_size);
-    //extend the heap if no free block was found
-    if (bp == NULL) {
-        //add a free block to the free list
-        bp = extend_heap(MAX(CHUNKSIZE, adj_size));
-        //report failure if the block pointer is still NULL
-        if (bp == NULL)
-            return NULL;
+    size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + ALLOC_OVERHEAD));
+    //reuse a cached block without locking
+    if (adj_size <= TCACHE_MAX && tc->bins[TCACHE_BIN(adj_size)] != NULL) {
+        int bin = TCACHE_BIN(adj_size);
+        void *bp = tc->bins[bin];
+        tc->bins[bin] = TCACHE_NEXT(bp);
+        tc->counts[bin]--;
+        return check_sample(bp);
     }
-    //allocate bp with size adj_size and return
-    allocate(bp, adj_size);
-    return bp;
+    arena_t *a = tc->arena;
+    pthread_mutex_lock(&a->lock);
+    void *bp = alloc_block(a, adj_size, NULL);
+    pthread_mutex_unlock(&a->lock);
+    return check_sample(bp);
 }
 
 /*
  * mm_free - free a previously allocated block.
  *
  * The given ptr must be a previously-allocated block, otherwise, this will
- * simply return without having done anything. This is validated by checking
- * whether or not the block reports as allocated. Additionally, the block's
- * header must match the block's footer. This is based on the heuristic that if
- * they do match, the block was probably allocated. This function has undefined
- * behavior for random pointers that pass the test. This function changes
- * ptr's header to reflect that it is free, then calls the coalesce function in
- * order to merge adjacent free blocks, if applicable.
+ * simply return without having done anything. This is validated by
+ * is_allocated_block. This function has undefined behavior for random pointers
+ * that pass the test. Objects in slabs, found through the slab map, are cached
+ * by tcache_put_object, which flushes them back to their slabs in batches.
+ * Blocks up to TCACHE_MAX are pushed onto the thread's cache, flushing half of
+ * the bin first if it is full. Larger blocks are handed to their owning arena
+ * under its lock by defer_free, and mapped blocks are unmapped. Heap blocks
+ * count towards sampled checking before they are freed.
  */
 void mm_free(void *ptr) {
+    //slab objects have no header to check
+    slab_t *slab = slab_of(ptr);
+    if (slab != NULL) {
+        tcache_put_object(tcache_get(), slab, ptr);
+        return;
+    }
     //ensure ptr is valid
-    if (!GET_ALLOC(HDRP(ptr)) || GET(HDRP(ptr)) != GET(FTRP(ptr)))
+    if (!is_allocated_block(ptr))
+        return;
+    if (GET_MAPPED(HDRP(ptr))) {
+        unmap_block(ptr);
+        return;
+    }
+    check_sample(ptr);
+    size_t size = GET_SIZE(HDRP(ptr));
+    //keep small blocks in the thread cache
+    if (size <= TCACHE_MAX) {
+        tcache_t *tc = tcache_get();
+        int bin = TCACHE_BIN(size);
+        if (tc->counts[bin] == TCACHE_COUNT)
+            tcache_flush(&tc->bins[bin], &tc->counts[bin], TCACHE_COUNT / 2 + 1);
+        TCACHE_NEXT(ptr) = tc->bins[bin];
+        tc->bins[bin] = ptr;
+        tc->counts[bin]++;
         return;
-    //set as free and coalesce
-    SET(HDRP(ptr), PACK(GET_SIZE(HDRP(ptr)), 0));
-    SET(FTRP(ptr), PACK(GET_SIZE(HDRP(ptr)), 0));
-    coalesce(ptr);
+    }
+    //return the block to its owner
+    arena_t *a = GET_ARENA(HDRP(ptr));
+    pthread_mutex_lock(&a->lock);
+    defer_free(a, ptr);
+    pthread_mutex_unlock(&a->lock);
 }
 
 /*
@@ -239,145 +772,886 @@ void mm_free(void *ptr) {
  * otherwise, NULL. If the given ptr is already NULL, the call is equivalent to
  * mm_malloc(size). If the given size is 0, the call is equivalent to
  * mm_free(ptr) and will return NULL. The given ptr must be a previously-
- * allocated block, otherwise this function will fail and return NULL. Similarly
- * to mm_malloc, this function calculates an adjusted size. It then compares
- * the adjusted size to the actual size of the block. If the block size can fit
- * the adjusted size, the pointer is simply returned. If not, this function
- * determines if the block adjacently after the current block is free and has
- * enough space for the adjusted size. If so, the free block is removed from the
- * free list and then the original pointer is returned. Otherwise, mm_malloc is
- * used to get a new pointer to a block sufficiently large and memory is copied
- * from the original block to the new one. Finally, the new pointer is returned.
+ * allocated block, otherwise this function will fail and return NULL. A slab
+ * object stays where it is as long as size fits it. A mapped block is resized
+ * by remap_block, without copying. Otherwise, similarly to
+ * mm_malloc, this function calculates an adjusted size and, unless the new
+ * size calls for a mapped block, tries to resize the block where it is with
+ * resize_block. Only when that fails is mm_malloc used to get a new block
+ * sufficiently large and memory copied from the original block to the new
+ * one by copy_payload, as far as both of them reach. Finally, the new pointer
+ * is returned.
  */
 void *mm_realloc(void *ptr, size_t size) {
     //special cases
     if (ptr == NULL)
         return mm_malloc(size);
-    if (GET(HDRP(ptr)) != GET(FTRP(ptr)))
+    slab_t *slab = slab_of(ptr);
+    if (slab == NULL && !is_allocated_block(ptr))
         return NULL;
     if (size <= 0) {
-        free(ptr);
+        mm_free(ptr);
         return NULL;
     }
-    size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + DWORD));
-    size_t block_size = GET_SIZE(HDRP(ptr));
-    //current block is big enough to fit the given size
-    if (adj_size <= block_size) {
-        return ptr;
-    }
-    //adj_size > block_size, so check if next block is free
-    void *next_blk = NEXT_BLKP(ptr);
-    if (!GET_ALLOC(HDRP(next_blk)) &&
-        adj_size <= block_size + GET_SIZE(HDRP(next_blk))) {
-        //use logic similar to allocate, remove next_blk from the free list
-        flist_remove(next_blk);
-        //increase block size
-        block_size += GET_SIZE(HDRP(next_blk));
-        //check if there's enough room for a free block
-        if (block_size - adj_size >= MIN_BLOCK_SIZE) {
-            //set the size of the current block's header and footer
-            SET(HDRP(ptr), PACK(adj_size, 1));
-            SET(FTRP(ptr), PACK(adj_size, 1));
-            //set the remaining space as a free block
-            SET(HDRP(NEXT_BLKP(ptr)), PACK(block_size - adj_size, 0));
-            SET(FTRP(NEXT_BLKP(ptr)), PACK(block_size - adj_size, 0));
-            coalesce(NEXT_BLKP(ptr));
+    size_t payload;
+    void *new_ptr;
+    if (slab != NULL) {
+        if (size <= slab->size) {
+            __atomic_fetch_add(&realloc_inplace, 1, __ATOMIC_RELAXED);
+            return ptr;
         }
-        //simply allocate
-        else {
-            SET(HDRP(ptr), PACK(block_size, 1));
-            SET(FTRP(ptr), PACK(block_size, 1));
+        payload = slab->size;
+    }
+    else {
+        if (GET_MAPPED(HDRP(ptr))) {
+            //the pages are moved, not copied, even when the region moves
+            if ((new_ptr = remap_block(ptr, size)) != NULL)
+                __atomic_fetch_add(&realloc_inplace, 1, __ATOMIC_RELAXED);
+            return new_ptr;
+        }
+        size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + ALLOC_OVERHEAD));
+        payload = GET_SIZE(HDRP(ptr)) - ALLOC_OVERHEAD;
+        if (size < MMAP_THRESHOLD && (new_ptr = resize_block(ptr, adj_size)) != NULL) {
+            __atomic_fetch_add(&realloc_inplace, 1, __ATOMIC_RELAXED);
+            return new_ptr;
         }
     }
+    __atomic_fetch_add(&realloc_copies, 1, __ATOMIC_RELAXED);
     //completely new block must be used
+    new_ptr = mm_malloc(size);
+    //if malloc fails realloc also fails
+    if (new_ptr == NULL)
+        return NULL;
+    //copy the old data over (aligned heap blocks may be larger than the new
+    //mapped one) and free the original block
+    copy_payload(new_ptr, ptr, payload < size ? payload : size);
+    mm_free(ptr);
+    //finally return the new ptr
+    return new_ptr;
+}
+
+/*
+ * mm_memalign - allocate a block of at least size whose payload is aligned.
+ *
+ * Returns a pointer to the allocated block, a multiple of alignment, if
+ * allocation is successful, otherwise, NULL. The given alignment must be a
+ * power of two. Alignments up to ALIGNMENT are what mm_malloc gives anyway.
+ * Any other request is served from the thread's arena by allocate_aligned,
+ * whatever its size, as neither slab objects nor mapped blocks can be moved
+ * to a boundary. The space in front of the aligned payload is split off as a
+ * free block. Such blocks are freed and resized like any other.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    //error check
+    if (size <= 0 || alignment == 0 || (alignment & (alignment - 1)))
+        return NULL;
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+    //the heap cannot grow by that much at once
+    if (size >= INT_MAX || alignment >= INT_MAX)
+        return NULL;
+    size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + ALLOC_OVERHEAD));
+    arena_t *a = tcache_get()->arena;
+    pthread_mutex_lock(&a->lock);
+    void *bp = allocate_aligned(a, alignment, adj_size);
+    pthread_mutex_unlock(&a->lock);
+    return bp;
+}
+
+/*
+ * mm_aligned_alloc - allocate a block of at least size aligned to alignment.
+ *
+ * The same as mm_memalign. Like C17's aligned_alloc, size need not be a
+ * multiple of alignment.
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * mm_usable_size - returns how many bytes of the block ptr can be used.
+ *
+ * This is at least the size ptr was allocated with, and may be more: a slab
+ * object's whole size, or a block's size or mapped region less its overhead.
+ * Returns 0 for NULL and for pointers that are not allocated blocks.
+ */
+size_t mm_usable_size(void *ptr) {
+    slab_t *slab = slab_of(ptr);
+    if (slab != NULL)
+        return slab->size;
+    if (!is_allocated_block(ptr))
+        return 0;
+    if (GET_MAPPED(HDRP(ptr)))
+        return GET_SIZE(HDRP(ptr)) - MAPPED_OVERHEAD;
+    return GET_SIZE(HDRP(ptr)) - ALLOC_OVERHEAD;
+}
+
+/*
+ * mm_calloc - allocate a zeroed block for an array of nmemb elements of size.
+ *
+ * Returns a pointer to the allocated block if allocation is successful,
+ * otherwise, NULL, also when nmemb * size overflows. Mapped blocks are fresh
+ * from the system and zero already. Slab objects, blocks reused from the
+ * thread's cache and, with LINE_ALIGN, cache-line-aligned blocks come from
+ * mm_malloc and are cleared in full. Otherwise the block is taken from the
+ * thread's arena by alloc_block, which reports the arena's clean mark from
+ * before the block was taken: only the part of the payload below it, and the
+ * footer a free block had left at its end, need to be cleared.
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+    //error check
+    if (nmemb == 0 || size == 0 || nmemb > (size_t)-1 / size)
+        return NULL;
+    size *= nmemb;
+    if (size >= MMAP_THRESHOLD)
+        return map_block(size);
+    tcache_t *tc = tcache_get();
+    size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + ALLOC_OVERHEAD));
+    if (size <= SLAB_MAX || LINE_ALIGNED(size) ||
+        (adj_size <= TCACHE_MAX && tc->bins[TCACHE_BIN(adj_size)] != NULL)) {
+        void *p = mm_malloc(size);
+        if (p != NULL)
+            memset(p, 0, size);
+        return p;
+    }
+    arena_t *a = tc->arena;
+    char *clean;
+    pthread_mutex_lock(&a->lock);
+    char *bp = alloc_block(a, adj_size, &clean);
+    pthread_mutex_unlock(&a->lock);
+    if (bp == NULL)
+        return NULL;
+    //clear what may have been written before
+    char *end = bp + GET_SIZE(HDRP(bp)) - ALLOC_OVERHEAD;
+    if (end <= clean)
+        memset(bp, 0, end - bp);
     else {
-        //save the original ptr
-        void *old_ptr = ptr;
-        //get new block that is sufficiently big
-        ptr = mm_malloc(size);
-        //if malloc fails realloc also fails
-        if (ptr == NULL)
-            return NULL;
-        //copy the old data over and free the original block
-        memcpy(ptr, old_ptr, block_size - DWORD);
-        mm_free(old_ptr);
+        if (clean > bp)
+            memset(bp, 0, clean - bp);
+#if FOOTER_ELISION
+        SET(FTRP(bp), 0);
+#endif
+    }
+    return bp;
+}
+
+/*
+ * mm_malloc_batch - allocate n blocks of at least size into ptrs.
+ *
+ * Returns the number of blocks allocated, which is 0 if size is 0 and n unless
+ * memory ran out. Every entry of ptrs not allocated is set to NULL. Slab
+ * objects are all taken under a single lock of the thread's arena, and mapped
+ * blocks are mapped one by one. Other blocks bypass the thread's cache and are
+ * allocated under a single lock as well: carve_blocks takes all n of them from
+ * one free block of the arena, back to back, writing their headers in a single
+ * pass. If no free block is large enough for all of them, they are allocated
+ * one at a time by alloc_block instead, so that the holes of the heap are
+ * filled before it grows. Whatever could not be had either way is left to
+ * mm_malloc, as are all blocks to be aligned to a cache line with LINE_ALIGN.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t i = 0;
+    //error check
+    if (size <= 0) {
+        for (; i < n; i++)
+            ptrs[i] = NULL;
+        return 0;
+    }
+    tcache_t *tc = tcache_get();
+    arena_t *a = tc->arena;
+    size_t adj_size = MAX(MIN_BLOCK_SIZE, ALIGN(size + ALLOC_OVERHEAD));
+    //aligned blocks are only had one by one
+    if (LINE_ALIGNED(size))
+        ;
+    else if (size <= SLAB_MAX) {
+        pthread_mutex_lock(&a->lock);
+        for (; i < n && (ptrs[i] = slab_alloc(a, ALIGN(size) / DWORD - 1)) != NULL; i++)
+            ;
+        pthread_mutex_unlock(&a->lock);
+    }
+    else if (size < MMAP_THRESHOLD && n > 1 && adj_size <= (size_t)-1 / n) {
+        pthread_mutex_lock(&a->lock);
+        char *bp = carve_blocks(a, adj_size, n);
+        if (bp != NULL)
+            for (; i < n; i++, bp += adj_size)
+                ptrs[i] = bp;
+        //fill the holes of the heap before growing it
+        else
+            for (; i < n && (ptrs[i] = alloc_block(a, adj_size, NULL)) != NULL; i++)
+                ;
+        pthread_mutex_unlock(&a->lock);
+        for (size_t j = 0; j < i; j++)
+            check_sample(ptrs[j]);
+    }
+    //fall back to single allocations
+    for (; i < n && (ptrs[i] = mm_malloc(size)) != NULL; i++)
+        ;
+    for (size_t j = i + 1; j < n; j++)
+        ptrs[j] = NULL;
+    return i;
+}
+
+/*
+ * mm_free_batch - free the n blocks in ptrs.
+ *
+ * Every entry must be NULL or a block that mm_free would accept, and ptrs is
+ * left sorted by address. Slab objects and mapped blocks are freed as mm_free
+ * frees them. Heap blocks bypass the thread's cache. After sorting, the blocks
+ * of one arena come in stretches, each freed under a single lock of their
+ * owner, and blocks that are neighbors in memory come one after the other:
+ * every run of them is merged into one allocated block, which is freed and
+ * coalesced only once, by free_block. A block without a neighbor in the batch
+ * is handed to defer_free, as mm_free would.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    qsort(ptrs, n, sizeof(*ptrs), ptr_order);
+    //count the heap blocks towards sampled checking before any is freed
+    for (size_t i = 0; check_every != 0 && i < n; i++)
+        if (batch_block(NULL, ptrs[i]))
+            check_sample(ptrs[i]);
+    size_t i = 0;
+    while (i < n) {
+        char *bp = ptrs[i++];
+        slab_t *slab = slab_of(bp);
+        if (slab != NULL) {
+            tcache_put_object(tcache_get(), slab, bp);
+            continue;
+        }
+        if (!is_allocated_block(bp))
+            continue;
+        if (GET_MAPPED(HDRP(bp))) {
+            unmap_block(bp);
+            continue;
+        }
+        //free the stretch of blocks of bp's owner
+        arena_t *a = GET_ARENA(HDRP(bp));
+        pthread_mutex_lock(&a->lock);
+        while (bp != NULL) {
+            //absorb the neighbors freed along with bp
+            size_t size = GET_SIZE(HDRP(bp));
+            char *run_end = bp + size;
+            while (i < n && ptrs[i] == run_end && batch_block(a, run_end)) {
+                run_end += GET_SIZE(HDRP(run_end));
+                i++;
+            }
+            if (run_end == bp + size)
+                defer_free(a, bp);
+            else {
+                set_allocated(bp, run_end - bp);
+                free_block(a, bp);
+            }
+            bp = (i < n && batch_block(a, ptrs[i])) ? ptrs[i++] : NULL;
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+/*
+ * mm_stats - fills in stats with the state of the heap and counts of events.
+ *
+ * Most of it is kept up to date as the heap changes, so this only adds up the
+ * counters of every arena, taking each arena's lock in turn. Only the largest
+ * free block is looked for: in the highest non-empty class of each arena, at
+ * the right end of its tree with FIT_TREE, or in its whole list with FIT_LIST.
+ * Live bytes are all heap and mapped bytes that are neither free nor deferred,
+ * so they include boundary tags and blocks held in thread caches and slabs.
+ * Reallocations count as done in place unless the data had to be copied, so
+ * a remapped block counts even if it moved, and a failed one counts in neither.
+ */
+void mm_stats(mm_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->num_classes = NUM_CLASSES;
+    for (int class = 0; class < NUM_CLASSES; class++)
+        stats->class_min[class] = class_min(class);
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        for (int class = 0; class < NUM_CLASSES; class++) {
+            stats->class_bytes[class] += a->class_bytes[class];
+            stats->free_bytes += a->class_bytes[class];
+        }
+        stats->free_blocks += a->free_blocks;
+        stats->quick_bytes += a->quick_bytes;
+        stats->splits += a->splits;
+        stats->coalesces += a->coalesces;
+        stats->extends += a->extends;
+        stats->fit_searches += a->fit_searches;
+        stats->fit_steps += a->fit_steps;
+        //the largest free block is in the highest non-empty class
+        void *bp = NULL;
+#if FIT_POLICY == FIT_TREE
+        for (bp = a->flist_heads[0]; bp != NULL && TREE_RIGHT(bp) != NULL; bp = TREE_RIGHT(bp))
+            ;
+#elif FIT_POLICY == FIT_INDEX
+        if (a->flist_bitmap != 0) {
+            int class = 63 - __builtin_clzl(a->flist_bitmap);
+            for (size_t i = 0; i < a->index_count[class]; i++)
+                stats->largest_free = MAX(stats->largest_free, a->index_sizes[class][i]);
+        }
+#else
+        if (a->flist_bitmap != 0)
+            bp = a->flist_heads[63 - __builtin_clzl(a->flist_bitmap)];
+#endif
+        for (; bp != NULL; bp = FIT_POLICY == FIT_TREE ? NULL : NEXT_FREE(bp))
+            stats->largest_free = MAX(stats->largest_free, GET_SIZE(HDRP(bp)));
+        pthread_mutex_unlock(&a->lock);
     }
-    //finally return the ptr
-    return ptr;
+    stats->heap_bytes = mem_heapsize();
+    stats->mapped_bytes = mem_mapsize();
+    stats->live_bytes = stats->heap_bytes + stats->mapped_bytes -
+        stats->free_bytes - stats->quick_bytes;
+    stats->realloc_inplace = __atomic_load_n(&realloc_inplace, __ATOMIC_RELAXED);
+    stats->realloc_copies = __atomic_load_n(&realloc_copies, __ATOMIC_RELAXED);
 }
 
+/*
+ * mm_snapshot - writes the layout of the heap to fd in the format of snapfmt.h.
+ *
+ * Returns 0 on success, otherwise, -1. The snapshot is labeled with id and op.
+ * Each arena's segments are written while its lock is held, one arena at a
+ * time, so a snapshot taken while other threads run is only consistent within
+ * each arena. Blocks on quick lists and in the calling thread's cache are told
+ * apart from allocated ones by marking them first in the checker's bitmap, so
+ * a snapshot must not be taken while mm_checkheap runs.
+ */
+int mm_snapshot(int fd, unsigned id, unsigned op) {
+    char buf[SNAP_BUFSIZE];
+    size_t len = 0;
+    unsigned long *marks = shadow_map();
+    if (marks == NULL)
+        return -1;
+    //a cached block is marked at its payload, a deferred one a DWORD after
+    tcache_t *tc = &tcache;
+    for (int bin = 0; bin < TCACHE_BINS && tc->generation == mm_generation; bin++)
+        for (void *bp = tc->bins[bin]; bp != NULL; bp = TCACHE_NEXT(bp))
+            shadow_flip(marks, bp);
+    snaphdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    hdr.id = id;
+    hdr.op = op;
+    hdr.heap_bytes = mem_heapsize();
+    hdr.mapped_bytes = mem_mapsize();
+    int rc = snap_put(fd, buf, &len, &hdr, sizeof(hdr));
+    for (int i = 0; i < NUM_ARENAS && rc == 0; i++) {
+        arena_t *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        for (int bin = 0; bin < QUICK_BINS && QUICK_MAX; bin++)
+            for (void *bp = a->quick[bin]; bp != NULL; bp = QUICK_NEXT(bp))
+                shadow_flip(marks, (char *)bp + DWORD);
+        for (char *seg = a->segments; seg != NULL && rc == 0; seg = (char *)GET(seg))
+            rc = snap_segment(fd, buf, &len, a, seg, marks);
+        pthread_mutex_unlock(&a->lock);
+    }
+    snapseg_t end;
+    memset(&end, 0, sizeof(end));
+    if (rc == 0)
+        rc = snap_put(fd, buf, &len, &end, sizeof(end));
+    if (rc == 0 && len > 0)
+        rc = snap_put(fd, buf, &len, NULL, 0);
+    return rc;
+}
+
+/*
+ * mm_trim - gives free memory at the end of the heap back to the system.
+ *
+ * Returns 1 if any memory was released, otherwise, 0. The calling thread's
+ * cache is flushed first, so that its blocks can coalesce. Then every arena is
+ * locked in turn and its quick lists consolidated, and if its most recent
+ * segment ends the heap with a free block, that block is trimmed down to pad
+ * bytes by trim. Only whole pages are released.
+ */
+int mm_trim(size_t pad) {
+    int released = 0;
+    tcache_exit(tcache_get());
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        consolidate(a);
+        //the block before the epilogue, if it is free
+        if (a->seg_end != NULL && !GET_PREV_ALLOC(HDRP(a->seg_end)))
+            released |= trim(a, PREV_BLKP(a->seg_end), pad);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return released;
+}
 
 /* HELPER FUNCTIONS */
 
+/*
+ * alloc_block - allocate a block of size from arena a
+ *
+ * Returns a pointer to the allocated block, otherwise, NULL. The given size
+ * must be adjusted already. A block of exactly that size is taken from a's
+ * quick list if there is one. Otherwise the free lists are searched for a
+ * sufficiently-large free block. If no blocks are found, the quick lists are
+ * consolidated and the search is repeated, and if that fails too, the heap is
+ * grown by grow_heap in order to obtain a free block, which is then allocated.
+ * If clean is not NULL, it is set to a's clean mark from right before the block
+ * was allocated. The caller must hold a's lock.
+ */
+static void *alloc_block(arena_t *a, size_t size, char **clean) {
+    //reuse a block whose coalescing was deferred
+    if (size <= QUICK_MAX && a->quick[QUICK_BIN(size)] != NULL) {
+        int bin = QUICK_BIN(size);
+        void *bp = a->quick[bin];
+        a->quick[bin] = QUICK_NEXT(bp);
+        a->quick_count--;
+        a->quick_bytes -= size;
+        if (clean != NULL)
+            *clean = a->clean;
+        return bp;
+    }
+    void *bp = find_fit(a, size);
+    if (bp == NULL && consolidate(a))
+        bp = find_fit(a, size);
+    //extend the heap if no free block was found, and report failure if that
+    //fails as well
+    if (bp == NULL && (bp = grow_heap(a, size)) == NULL)
+        return NULL;
+    if (clean != NULL)
+        *clean = a->clean;
+    //allocate bp with size and return
+    allocate(a, bp, size);
+    return bp;
+}
+
+/*
+ * carve_blocks - allocate n adjacent blocks of size from arena a
+ *
+ * Returns a pointer to the first of the blocks, which follow each other every
+ * size bytes, otherwise, NULL. The given size must be adjusted already, and n
+ * must be at least 2. A free block of n times size is found as in alloc_block,
+ * consolidating the quick lists if need be, but the heap is never grown for
+ * it. The first block keeps the free block's header bits, the
+ * headers of the ones in between are written in one pass, and the last one
+ * is placed by place, which splits off whatever is left of the free block and
+ * moves the clean mark past all of them. The caller must hold a's lock.
+ */
+static void *carve_blocks(arena_t *a, size_t size, size_t n) {
+    size_t total = size * n;
+    void *bp = find_fit(a, total);
+    if (bp == NULL && consolidate(a))
+        bp = find_fit(a, total);
+    if (bp == NULL)
+        return NULL;
+    flist_remove(a, bp);
+    size_t block_size = GET_SIZE(HDRP(bp));
+    set_allocated(bp, size);
+    char *p = NEXT_BLKP(bp);
+    for (size_t i = 1; i < n; i++, p += size) {
+        SET(HDRP(p), PACK(size, 1, 1) | a->tag);
+#if !FOOTER_ELISION
+        SET(FTRP(p), PACK(size, 1, 0));
+#endif
+    }
+    //the last block takes the rest
+    p -= size;
+    place(a, p, block_size - (n - 1) * size, size);
+    return bp;
+}
+
+/*
+ * batch_block - tells whether mm_free_batch frees bp into an arena
+ *
+ * Returns nonzero if bp is an allocated heap block, neither a slab object nor
+ * mapped, that is owned by arena a, or by any arena if a is NULL.
+ */
+static int batch_block(arena_t *a, void *bp) {
+    return slab_of(bp) == NULL && is_allocated_block(bp) && !GET_MAPPED(HDRP(bp)) &&
+        (a == NULL || GET_ARENA(HDRP(bp)) == a);
+}
+
+/*
+ * ptr_order - orders the pointers at x and y by address, for qsort
+ */
+static int ptr_order(const void *x, const void *y) {
+    char *p = *(char * const *)x;
+    char *q = *(char * const *)y;
+    return (p > q) - (p < q);
+}
+
 /*
  * find_fit - find a freeblock large enough to fit size
  *
- * Returns the pointer to a free block large enough to fit the given size,
- * otherwise NULL. This function iterates over the free list and examine's each
- * free block's size. It returns the first block found that is large enough to
- * fit size. If the function finishes looking over the list without returning,
- * then there are no blocks large enough, so NULL is returned.
+ * Returns the pointer to a free block of arena a large enough to fit the given
+ * size, otherwise NULL. This function first iterates over the list of size's
+ * own class and returns the first block found that is large enough to fit
+ * size, or with PLACE_BEST the smallest one, stopping early at an exact fit.
+ * For exact classes that is always the head of the list. If none of them fit,
+ * every block in a larger class does, so the head of the nearest non-empty
+ * larger class is returned, as found by a bit scan of flist_bitmap. If there
+ * is no such class, then there are no blocks large enough, so NULL is
+ * returned. With FIT_POLICY set to FIT_LIST, the one class holds every block,
+ * so this is a first-fit (or best-fit) search of a single list. With FIT_TREE,
+ * the smallest block that fits is found in the tree instead. With FIT_INDEX,
+ * the class's index is searched the same way from its newest entry down,
+ * comparing the cached sizes, and a larger class gives its newest entry.
+ * Searches and the list nodes they look at are counted. The caller must hold
+ * a's lock.
+ */
+static void *find_fit(arena_t *a, size_t size) {
+#if FIT_POLICY == FIT_TREE
+    a->fit_searches++;
+    return tree_best_fit(a->flist_heads[0], size);
+#endif
+    int class = size_class(size);
+    void *best = NULL;
+    a->fit_searches++;
+#if FIT_POLICY == FIT_INDEX
+    //scan the sizes of size's own class, newest first
+    size_t *sizes = a->index_sizes[class];
+#if PLACE_POLICY == PLACE_BEST
+    size_t best_size = 0;
+#endif
+    for (size_t i = a->index_count[class]; i-- > 0; ) {
+        if (i >= INDEX_PREFETCH)
+            __builtin_prefetch(&sizes[i - INDEX_PREFETCH]);
+        a->fit_steps++;
+        if (sizes[i] >= size) {
+#if PLACE_POLICY == PLACE_FIRST
+            return a->index_blocks[class][i];
+#else
+            if (best == NULL || sizes[i] < best_size) {
+                best = a->index_blocks[class][i];
+                best_size = sizes[i];
+            }
+            if (sizes[i] == size)
+                break;
+#endif
+        }
+    }
+#else
+    //iterate over the list of size's own class
+    for (void *bp = a->flist_heads[class]; bp != NULL; bp = NEXT_FREE(bp)) {
+        //start loading the next node while this one is looked at
+        if (NEXT_FREE(bp) != NULL)
+            __builtin_prefetch(HDRP(NEXT_FREE(bp)));
+        a->fit_steps++;
+        if (GET_SIZE(HDRP(bp)) >= size) {
+#if PLACE_POLICY == PLACE_FIRST
+            return bp;
+#else
+            if (best == NULL || GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(best)))
+                best = bp;
+            if (GET_SIZE(HDRP(bp)) == size)
+                break;
+#endif
+        }
+    }
+#endif
+    if (best != NULL)
+        return best;
+    //nearest non-empty class above it
+    if (class == NUM_CLASSES - 1)
+        return NULL;
+    unsigned long larger = a->flist_bitmap & (~0UL << (class + 1));
+    if (larger == 0)
+        return NULL;
+#if FIT_POLICY == FIT_INDEX
+    class = __builtin_ctzl(larger);
+    return a->index_blocks[class][a->index_count[class] - 1];
+#else
+    return a->flist_heads[__builtin_ctzl(larger)];
+#endif
+}
+
+/*
+ * grow_heap - extend arena a's part of the heap for a block of size
+ *
+ * Returns a free block of at least size bytes at the end of a's most recent
+ * segment, otherwise, NULL. With GROW_ADAPTIVE, if that segment ends in a free
+ * block too small for size, the heap is extended by just the shortfall, which
+ * coalesces with it. If another arena has moved the break since, the new space
+ * starts a segment of its own instead, and the heap is extended again.
+ * Otherwise the heap grows by size, but at least by its current size shifted
+ * right by GROW_SHIFT, kept between CHUNKSIZE and GROW_MAX. A heap that keeps
+ * growing thus grows geometrically, calling mem_sbrk ever less often, while the
+ * space left over at its end stays a small share of it. With GROW_FIXED, the
+ * heap always grows by at least CHUNKSIZE. The caller must hold a's lock.
  */
-static void *find_fit(size_t size) {
-    //iterate over free list
-    for (void *bp = flist_head; !GET_ALLOC(HDRP(bp)); bp = NEXT_FREE(bp))
-        if (GET_SIZE(HDRP(bp)) >= size)
+static void *grow_heap(arena_t *a, size_t size) {
+#if GROW_POLICY == GROW_ADAPTIVE
+    //the free block before the epilogue makes up part of size, if the break
+    //is still right after it (extend_heap checks again under sbrk_lock)
+    if (a->seg_end != NULL && !GET_PREV_ALLOC(HDRP(a->seg_end)) &&
+        (char *)mem_heap_hi() + 1 == a->seg_end) {
+        size_t tail = GET_SIZE(HDRP(PREV_BLKP(a->seg_end)));
+        void *bp = extend_heap(a, MAX(MIN_BLOCK_SIZE, size - tail));
+        if (bp == NULL || GET_SIZE(HDRP(bp)) >= size)
             return bp;
-    return NULL;
+    }
+    size_t grow = MIN(GROW_MAX, ALIGN(mem_heapsize() >> GROW_SHIFT));
+    return extend_heap(a, MAX(size, MAX(CHUNKSIZE, grow)));
+#else
+    return extend_heap(a, MAX(CHUNKSIZE, size));
+#endif
 }
 
 /*
- * extend_heap - extend the heap by size bytes
+ * extend_heap - extend arena a's part of the heap by size bytes
  *
  * Returns a pointer to the start of the newly-added heap space if the heap is
- * successfully extended, otherwise, NULL. Uses mem_sbrk to extend the heap. The
- * new heap space is treated as a single free block. Recreates the epilogue
- * block to ensure the integrity to the heap's structure.
+ * successfully extended, otherwise, NULL. Uses mem_sbrk to extend the heap. If
+ * the break still sits right after a's last segment, the new heap space is
+ * treated as a single free block, whose header takes over the old epilogue and
+ * with it the previous-allocated bit. Otherwise another arena has grown the
+ * heap since, so DWORD more is requested to start a new segment with its own
+ * link word and epilogue. Recreates the epilogue block to ensure the integrity
+ * to the heap's structure. a's clean mark moves up past the list pointers of
+ * the new block, or to heap_high if the heap has been this large before. The
+ * caller must hold a's lock.
  */
-static void *extend_heap(size_t size) {
+static void *extend_heap(arena_t *a, size_t size) {
+    //mem_sbrk takes an int
+    if (size > INT_MAX - DWORD)
+        return NULL;
     //get more heap space!
-    void *bp = mem_sbrk(size);
+    pthread_mutex_lock(&sbrk_lock);
+    int fresh = (char *)mem_heap_hi() + 1 != a->seg_end;
+    void *bp = mem_sbrk(fresh ? size + DWORD : size);
+    char *high = (char *)mem_heap_lo() + heap_high;
+    if (bp != (void *)-1) {
+        a->seg_end = (char *)bp + (fresh ? size + DWORD : size);
+        heap_high = MAX(heap_high, (size_t)(a->seg_end - (char *)mem_heap_lo()));
+    }
+    pthread_mutex_unlock(&sbrk_lock);
     //error check
     if (bp == (void *)-1)
         return NULL;
+    a->extends++;
+    a->clean = MAX(high, (char *)bp + (fresh ? 2*DWORD : DWORD));
     //set as a free block
-    SET(HDRP(bp), PACK(size, 0));
-    SET(FTRP(bp), PACK(size, 0));
+    if (fresh) {
+        //link the new segment in front of a's previous one
+        SET(bp, (unsigned long)a->segments);
+        a->segments = bp;
+        bp = (char *)bp + DWORD;
+        SET(HDRP(bp), PACK(size, 0, 1) | a->tag);
+    }
+    else
+        SET(HDRP(bp), PACK(size, 0, GET_PREV_ALLOC(HDRP(bp))) | a->tag);
+    SET(FTRP(bp), PACK(size, 0, 0));
     //recreate epilogue
-    SET(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+    SET(HDRP(NEXT_BLKP(bp)), PACK(0, 1, 0) | a->tag);
     //coalesce if necessary (possible that adjacently previous block is free)
-    return coalesce(bp);
+    return coalesce(a, bp);
 }
 
 /*
  * allocate - sets bp as allocated with the given size
  *
- * Compares the size reported by bp's header to the given size. If the
- * difference is large enough for another block, a free block with the size of
- * the difference is created.
+ * Removes the free block bp from its free list and places an allocated block
+ * of the given size in it. The caller must hold a's lock.
  */
-static void allocate(void *bp, size_t size) {
+static void allocate(arena_t *a, void *bp, size_t size) {
     //ensure bp is actually free
     assert(!GET_ALLOC(HDRP(bp)));
-    //get the block's actual size
-    size_t block_size = GET_SIZE(HDRP(bp));
     //remove the block from the free list
-    flist_remove(bp);
+    flist_remove(a, bp);
+    place(a, bp, GET_SIZE(HDRP(bp)), size);
+}
+
+/*
+ * place - sets the block_size bytes at bp as an allocated block of size
+ *
+ * The space must not be on any free list, and bp's header must hold the right
+ * previous-allocated bit and arena. Compares block_size to the given size. If
+ * the difference is large enough for another block, a free block with the size
+ * of the difference is created and coalesced with whatever follows it. The
+ * difference must be at least SPLIT_MIN. Otherwise the whole space is
+ * allocated. a's clean mark moves up past the allocated block and the list
+ * pointers of a free block after it. The caller must hold a's lock.
+ */
+static void place(arena_t *a, void *bp, size_t block_size, size_t size) {
+    if ((char *)bp + size + DWORD > a->clean)
+        a->clean = (char *)bp + size + DWORD;
     //extra space for a block
-    if (block_size - size >= MIN_BLOCK_SIZE) {
-        //set the size of the current block's header and footer
-        SET(HDRP(bp), PACK(size, 1));
-        SET(FTRP(bp), PACK(size, 1));
+    if (block_size - size >= SPLIT_MIN) {
+        a->splits++;
+        //set the size of the current block
+        set_allocated(bp, size);
         //set the remaining space as a free block
-        SET(HDRP(NEXT_BLKP(bp)), PACK(block_size - size, 0));
-        SET(FTRP(NEXT_BLKP(bp)), PACK(block_size - size, 0));
-        coalesce(NEXT_BLKP(bp));
+        void *rest = NEXT_BLKP(bp);
+        SET(HDRP(rest), PACK(block_size - size, 0, 1) | a->tag);
+        SET(FTRP(rest), PACK(block_size - size, 0, 0));
+        CLR_PREV_ALLOC(NEXT_BLKP(rest));
+        coalesce(a, rest);
     }
     //simply allocate the block
     else {
-        SET(HDRP(bp), PACK(block_size, 1));
-        SET(FTRP(bp), PACK(block_size, 1));
+        set_allocated(bp, block_size);
+        SET_PREV_ALLOC(NEXT_BLKP(bp));
+    }
+}
+
+/*
+ * resize_block - resizes the heap block bp to size without leaving its place
+ *
+ * Returns a pointer to the resized block, which holds bp's data, if there is
+ * room for it, otherwise, NULL. Locks the block's owning arena and tries the
+ * following in order:
+ * (1) if the block is big enough already, its tail is split off and freed when
+ *     it is large enough for a block of its own;
+ * (2) if the block together with a free block adjacently after it is big
+ *     enough, the free block is absorbed;
+ * (3) if the block, or the free block after it, is the last of the arena's
+ *     most recent segment and the break is still right after it, the heap is
+ *     extended by just what is missing, and the new space is absorbed as in
+ *     (2);
+ * (4) if a free block adjacently before it makes up the rest, the previous
+ *     block (and the next one, if free) is absorbed and the data is moved
+ *     down to its start with memmove.
+ * In all of these cases, any tail beyond size is split off as in (1).
+ */
+static void *resize_block(void *bp, size_t size) {
+    size_t block_size = GET_SIZE(HDRP(bp));
+    arena_t *a = GET_ARENA(HDRP(bp));
+    pthread_mutex_lock(&a->lock);
+    //space available after bp, and before it
+    void *next_blk = NEXT_BLKP(bp);
+    size_t avail = block_size;
+    if (!GET_ALLOC(HDRP(next_blk)))
+        avail += GET_SIZE(HDRP(next_blk));
+    size_t back = GET_PREV_ALLOC(HDRP(bp)) ? 0 : GET_SIZE(HDRP(PREV_BLKP(bp)));
+    //extend the segment in place when the available space ends it and the
+    //break (extend_heap checks again under sbrk_lock)
+    if (avail + back < size && (char *)bp + avail == a->seg_end &&
+        (char *)mem_heap_hi() + 1 == a->seg_end &&
+        extend_heap(a, MAX(MIN_BLOCK_SIZE, size - avail - back)) != NULL) {
+        next_blk = NEXT_BLKP(bp);
+        avail = block_size;
+        if (!GET_ALLOC(HDRP(next_blk)))
+            avail += GET_SIZE(HDRP(next_blk));
+    }
+    //grow (or shrink) in place
+    if (avail >= size) {
+        if (avail > block_size)
+            flist_remove(a, next_blk);
+        place(a, bp, avail, size);
+    }
+    //grow backward, moving the data down
+    else if (avail + back >= size) {
+        void *prev_blk = PREV_BLKP(bp);
+        flist_remove(a, prev_blk);
+        if (avail > block_size)
+            flist_remove(a, next_blk);
+        memmove(prev_blk, bp, block_size - ALLOC_OVERHEAD);
+        place(a, prev_blk, avail + back, size);
+        bp = prev_blk;
+    }
+    else
+        bp = NULL;
+    pthread_mutex_unlock(&a->lock);
+    return bp;
+}
+
+/*
+ * copy_payload - copies the n bytes at src to the block dst
+ *
+ * Copies of fewer than COPY_STREAM_MIN bytes, or into a slab object or mapped
+ * block, or into heap memory no block has reached yet, are left to memcpy:
+ * their target is either small, or made of pages the system is faulting in,
+ * zeroed and cache hot, for the first time. Otherwise, with SSE2, the target is
+ * written with non-temporal stores, so that the copy neither reads it into the
+ * cache first nor evicts the rest of the cache. Reading dst's arena's clean
+ * mark without its lock is only a hint.
+ */
+static void copy_payload(void *dst, const void *src, size_t n) {
+#ifdef __SSE2__
+    char *to = dst;
+    const char *from = src;
+    if (n < COPY_STREAM_MIN || slab_of(dst) != NULL || GET_MAPPED(HDRP(dst)) ||
+        to + n > __atomic_load_n(&GET_ARENA(HDRP(dst))->clean, __ATOMIC_RELAXED)) {
+        memcpy(dst, src, n);
+        return;
     }
+    //blocks are DWORD-aligned, so the streaming stores are as well
+    for (; n >= 4 * DWORD; n -= 4 * DWORD, to += 4 * DWORD, from += 4 * DWORD) {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)from);
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(from + DWORD));
+        __m128i x2 = _mm_loadu_si128((const __m128i *)(from + 2 * DWORD));
+        __m128i x3 = _mm_loadu_si128((const __m128i *)(from + 3 * DWORD));
+        _mm_stream_si128((__m128i *)to, x0);
+        _mm_stream_si128((__m128i *)(to + DWORD), x1);
+        _mm_stream_si128((__m128i *)(to + 2 * DWORD), x2);
+        _mm_stream_si128((__m128i *)(to + 3 * DWORD), x3);
+    }
+    memcpy(to, from, n);
+    //order the streaming stores before whatever the caller writes next
+    _mm_sfence();
+#else
+    memcpy(dst, src, n);
+#endif
+}
+
+/*
+ * set_allocated - marks bp as allocated with the given size
+ *
+ * Writes bp's header, keeping its previous-allocated bit and its arena, and
+ * its footer only when allocated blocks carry one. The caller is responsible
+ * for the next block's previous-allocated bit.
+ */
+static void set_allocated(void *bp, size_t size) {
+    SET(HDRP(bp), PACK(size, 1, GET_PREV_ALLOC(HDRP(bp))) |
+        (GET(HDRP(bp)) & ~(ARENA_TAG(1) - 1)));
+#if !FOOTER_ELISION
+    SET(FTRP(bp), PACK(size, 1, 0));
+#endif
+}
+
+/*
+ * free_block - frees the allocated block bp into arena a
+ *
+ * Changes bp's header and footer to reflect that it is free, clears the
+ * previous-allocated bit of the next block, then calls the coalesce function
+ * in order to merge adjacent free blocks, if applicable. The caller must hold
+ * a's lock, and a must be bp's owner.
+ */
+static void free_block(arena_t *a, void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    SET(HDRP(bp), PACK(size, 0, GET_PREV_ALLOC(HDRP(bp))) | a->tag);
+    SET(FTRP(bp), PACK(size, 0, 0));
+    CLR_PREV_ALLOC(NEXT_BLKP(bp));
+    bp = coalesce(a, bp);
+    size = GET_SIZE(HDRP(bp));
+    //give a large enough block at the end of the heap back
+    if (TRIM_THRESHOLD && size >= TRIM_THRESHOLD && trim(a, bp, TRIM_PAD))
+        return;
+    //discard the pages between the list pointers and the footer
+    if (DISCARD_THRESHOLD && size >= DISCARD_THRESHOLD)
+        mem_discard((char *)bp + DWORD, size - 2*DWORD);
+}
+
+/*
+ * is_allocated_block - checks whether bp looks like an allocated block
+ *
+ * Returns nonzero if bp is aligned, lies inside the heap, is marked allocated
+ * with a plausible size, and the next block's header records its previous
+ * block as allocated. Without FOOTER_ELISION, bp's footer must also match its
+ * header. Outside the heap, bp must instead sit MAPPED_OVERHEAD bytes into a
+ * page whose header is marked allocated and mapped; the header is in the same
+ * page as bp, so reading it is safe. None of this proves bp is a block, but it
+ * costs no extra space.
+ */
+static int is_allocated_block(void *bp) {
+    if (!IS_ALIGNED(bp))
+        return 0;
+    if ((char *)bp < (char *)mem_heap_lo() || (char *)bp > (char *)mem_heap_hi())
+        return ((size_t)bp & (mem_pagesize() - 1)) == MAPPED_OVERHEAD &&
+            (GET(HDRP(bp)) & (MAPPED | 0x01)) == (MAPPED | 0x01);
+    if ((char *)bp <= (char *)heap_prologue)
+        return 0;
+    size_t size = GET_SIZE(HDRP(bp));
+    if (!GET_ALLOC(HDRP(bp)) || GET_MAPPED(HDRP(bp)) || size < MIN_BLOCK_SIZE ||
+        (char *)bp + size > (char *)mem_heap_hi() + 1 ||
+        (GET(HDRP(bp)) >> ARENA_SHIFT) >= NUM_ARENAS)
+        return 0;
+#if !FOOTER_ELISION
+    if (GET(FTRP(bp)) != PACK(size, 1, 0))
+        return 0;
+#endif
+    return GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
 }
 
 /*
@@ -385,35 +1659,37 @@ static void allocate(void *bp, size_t size) {
  *
  * Returns a pointer the block after coalescing. This function is called every
  * time a free block is created. So naturally, after the block has been
- * coalesced, it also adds the block to the free list as well. There are four
- * possible types of coalescing possible:
+ * coalesced, it also adds the block to arena a's free list as well. There are
+ * four possible types of coalescing possible:
  * (1) the next block is free and the previous block isn't;
  * (2) the previous block is free and the next block isn't;
  * (3) both the previous and next blocks are free;
  * (4) and neither the previous nor next blocks are free.
  * In the above cases, `previous` and `next` refer to adjacently previous and
- * adjacently next.
+ * adjacently next. Neighbors always belong to a as well, as segment ends are
+ * marked allocated. The caller must hold a's lock.
  */
-static void *coalesce(void *bp) {
+static void *coalesce(arena_t *a, void *bp) {
     //ensure block to be coalesced is actually a free block
     assert(!GET_ALLOC(HDRP(bp)));
     //get allocation status of neighbors
-    size_t prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
+    a->coalesces += !prev_alloc + !next_alloc;
     //case 1
     if (prev_alloc && !next_alloc) {
         //increment size by the additional free space
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         //remove the next block from the free list
-        flist_remove(NEXT_BLKP(bp));
+        flist_remove(a, NEXT_BLKP(bp));
     }
     //case 2
     else if (!prev_alloc && next_alloc) {
         //increment size the by additional free space
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         //remove the previous block from the free list
-        flist_remove(PREV_BLKP(bp));
+        flist_remove(a, PREV_BLKP(bp));
         //the previous block becomes the new block
         bp = PREV_BLKP(bp);
     }
@@ -422,114 +1698,1236 @@ static void *coalesce(void *bp) {
         //increment size the by additional free space
         size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp))));
         //remove the previous ane next blocks
-        flist_remove(PREV_BLKP(bp));
-        flist_remove(NEXT_BLKP(bp));
+        flist_remove(a, PREV_BLKP(bp));
+        flist_remove(a, NEXT_BLKP(bp));
         //the previous block becomes the new block
         bp = PREV_BLKP(bp);
     }
     //case 4
     else {}
     //adjust the size to reflect the size of the new block
-    SET(HDRP(bp), PACK(size, 0));
-    SET(FTRP(bp), PACK(size, 0));
+    SET(HDRP(bp), PACK(size, 0, GET_PREV_ALLOC(HDRP(bp))) | a->tag);
+    SET(FTRP(bp), PACK(size, 0, 0));
     //add coalesced block into the free list and return
-    flist_add(bp);
+    flist_add(a, bp);
     return bp;
 }
 
-/* LINKED LIST FUNCTIONS */
-
 /*
- * flist_remove - removes bp from the free list
+ * trim - shrinks the heap by returning the end of free block bp to memlib
  *
- * Just a typical function to remove a node from a doubly-linked list.
+ * Returns nonzero if the heap was shrunk. Does nothing unless bp is the last
+ * block of a's most recent segment and that segment ends at the break, as
+ * only the top of the heap can be given back. Then the block is cut down to
+ * pad bytes (at least MIN_BLOCK_SIZE), rounded up so that only whole pages are
+ * released, and the epilogue is moved down behind it. More than INT_MAX bytes
+ * are released in several calls to mem_sbrk. The caller must hold a's lock.
  */
-static void flist_remove(void *bp) {
-    //ensure bp is actually free
-    assert(!GET_ALLOC(HDRP(bp)));
-    //possible that bp is the head of the list
-    if (bp == flist_head)
-        flist_head = NEXT_FREE(bp);
-    else
-        NEXT_FREE(PREV_FREE(bp)) = NEXT_FREE(bp);
-    PREV_FREE(NEXT_FREE(bp)) = PREV_FREE(bp);
+static int trim(arena_t *a, void *bp, size_t pad) {
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t pagesize = mem_pagesize();
+    if ((char *)NEXT_BLKP(bp) != a->seg_end)
+        return 0;
+    size_t keep = MAX(MIN_BLOCK_SIZE, ALIGN(pad));
+    size_t release = size > keep ? (size - keep) & ~(pagesize - 1) : 0;
+    if (release == 0)
+        return 0;
+    pthread_mutex_lock(&sbrk_lock);
+    if ((char *)mem_heap_hi() + 1 != a->seg_end) {
+        pthread_mutex_unlock(&sbrk_lock);
+        return 0;
+    }
+    //shrink the block, which may change its class
+    flist_remove(a, bp);
+    size -= release;
+    SET(HDRP(bp), PACK(size, 0, GET_PREV_ALLOC(HDRP(bp))) | a->tag);
+    SET(FTRP(bp), PACK(size, 0, 0));
+    SET(HDRP(NEXT_BLKP(bp)), PACK(0, 1, 0) | a->tag);
+    flist_add(a, bp);
+    //release everything past the new epilogue, in pieces mem_sbrk's int
+    //can hold
+    for (size_t left = release; left > 0; ) {
+        size_t piece = MIN(left, (size_t)INT_MAX & ~(pagesize - 1));
+        mem_sbrk(-(int)piece);
+        left -= piece;
+    }
+    a->seg_end -= release;
+    pthread_mutex_unlock(&sbrk_lock);
+    return 1;
 }
 
+/* QUICK LIST FUNCTIONS */
+
 /*
- * flist_add - adds bp to the head of the free list
+ * defer_free - returns the allocated block bp to arena a
  *
- * Just a typical function to add a node to the head of a doubly-linked list.
+ * A block of up to QUICK_MAX bytes is pushed onto a's quick list for its size
+ * as it is, still marked as allocated, so that mm_malloc can hand it out again
+ * without touching any boundary tag. Larger blocks are freed by free_block.
+ * The caller must hold a's lock, and a must be bp's owner.
  */
-static void flist_add(void *bp) {
-    //ensure bp is actually free
-    assert(!GET_ALLOC(HDRP(bp)));
-    //set the bp's next pointer to the head of the free list
-    NEXT_FREE(bp) = flist_head;
-    //set the head of the free list's previous pointer to bp
-    PREV_FREE(flist_head) = bp;
-    //set bp to the head of the free list
-    flist_head = bp;
+static void defer_free(arena_t *a, void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    if (size > QUICK_MAX) {
+        free_block(a, bp);
+        return;
+    }
+    int bin = QUICK_BIN(size);
+    QUICK_NEXT(bp) = a->quick[bin];
+    a->quick[bin] = bp;
+    a->quick_count++;
+    a->quick_bytes += size;
 }
 
-/* CHECKHEAP FUNCTIONS */
-
 /*
- * mm_checkheap checks each block in the heap sequencially. The helper function
- * print_block prints the information of each block visited. mm_checkheap checks if there
- * is any contiguous free block escaped from coalescing by checking each free block's next
- * block and previous block are free or not. mm_checkheap also checks whether each free block 
- * is actually in free list by checking the blocks pointed by PREV_FREE and NEXT_FREE pointers.
- * If there is any allocated block pointed by PREV_FREE or NEXT_FREE, there must be an error.
- * Whenever error is detected, mm_checkheap prints out the error type and the address where the 
- * error occurs. In case the errors are hidden in too many lines of print out, assert terminates
- * the program when error is detected.
- */
-void mm_checkheap(int verbose) {
-    printf("checking heap\n");
-    //go to the first normal block
-    if(verbose){
-        void *bp=heap_prologue;
-	void *last_block=mem_heap_hi()-7;
-        while (bp<last_block){
-            //print out the information of block bp.
-            print_block(bp);
-            if(!GET_ALLOC(HDRP(bp))){
-                //Check if there is any contiguous free block escaped from coalescing.
-                if(!GET_ALLOC(HDRP(NEXT_BLKP(bp)))){
-                    printf("There are contiguous free blocks escaped from coalescing.\n");
-                    printf("Error occurs at %p\n",HDRP(NEXT_BLKP(bp)));
-                    assert(0);
-                }
-                if(!GET_ALLOC(HDRP(PREV_BLKP(bp)))){
-                    printf("There are contiguous free blocks escaped from coalescing.\n");
-                    printf("Error occurs at %p\n",HDRP(PREV_BLKP(bp)));
-                    assert(0);
-                }
-                //Check if either an allocated block is in the free list
-                // or a freed block is not in the free list.
-                if(NEXT_FREE(bp)!=NULL && NEXT_FREE(bp)<last_block){
-                    if(GET_ALLOC(HDRP(NEXT_FREE(bp)))){
-                        printf("There is an allocated block pointed by NEXT_FREE.\n");
-                        printf("Error occurs at %p\n",HDRP(NEXT_FREE(bp)));
-                        assert(0);
-                    }
-                }
-                if(PREV_FREE(bp)!=NULL && PREV_FREE(bp)<last_block&&PREV_FREE(bp)>heap_prologue){
-                    if(GET_ALLOC(HDRP(PREV_FREE(bp)))){
-                        printf("There is an allocated block pointed by PREV_FREE.\n");
-                        printf("Error occurs at %p\n",HDRP(PREV_FREE(bp)));
-                        assert(0);
-                    }
-                }
-            }
-            bp=NEXT_BLKP(bp);
+ * consolidate - frees every block on arena a's quick lists
+ *
+ * Returns nonzero if there were any. Each block is freed by free_block, which
+ * coalesces it with whatever neighbors are free by then, so runs of deferred
+ * blocks merge back into single blocks. The caller must hold a's lock.
+ */
+static int consolidate(arena_t *a) {
+    if (a->quick_count == 0)
+        return 0;
+    for (int bin = 0; bin < QUICK_BINS; bin++) {
+        void *bp = a->quick[bin];
+        a->quick[bin] = NULL;
+        while (bp != NULL) {
+            void *next = QUICK_NEXT(bp);
+            free_block(a, bp);
+            bp = next;
         }
-    }   
-    return ;
+    }
+    a->quick_count = 0;
+    a->quick_bytes = 0;
+    return 1;
 }
 
+/* SLAB FUNCTIONS */
+
 /*
- *print_block prints out the information of block bp.
+ * allocate_aligned - allocates a block of size whose payload is aligned to align
+ *
+ * Returns a pointer to the new block, otherwise, NULL. The given size must be
+ * adjusted already, and align must be a power of two that is at least DWORD.
+ * Finds (or extends the heap for) a free block big enough to leave a free
+ * block of its own in front of the first suitably aligned payload. That front
+ * part is split off and put back on a free list, and the block is placed
+ * behind it. The caller must hold a's lock.
+ */
+static void *allocate_aligned(arena_t *a, size_t align, size_t size) {
+    size_t search = size + align + MIN_BLOCK_SIZE;
+    void *bp = find_fit(a, search);
+    if (bp == NULL && consolidate(a))
+        bp = find_fit(a, search);
+    if (bp == NULL && (bp = grow_heap(a, search)) == NULL)
+        return NULL;
+    flist_remove(a, bp);
+    size_t block_size = GET_SIZE(HDRP(bp));
+    //first aligned payload that leaves room for a free block before it
+    char *aligned = (char *)(((size_t)bp + align - 1) & ~(align - 1));
+    if (aligned != (char *)bp) {
+        while (aligned - (char *)bp < MIN_BLOCK_SIZE)
+            aligned += align;
+        size_t front = aligned - (char *)bp;
+        a->splits++;
+        //the front part is free, between allocated neighbors
+        SET(HDRP(bp), PACK(front, 0, GET_PREV_ALLOC(HDRP(bp))) | a->tag);
+        SET(FTRP(bp), PACK(front, 0, 0));
+        flist_add(a, bp);
+        SET(HDRP(aligned), PACK(block_size - front, 0, 0) | a->tag);
+        block_size -= front;
+    }
+    place(a, aligned, block_size, size);
+    return aligned;
+}
+
+/*
+ * slab_of - finds the slab holding the object p
+ *
+ * Returns the slab if p lies in one, otherwise, NULL. Slabs are aligned to
+ * SLAB_SIZE, so p's slab page is looked up in slab_map. Nothing else can lie
+ * in a slab page, as a slab spans all of it.
+ */
+static slab_t *slab_of(void *p) {
+    if ((char *)p < (char *)mem_heap_lo() || (char *)p > (char *)mem_heap_hi())
+        return NULL;
+    size_t page = SLAB_PAGE(p);
+    if (page >= SLAB_MAP_PAGES || !((slab_map[page / 64] >> (page % 64)) & 1))
+        return NULL;
+    return (slab_t *)((size_t)p & ~(size_t)(SLAB_SIZE - 1));
+}
+
+/*
+ * slab_alloc - takes an object from one of arena a's slabs of the given class
+ *
+ * Returns a pointer to the object, otherwise NULL if a new slab was needed and
+ * could not be made. Objects of class i are (i + 1) * DWORD bytes. Objects that
+ * have been freed are reused first, then those never handed out, in address
+ * order. A slab that runs out of objects leaves its list. The caller must hold
+ * a's lock.
+ */
+static void *slab_alloc(arena_t *a, int class) {
+    slab_t *s = a->slabs[class];
+    if (s == NULL && (s = new_slab(a, class)) == NULL)
+        return NULL;
+    void *p = s->free;
+    if (p != NULL)
+        s->free = SLAB_NEXT(p);
+    else
+        p = SLAB_OBJECTS(s) + s->fresh++ * s->size;
+    if (++s->used == s->capacity)
+        slab_unlink(a, s);
+    return p;
+}
+
+/*
+ * slab_free - gives the object p back to slab s
+ *
+ * A full slab rejoins its arena's list. A slab that becomes empty is freed
+ * back into the heap, unless it is the only one of its size with free
+ * objects, which is kept to avoid making a new slab for the next request. The
+ * caller must hold the lock of s's arena.
+ */
+static void slab_free(slab_t *s, void *p) {
+    arena_t *a = s->arena;
+    SLAB_NEXT(p) = s->free;
+    s->free = p;
+    if (s->used-- == s->capacity)
+        slab_link(a, s);
+    else if (s->used == 0 && (s->prev != NULL || s->next != NULL)) {
+        slab_unlink(a, s);
+        size_t page = SLAB_PAGE(s);
+        slab_map[page / 64] &= ~(1UL << (page % 64));
+        free_block(a, s);
+    }
+}
+
+/*
+ * new_slab - makes a slab for objects of the given class in arena a
+ *
+ * Returns the new slab, already on a's list, otherwise, NULL. The slab is an
+ * allocated block whose payload is exactly one SLAB_SIZE-aligned page, taken
+ * by allocate_aligned, and is marked in slab_map. Its objects are handed out
+ * lazily, so they need no setting up. The caller must hold a's lock.
+ */
+static slab_t *new_slab(arena_t *a, int class) {
+    slab_t *s = allocate_aligned(a, SLAB_SIZE, SLAB_SIZE + DWORD);
+    if (s == NULL)
+        return NULL;
+    size_t page = SLAB_PAGE(s);
+    if (page >= SLAB_MAP_PAGES) {
+        free_block(a, s);
+        return NULL;
+    }
+    slab_map[page / 64] |= 1UL << (page % 64);
+    s->free = NULL;
+    s->arena = a;
+    s->size = (class + 1) * DWORD;
+    s->used = 0;
+    s->capacity = (SLAB_SIZE - ALIGN(sizeof(slab_t))) / s->size;
+    s->fresh = 0;
+    slab_link(a, s);
+    return s;
+}
+
+/*
+ * slab_link - puts slab s at the head of its list in arena a
+ */
+static void slab_link(arena_t *a, slab_t *s) {
+    int class = s->size / DWORD - 1;
+    s->prev = NULL;
+    s->next = a->slabs[class];
+    if (s->next != NULL)
+        s->next->prev = s;
+    a->slabs[class] = s;
+}
+
+/*
+ * slab_unlink - takes slab s off its list in arena a
+ */
+static void slab_unlink(arena_t *a, slab_t *s) {
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        a->slabs[s->size / DWORD - 1] = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+    s->prev = NULL;
+    s->next = NULL;
+}
+
+/* MAPPED BLOCK FUNCTIONS */
+
+/*
+ * map_block - allocates a block of at least size in a region of its own
+ *
+ * Returns a pointer to the new block if a region could be mapped, otherwise,
+ * NULL, also when size is too large to be rounded up. The region is size plus
+ * MAPPED_OVERHEAD, rounded up to whole pages. Its first word is unused and its
+ * second is the block's header, so the payload starts MAPPED_OVERHEAD bytes
+ * into the page. The header records the whole region's size, and carries the
+ * MAPPED bit instead of an arena.
+ */
+static void *map_block(size_t size) {
+    size_t pagesize = mem_pagesize();
+    //the rounding must not wrap around
+    if (size > (size_t)-1 - MAPPED_OVERHEAD - pagesize)
+        return NULL;
+    size_t region_size = (size + MAPPED_OVERHEAD + pagesize - 1) & ~(pagesize - 1);
+    pthread_mutex_lock(&sbrk_lock);
+    char *region = mem_map(region_size);
+    pthread_mutex_unlock(&sbrk_lock);
+    if (region == (char *)-1)
+        return NULL;
+    void *bp = region + MAPPED_OVERHEAD;
+    SET(HDRP(bp), PACK(region_size, 1, 1) | MAPPED);
+    return bp;
+}
+
+/*
+ * remap_block - resizes the mapped block bp to hold at least size bytes
+ *
+ * Returns a pointer to the resized block, which may have moved, or NULL if the
+ * region could not be resized or size is too large to be rounded up, in which
+ * case bp is left as it was. The region is resized with mem_remap, so the
+ * system moves its pages instead of copying the data.
+ */
+static void *remap_block(void *bp, size_t size) {
+    size_t pagesize = mem_pagesize();
+    //the rounding must not wrap around
+    if (size > (size_t)-1 - MAPPED_OVERHEAD - pagesize)
+        return NULL;
+    size_t region_size = (size + MAPPED_OVERHEAD + pagesize - 1) & ~(pagesize - 1);
+    size_t old_size = GET_SIZE(HDRP(bp));
+    if (region_size == old_size)
+        return bp;
+    pthread_mutex_lock(&sbrk_lock);
+    char *region = mem_remap((char *)bp - MAPPED_OVERHEAD, old_size, region_size);
+    pthread_mutex_unlock(&sbrk_lock);
+    if (region == (char *)-1)
+        return NULL;
+    bp = region + MAPPED_OVERHEAD;
+    SET(HDRP(bp), PACK(region_size, 1, 1) | MAPPED);
+    return bp;
+}
+
+/*
+ * unmap_block - frees the mapped block bp by unmapping its whole region
+ */
+static void unmap_block(void *bp) {
+    pthread_mutex_lock(&sbrk_lock);
+    mem_unmap((char *)bp - MAPPED_OVERHEAD, GET_SIZE(HDRP(bp)));
+    pthread_mutex_unlock(&sbrk_lock);
+}
+
+/* LINKED LIST FUNCTIONS */
+
+/*
+ * size_class - returns the index of the free list that holds blocks of size
+ *
+ * Sizes up to EXACT_CLASS_MAX map to one class per DWORD. Larger sizes map to
+ * one of the 1 << CLASS_SPLIT_BITS classes of their power of two, chosen by
+ * the bits just below the most significant one. Anything beyond the last
+ * class is clamped into it. With a single class, everything maps to it.
+ */
+static int size_class(size_t size) {
+    if (NUM_CLASSES == 1)
+        return 0;
+    if (size <= EXACT_CLASS_MAX)
+        return (size - MIN_BLOCK_SIZE) / DWORD;
+    //position of the most significant bit, and the bits just below it
+    int msb = 63 - __builtin_clzl(size);
+    int sub = (size >> (msb - CLASS_SPLIT_BITS)) & ((1 << CLASS_SPLIT_BITS) - 1);
+    int class = EXACT_CLASSES +
+        ((msb - (63 - __builtin_clzl(EXACT_CLASS_MAX))) << CLASS_SPLIT_BITS) + sub;
+    return class < NUM_CLASSES ? class : NUM_CLASSES - 1;
+}
+
+/*
+ * class_min - returns the smallest block size in the given size class
+ *
+ * The inverse of size_class: the first size of an exact class, or of the part
+ * of a power of two that the class covers above EXACT_CLASS_MAX.
+ */
+static size_t class_min(int class) {
+    if (NUM_CLASSES == 1 || class < EXACT_CLASSES)
+        return MIN_BLOCK_SIZE + class * DWORD;
+    int k = class - EXACT_CLASSES;
+    int msb = (63 - __builtin_clzl(EXACT_CLASS_MAX)) + (k >> CLASS_SPLIT_BITS);
+    size_t min = (1UL << msb) |
+        ((size_t)(k & ((1 << CLASS_SPLIT_BITS) - 1)) << (msb - CLASS_SPLIT_BITS));
+    return MAX(min, EXACT_CLASS_MAX + DWORD);
+}
+
+/*
+ * flist_remove - removes bp from its size class list in arena a
+ *
+ * Just a typical function to remove a node from a doubly-linked list. Clears
+ * the class's bit in flist_bitmap if the list becomes empty. With FIT_TREE, bp
+ * is removed from a's tree instead, which must ask for the same size bp had
+ * when it was added. With FIT_INDEX, the last entry of the class's index is
+ * moved into bp's slot, which likewise relies on bp's size being unchanged.
+ * a's count of free blocks and bytes is kept up to date.
+ */
+static void flist_remove(arena_t *a, void *bp) {
+    //ensure bp is actually free
+    assert(!GET_ALLOC(HDRP(bp)));
+    a->free_blocks--;
+#if FIT_POLICY == FIT_TREE
+    a->class_bytes[0] -= GET_SIZE(HDRP(bp));
+    a->flist_heads[0] = tree_remove(a->flist_heads[0], bp);
+    return;
+#endif
+    int class = size_class(GET_SIZE(HDRP(bp)));
+    a->class_bytes[class] -= GET_SIZE(HDRP(bp));
+#if FIT_POLICY == FIT_INDEX
+    size_t slot = INDEX_SLOT(bp), last = --a->index_count[class];
+    void *moved = a->index_blocks[class][last];
+    a->index_blocks[class][slot] = moved;
+    a->index_sizes[class][slot] = a->index_sizes[class][last];
+    INDEX_SLOT(moved) = slot;
+    if (last == 0)
+        a->flist_bitmap &= ~(1UL << class);
+    return;
+#endif
+    //possible that bp is the head of the list
+    if (PREV_FREE(bp) == NULL) {
+        a->flist_heads[class] = NEXT_FREE(bp);
+        if (a->flist_heads[class] == NULL)
+            a->flist_bitmap &= ~(1UL << class);
+    }
+    else
+        NEXT_FREE(PREV_FREE(bp)) = NEXT_FREE(bp);
+    if (NEXT_FREE(bp) != NULL)
+        PREV_FREE(NEXT_FREE(bp)) = PREV_FREE(bp);
+}
+
+/*
+ * flist_add - adds bp to the head of its size class list in arena a
+ *
+ * Just a typical function to add a node to the head of a doubly-linked list.
+ * Sets the class's bit in flist_bitmap. With FIT_TREE, bp is inserted into a's
+ * tree instead. With FIT_INDEX, bp and its size are appended to the class's
+ * index, which is grown first if it is full. a's count of free blocks and
+ * bytes is kept up to date.
+ */
+static void flist_add(arena_t *a, void *bp) {
+    //ensure bp is actually free
+    assert(!GET_ALLOC(HDRP(bp)));
+    a->free_blocks++;
+#if FIT_POLICY == FIT_TREE
+    a->class_bytes[0] += GET_SIZE(HDRP(bp));
+    a->flist_heads[0] = tree_insert(a->flist_heads[0], bp);
+    return;
+#endif
+    int class = size_class(GET_SIZE(HDRP(bp)));
+    a->class_bytes[class] += GET_SIZE(HDRP(bp));
+#if FIT_POLICY == FIT_INDEX
+    size_t slot = a->index_count[class]++;
+    if (slot == a->index_capacity[class])
+        index_grow(a, class);
+    a->index_blocks[class][slot] = bp;
+    a->index_sizes[class][slot] = GET_SIZE(HDRP(bp));
+    INDEX_SLOT(bp) = slot;
+    a->flist_bitmap |= 1UL << class;
+    return;
+#endif
+    //set the bp's pointers around the head of its class list
+    PREV_FREE(bp) = NULL;
+    NEXT_FREE(bp) = a->flist_heads[class];
+    //set the head of the class list's previous pointer to bp
+    if (a->flist_heads[class] != NULL)
+        PREV_FREE(a->flist_heads[class]) = bp;
+    //set bp to the head of the class list
+    a->flist_heads[class] = bp;
+    a->flist_bitmap |= 1UL << class;
+}
+
+#if FIT_POLICY == FIT_INDEX
+/*
+ * index_grow - doubles the slots of the given class's index in arena a
+ *
+ * The new arrays are mapped straight from the system, like the shadow map of
+ * mm_checkheap, so that they neither live in the heap they describe nor show
+ * up in memlib's accounting. The entries in use are copied over and the old
+ * mapping is released. A free block that cannot be indexed would be lost for
+ * good, so running out of memory here aborts. The caller must hold a's lock.
+ */
+static void index_grow(arena_t *a, int class) {
+    size_t old = a->index_capacity[class];
+    size_t capacity = MAX(INDEX_MIN, 2 * old);
+    size_t entry = sizeof(void *) + sizeof(size_t);
+    char *p = mmap(NULL, capacity * entry, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mm: no memory for the free block index\n");
+        abort();
+    }
+    void **blocks = (void **)p;
+    size_t *sizes = (size_t *)(p + capacity * sizeof(void *));
+    if (old != 0) {
+        memcpy(blocks, a->index_blocks[class], old * sizeof(void *));
+        memcpy(sizes, a->index_sizes[class], old * sizeof(size_t));
+        munmap(a->index_blocks[class], old * entry);
+    }
+    a->index_blocks[class] = blocks;
+    a->index_sizes[class] = sizes;
+    a->index_capacity[class] = capacity;
+}
+#endif
+
+/* TREE FUNCTIONS */
+
+#if FIT_POLICY == FIT_TREE
+/*
+ * With FIT_TREE, each arena's free blocks form a treap rooted at flist_heads[0]:
+ * a binary search tree ordered by size, ties broken by address, that is also a
+ * heap on TREE_PRIO. The priorities are scattered by hashing the address, so
+ * the tree is balanced in expectation and nodes need no room for them. The two
+ * list pointers of a free block serve as its children.
+ */
+
+/*
+ * tree_less - returns whether block x comes before block y in the tree order
+ */
+static int tree_less(void *x, void *y) {
+    size_t x_size = GET_SIZE(HDRP(x));
+    size_t y_size = GET_SIZE(HDRP(y));
+    return x_size < y_size || (x_size == y_size && (char *)x < (char *)y);
+}
+
+/*
+ * tree_insert - inserts bp into the tree t
+ *
+ * Returns the new root of the tree. bp goes in as a leaf in its place in the
+ * order and is then rotated up for as long as it outranks its parent.
+ */
+static void *tree_insert(void *t, void *bp) {
+    if (t == NULL) {
+        TREE_LEFT(bp) = NULL;
+        TREE_RIGHT(bp) = NULL;
+        return bp;
+    }
+    if (tree_less(bp, t)) {
+        TREE_LEFT(t) = tree_insert(TREE_LEFT(t), bp);
+        //rotate right
+        void *left = TREE_LEFT(t);
+        if (TREE_PRIO(left) > TREE_PRIO(t)) {
+            TREE_LEFT(t) = TREE_RIGHT(left);
+            TREE_RIGHT(left) = t;
+            return left;
+        }
+    }
+    else {
+        TREE_RIGHT(t) = tree_insert(TREE_RIGHT(t), bp);
+        //rotate left
+        void *right = TREE_RIGHT(t);
+        if (TREE_PRIO(right) > TREE_PRIO(t)) {
+            TREE_RIGHT(t) = TREE_LEFT(right);
+            TREE_LEFT(right) = t;
+            return right;
+        }
+    }
+    return t;
+}
+
+/*
+ * tree_remove - removes bp, which must be in it, from the tree t
+ *
+ * Returns the new root of the tree. bp is found by its size and address, and
+ * replaced by the merge of its two subtrees.
+ */
+static void *tree_remove(void *t, void *bp) {
+    if (t == bp)
+        return tree_merge(TREE_LEFT(t), TREE_RIGHT(t));
+    if (tree_less(bp, t))
+        TREE_LEFT(t) = tree_remove(TREE_LEFT(t), bp);
+    else
+        TREE_RIGHT(t) = tree_remove(TREE_RIGHT(t), bp);
+    return t;
+}
+
+/*
+ * tree_merge - joins two trees, where every block of left comes before every
+ *              block of right
+ *
+ * Returns the root of the joined tree, which is whichever root outranks the
+ * other.
+ */
+static void *tree_merge(void *left, void *right) {
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+    if (TREE_PRIO(left) > TREE_PRIO(right)) {
+        TREE_RIGHT(left) = tree_merge(TREE_RIGHT(left), right);
+        return left;
+    }
+    TREE_LEFT(right) = tree_merge(left, TREE_LEFT(right));
+    return right;
+}
+
+/*
+ * tree_best_fit - finds the smallest block of the tree t that fits size
+ *
+ * Returns the block, or NULL if none fits. Among blocks of the same size, the
+ * one with the lowest address is returned.
+ */
+static void *tree_best_fit(void *t, size_t size) {
+    void *fit = NULL;
+    while (t != NULL) {
+        if (GET_SIZE(HDRP(t)) >= size) {
+            fit = t;
+            t = TREE_LEFT(t);
+        }
+        else
+            t = TREE_RIGHT(t);
+    }
+    return fit;
+}
+#endif
+
+/* THREAD CACHE FUNCTIONS */
+
+/*
+ * mm_once - one-time setup of the arena locks, the thread cache key and the
+ * fork handlers
+ */
+static void mm_once(void) {
+    for (int i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_key_create(&tcache_key, tcache_exit);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * fork_prepare - takes every lock of the package before a fork
+ *
+ * A child only gets the forking thread, so a lock some other thread held
+ * would stay locked in it forever. The arena locks are taken in order, and
+ * sbrk_lock last, as it is taken inside an arena lock elsewhere.
+ */
+static void fork_prepare(void) {
+    for (int i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&sbrk_lock);
+}
+
+/*
+ * fork_parent - releases the locks fork_prepare took, in the parent
+ */
+static void fork_parent(void) {
+    pthread_mutex_unlock(&sbrk_lock);
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+}
+
+/*
+ * fork_child - sets up the locks fork_prepare took afresh, in the child
+ *
+ * The caches of the threads that did not survive the fork are lost, along
+ * with their blocks.
+ */
+static void fork_child(void) {
+    pthread_mutex_init(&sbrk_lock, NULL);
+    for (int i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+}
+
+/*
+ * tcache_get - returns the calling thread's cache
+ *
+ * If the heap was reset by mm_init since the cache was last used, the cached
+ * blocks no longer exist, so the cache is emptied and the thread is assigned
+ * the next arena, round-robin. Registering the cache with tcache_key makes
+ * sure it is flushed when the thread exits.
+ */
+static tcache_t *tcache_get(void) {
+    tcache_t *tc = &tcache;
+    if (tc->generation != mm_generation) {
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        memset(tc->slab_bins, 0, sizeof(tc->slab_bins));
+        memset(tc->slab_counts, 0, sizeof(tc->slab_counts));
+        tc->arena = &arenas[__sync_fetch_and_add(&next_arena, 1) % NUM_ARENAS];
+        tc->generation = mm_generation;
+        pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+/*
+ * tcache_refill - refills the cache's empty bin of a slab class
+ *
+ * Returns an object of the class, otherwise NULL if no slab could be made.
+ * Locks the thread's arena once to take up to TCACHE_SLAB_COUNT / 2 objects
+ * from its slabs, one of which is returned and the rest of which are cached.
+ */
+static void *tcache_refill(tcache_t *tc, int class) {
+    arena_t *a = tc->arena;
+    pthread_mutex_lock(&a->lock);
+    void *p = slab_alloc(a, class);
+    for (int i = 1; p != NULL && i < TCACHE_SLAB_COUNT / 2; i++) {
+        void *q = slab_alloc(a, class);
+        if (q == NULL)
+            break;
+        SLAB_NEXT(q) = tc->slab_bins[class];
+        tc->slab_bins[class] = q;
+        tc->slab_counts[class]++;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+
+/*
+ * tcache_put_object - caches the object p of slab s
+ *
+ * Pointers that are not at the start of an object are ignored. A full bin is
+ * flushed by half first, back into the slabs.
+ */
+static void tcache_put_object(tcache_t *tc, slab_t *s, void *p) {
+    if ((char *)p < SLAB_OBJECTS(s) || ((char *)p - SLAB_OBJECTS(s)) % s->size != 0)
+        return;
+    int class = s->size / DWORD - 1;
+    if (tc->slab_counts[class] == TCACHE_SLAB_COUNT)
+        tcache_flush(&tc->slab_bins[class], &tc->slab_counts[class],
+                     TCACHE_SLAB_COUNT / 2);
+    SLAB_NEXT(p) = tc->slab_bins[class];
+    tc->slab_bins[class] = p;
+    tc->slab_counts[class]++;
+}
+
+/*
+ * tcache_flush - returns the first count blocks of a bin to their arenas
+ *
+ * The bin's blocks are counted in *counts. The blocks are detached from the
+ * bin first. Then, as long as any remain, the owner of the first one is locked
+ * and every remaining block it owns is handed to defer_free in the same pass,
+ * or, for slab objects, to slab_free, so each arena's lock is taken once per
+ * flush no matter how the blocks are spread between arenas.
+ */
+static void tcache_flush(void **bin, int *counts, int count) {
+    //detach the batch from the bin
+    void *batch = *bin;
+    void *last = batch;
+    for (int i = 1; i < count; i++)
+        last = TCACHE_NEXT(last);
+    *bin = TCACHE_NEXT(last);
+    TCACHE_NEXT(last) = NULL;
+    *counts -= count;
+    //free it, one owning arena at a time
+    while (batch != NULL) {
+        slab_t *s = slab_of(batch);
+        arena_t *a = s != NULL ? s->arena : GET_ARENA(HDRP(batch));
+        void *rest = NULL;
+        pthread_mutex_lock(&a->lock);
+        while (batch != NULL) {
+            void *next = TCACHE_NEXT(batch);
+            if ((s = slab_of(batch)) != NULL && s->arena == a)
+                slab_free(s, batch);
+            else if (s == NULL && GET_ARENA(HDRP(batch)) == a)
+                defer_free(a, batch);
+            else {
+                TCACHE_NEXT(batch) = rest;
+                rest = batch;
+            }
+            batch = next;
+        }
+        pthread_mutex_unlock(&a->lock);
+        batch = rest;
+    }
+}
+
+/*
+ * tcache_exit - flushes an exiting thread's cache back into the arenas
+ */
+static void tcache_exit(void *p) {
+    tcache_t *tc = (tcache_t *)p;
+    if (tc->generation != mm_generation)
+        return;
+    for (int bin = 0; bin < TCACHE_BINS; bin++)
+        if (tc->counts[bin] > 0)
+            tcache_flush(&tc->bins[bin], &tc->counts[bin], tc->counts[bin]);
+    for (int class = 0; class < SLAB_CLASSES; class++)
+        if (tc->slab_counts[class] > 0)
+            tcache_flush(&tc->slab_bins[class], &tc->slab_counts[class],
+                         tc->slab_counts[class]);
+}
+
+/* SNAPSHOT FUNCTIONS */
+
+/*
+ * snap_put - appends the n bytes at p to the len bytes buffered in buf
+ *
+ * Returns 0 on success, otherwise, -1. The buffer, of SNAP_BUFSIZE bytes, is
+ * written to fd whenever p does not fit, and when p is NULL.
+ */
+static int snap_put(int fd, char *buf, size_t *len, const void *p, size_t n) {
+    if (p == NULL || *len + n > SNAP_BUFSIZE) {
+        for (size_t done = 0; done < *len; ) {
+            ssize_t written = write(fd, buf + done, *len - done);
+            if (written < 0)
+                return -1;
+            done += written;
+        }
+        *len = 0;
+    }
+    if (p != NULL) {
+        memcpy(buf + *len, p, n);
+        *len += n;
+    }
+    return 0;
+}
+
+/*
+ * snap_segment - writes segment seg of arena a, and each of its blocks
+ *
+ * Returns 0 on success, otherwise, -1. The blocks are counted in a first pass.
+ * A block is free if its header says so, cached or deferred if mm_snapshot
+ * marked it in marks (whose marks it clears), otherwise, a slab if slab_map
+ * has it, and allocated if not. The caller must hold a's lock.
+ */
+static int snap_segment(int fd, char *buf, size_t *len, arena_t *a, char *seg, unsigned long *marks) {
+    snapseg_t sseg;
+    memset(&sseg, 0, sizeof(sseg));
+    sseg.offset = HDRP(seg + DWORD) - (char *)mem_heap_lo();
+    sseg.arena = a - arenas;
+    for (char *bp = seg + DWORD; GET_SIZE(HDRP(bp)) != 0; bp = NEXT_BLKP(bp))
+        sseg.num_blocks++;
+    if (snap_put(fd, buf, len, &sseg, sizeof(sseg)) < 0)
+        return -1;
+    for (char *bp = seg + DWORD; GET_SIZE(HDRP(bp)) != 0; bp = NEXT_BLKP(bp)) {
+        snapblk_t blk;
+        memset(&blk, 0, sizeof(blk));
+        blk.size = GET_SIZE(HDRP(bp)) / SNAP_UNIT;
+        blk.class = size_class(GET_SIZE(HDRP(bp)));
+        if (!GET_ALLOC(HDRP(bp)))
+            blk.kind = SNAP_FREE;
+        else if (shadow_flip(marks, bp))
+            blk.kind = SNAP_CACHED;
+        else if (shadow_flip(marks, bp + DWORD))
+            blk.kind = SNAP_DEFERRED;
+        else if (slab_of(bp) == (slab_t *)bp)
+            blk.kind = SNAP_SLAB;
+        else
+            blk.kind = SNAP_ALLOC;
+        if (snap_put(fd, buf, len, &blk, sizeof(blk)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* CHECKHEAP FUNCTIONS */
+
+/*
+ * mm_checkheap checks each block in the heap sequencially, one segment of one arena at a
+ * time, and returns 0 if it finds nothing wrong, otherwise -1. It prints nothing but the
+ * errors it finds, unless verbose is set, in which case the helper function print_block
+ * also prints the information of each block visited. Each block is checked on its own by
+ * check_block, which makes sure the block is tagged with the arena whose segment holds it,
+ * that its previous-allocated bit matches the block before it, and that every free block's
+ * footer matches its header (as must every allocated one's, without FOOTER_ELISION). A free
+ * block must not have a free neighbor, which would have escaped from coalescing, and must
+ * be linked into its list from both sides. Afterwards, each size class list of the arena is
+ * walked to check that it only holds free blocks of its own class, that its links agree in
+ * both directions, and that its bit in flist_bitmap matches whether it is empty. The number
+ * of free blocks seen in the lists must equal the number seen in the heap, otherwise some
+ * free block is missing from its list; no list may hold more, which also stops the walk of a
+ * list with a cycle. With CHECK_SHADOW, every free block seen in the heap is also marked in
+ * a bitmap, and each one in a list must be marked and is unmarked, so that the two sets are
+ * compared block by block. Blocks held in thread caches or quick lists count as allocated,
+ * and each quick list must hold only blocks of its own size, as many as the arena counts.
+ * The free block and byte counters that mm_stats reports must match what the heap holds.
+ * The package must not be in use by other threads while the heap is checked. Whenever an
+ * error is detected, mm_checkheap prints out the error type and the address where the error
+ * occurs, and stops.
+ */
+int mm_checkheap(int verbose) {
+    if(verbose)
+        printf("checking heap\n");
+    unsigned long *shadow=CHECK_SHADOW?shadow_map():NULL;
+    for(int i=0;i<NUM_ARENAS;i++){
+        arena_t *a=&arenas[i];
+        size_t heap_free=0;
+        size_t list_free=0;
+        size_t free_bytes=0;
+        for(char *seg=a->segments;seg!=NULL;seg=(char *)GET(seg)){
+            void *bp=seg+DWORD;
+            size_t prev_alloc=1;
+            while (GET_SIZE(HDRP(bp))!=0){
+                //print out the information of block bp.
+                if(verbose)
+                    print_block(bp);
+                if(check_block(a,bp,prev_alloc)<0)
+                    return -1;
+                prev_alloc=GET_ALLOC(HDRP(bp));
+                if(!prev_alloc){
+                    heap_free++;
+                    free_bytes+=GET_SIZE(HDRP(bp));
+                    if(shadow!=NULL)
+                        shadow_flip(shadow,bp);
+                }
+                bp=NEXT_BLKP(bp);
+            }
+            //Check the epilogue's previous-allocated bit as well.
+            if(GET_PREV_ALLOC(HDRP(bp))!=prev_alloc){
+                printf("The epilogue's previous-allocated bit is wrong.\n");
+                return -1;
+            }
+        }
+        //Check that the memory past the clean mark is still zero.
+        for(char *p=a->clean;a->segments!=NULL&&p<a->seg_end-DWORD;p+=WORD){
+            if(GET(p)!=0){
+                printf("Arena %d has been written past its clean mark.\n",i);
+                printf("Error occurs at %p\n",p);
+                return -1;
+            }
+        }
+#if FIT_POLICY == FIT_TREE
+        //Check the tree's order and priorities, and count its blocks.
+        void *prev=NULL;
+        list_free=tree_check(a,a->flist_heads[0],&prev,heap_free,shadow);
+        if(list_free==(size_t)-1)
+            return -1;
+#elif FIT_POLICY == FIT_INDEX
+        //Check every class's index against its bit, its blocks and their slots and sizes.
+        for(int class=0;class<NUM_CLASSES;class++){
+            if((a->index_count[class]!=0)!=((a->flist_bitmap>>class)&1)||
+               a->index_count[class]>a->index_capacity[class]){
+                printf("The bitmap bit or count of class %d does not match its index.\n",class);
+                return -1;
+            }
+            list_free+=a->index_count[class];
+            if(list_free>heap_free){
+                printf("The indexes of arena %d hold more than its %lu free blocks.\n",
+                       i,(unsigned long)heap_free);
+                return -1;
+            }
+            for(size_t slot=0;slot<a->index_count[class];slot++){
+                void *bp=a->index_blocks[class][slot];
+                if((char *)bp<(char *)mem_heap_lo()+DWORD||(char *)bp>(char *)mem_heap_hi()||
+                   GET_ALLOC(HDRP(bp))||GET_ARENA(HDRP(bp))!=a){
+                    printf("There is a foreign or allocated block in the index of class %d.\n",class);
+                    printf("Error occurs at %p\n",bp);
+                    return -1;
+                }
+                if(a->index_sizes[class][slot]!=GET_SIZE(HDRP(bp))||
+                   size_class(GET_SIZE(HDRP(bp)))!=class){
+                    printf("There is a block of the wrong size in the index of class %d.\n",class);
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                if(INDEX_SLOT(bp)!=slot){
+                    printf("INDEX_SLOT does not point back to the block's slot.\n");
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                if(shadow!=NULL&&!shadow_flip(shadow,bp)){
+                    printf("The index of class %d holds a block that is not free in the heap.\n",class);
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+            }
+        }
+#else
+        //Check every size class list against its bit and its members' sizes.
+        for(int class=0;class<NUM_CLASSES;class++){
+            if((a->flist_heads[class]!=NULL)!=((a->flist_bitmap>>class)&1)){
+                printf("The bitmap bit of class %d does not match its list.\n",class);
+                return -1;
+            }
+            void *prev=NULL;
+            for(void *bp=a->flist_heads[class];bp!=NULL;bp=NEXT_FREE(bp)){
+                if(++list_free>heap_free){
+                    printf("The lists of arena %d hold more than its %lu free blocks.\n",
+                           i,(unsigned long)heap_free);
+                    return -1;
+                }
+                if(GET_ALLOC(HDRP(bp))||GET_ARENA(HDRP(bp))!=a){
+                    printf("There is a foreign or allocated block in the list of class %d.\n",class);
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                if(size_class(GET_SIZE(HDRP(bp)))!=class){
+                    printf("There is a block of the wrong size in the list of class %d.\n",class);
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                if(PREV_FREE(bp)!=prev){
+                    printf("PREV_FREE does not point back to the previous list node.\n");
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                if(shadow!=NULL&&!shadow_flip(shadow,bp)){
+                    printf("The list of class %d holds a block that is not free in the heap.\n",class);
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                prev=bp;
+            }
+        }
+#endif
+        //Check every slab list against the slab map and its slabs' sizes.
+        for(int class=0;class<SLAB_CLASSES;class++){
+            for(slab_t *s=a->slabs[class];s!=NULL;s=s->next){
+                if(slab_of(s)!=s||s->arena!=a||s->size!=(class+1)*DWORD){
+                    printf("There is a stray slab in the slab list of class %d.\n",class);
+                    printf("Error occurs at %p\n",(void *)s);
+                    return -1;
+                }
+                if(s->used>=s->capacity||s->fresh>s->capacity){
+                    printf("There is a full slab in the slab list of class %d.\n",class);
+                    printf("Error occurs at %p\n",(void *)s);
+                    return -1;
+                }
+            }
+        }
+        //Check every quick list against its blocks' sizes and quick_count.
+        size_t quick=0;
+        size_t quick_bytes=0;
+        for(int bin=0;bin<QUICK_BINS&&QUICK_MAX;bin++){
+            for(void *bp=a->quick[bin];bp!=NULL;bp=QUICK_NEXT(bp)){
+                if(!is_allocated_block(bp)||GET_ARENA(HDRP(bp))!=a||
+                   QUICK_BIN(GET_SIZE(HDRP(bp)))!=bin||quick>=a->quick_count){
+                    printf("There is a stray block in the quick list of bin %d.\n",bin);
+                    printf("Error occurs at %p\n",HDRP(bp));
+                    return -1;
+                }
+                quick++;
+                quick_bytes+=GET_SIZE(HDRP(bp));
+            }
+        }
+        if(quick!=a->quick_count||quick_bytes!=a->quick_bytes){
+            printf("Arena %d has %lu blocks in its quick lists but counts %lu (or their bytes differ).\n",
+                   i,(unsigned long)quick,(unsigned long)a->quick_count);
+            return -1;
+        }
+        //Check that every free block in the heap is reachable from some list.
+        if(heap_free!=list_free){
+            printf("Arena %d has %lu free blocks but its lists hold %lu.\n",
+                   i,(unsigned long)heap_free,(unsigned long)list_free);
+            return -1;
+        }
+        //Check the counters mm_stats reports.
+        size_t class_bytes=0;
+        for(int class=0;class<NUM_CLASSES;class++)
+            class_bytes+=a->class_bytes[class];
+        if(a->free_blocks!=heap_free||class_bytes!=free_bytes){
+            printf("Arena %d counts %lu free blocks of %lu bytes but has %lu of %lu.\n",
+                   i,(unsigned long)a->free_blocks,(unsigned long)class_bytes,
+                   (unsigned long)heap_free,(unsigned long)free_bytes);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *mm_check_sample turns on sampled checking, which is cheap enough to leave on in production.
+ *Every every-th mm_malloc or mm_free of a thread (0 turns it off) has check_range check the
+ *window blocks (CHECK_WINDOW if 0) starting at the block it hands out or frees, and aborts if
+ *they are inconsistent. This setting survives mm_init.
+ */
+void mm_check_sample(unsigned every, unsigned window){
+    check_window=window?window:CHECK_WINDOW;
+    check_every=every;
+}
+
+/*
+ *check_sample counts an operation on the (non-slab, unmapped) block bp, and has check_range
+ *check the blocks from bp on if sampled checking is on and the operation is due. Returns bp.
+ */
+static inline void *check_sample(void *bp){
+    if(__builtin_expect(check_every!=0,0)&&bp!=NULL&&++check_ops>=check_every){
+        check_ops=0;
+        if(check_range(bp,check_window)<0){
+            fflush(stdout);
+            abort();
+        }
+    }
+    return bp;
+}
+
+/*
+ *check_range checks up to n blocks of a segment with check_block, starting at the heap block
+ *bp, under the lock of bp's arena. The walk stops early at the end of the segment. Returns 0
+ *if they are consistent, otherwise -1.
+ */
+static int check_range(void *bp,size_t n){
+    arena_t *a=GET_ARENA(HDRP(bp));
+    int result=0;
+    pthread_mutex_lock(&a->lock);
+    size_t prev_alloc=GET_PREV_ALLOC(HDRP(bp));
+    for(;n>0&&GET_SIZE(HDRP(bp))!=0;n--){
+        if(check_block(a,bp,prev_alloc)<0){
+            result=-1;
+            break;
+        }
+        prev_alloc=GET_ALLOC(HDRP(bp));
+        bp=NEXT_BLKP(bp);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return result;
+}
+
+/*
+ *check_block checks the heap block bp of arena a on its own, looking no further than its
+ *neighbors and, if it is free, its list links, and returns 0 if it finds nothing wrong,
+ *otherwise -1. prev_alloc must be the allocation bit of the block before bp. The block must
+ *be tagged with a, lie within the heap with an aligned size of at least MIN_BLOCK_SIZE, and
+ *agree with prev_alloc. A free block's footer must match its header and neither neighbor may
+ *be free. Its list neighbors must be free blocks of a that point back to it, or it must head
+ *its class list, whose bitmap bit must be set (with FIT_TREE, its children must be free
+ *blocks of a). Without FOOTER_ELISION, an allocated block's footer must match too.
+ */
+static int check_block(arena_t *a,void *bp,size_t prev_alloc){
+    size_t size=GET_SIZE(HDRP(bp));
+    if(GET_ARENA(HDRP(bp))!=a){
+        printf("The block is not tagged with its segment's arena %d.\n",(int)(a-arenas));
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+    if(size<MIN_BLOCK_SIZE||size%DWORD!=0||(char *)bp+size>(char *)mem_heap_hi()+1){
+        printf("The block's size of %lu does not fit the heap.\n",(unsigned long)size);
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+    //Check the previous-allocated bit against the block before.
+    if(GET_PREV_ALLOC(HDRP(bp))!=prev_alloc){
+        printf("The previous-allocated bit disagrees with the previous block.\n");
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+    //Check the footer of blocks that carry one.
+    if((!GET_ALLOC(HDRP(bp))||!FOOTER_ELISION||bp==heap_prologue)&&
+       GET_SIZE(FTRP(bp))!=size){
+        printf("The footer does not match the header.\n");
+        printf("Error occurs at %p\n",FTRP(bp));
+        return -1;
+    }
+    if(GET_ALLOC(HDRP(bp)))
+        return 0;
+    //Check if there is any contiguous free block escaped from coalescing.
+    if(!GET_ALLOC(HDRP(NEXT_BLKP(bp)))||!prev_alloc){
+        printf("There are contiguous free blocks escaped from coalescing.\n");
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+    //Check if either an allocated block is in the free list
+    // or a freed block is not in the free list.
+#if FIT_POLICY == FIT_INDEX
+    int class=size_class(size);
+    size_t slot=INDEX_SLOT(bp);
+    if(slot>=a->index_count[class]||a->index_blocks[class][slot]!=bp){
+        printf("The free block is not in the index of class %d.\n",class);
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+#else
+    void *next=NEXT_FREE(bp),*prev=PREV_FREE(bp);
+    if((next!=NULL&&(GET_ALLOC(HDRP(next))||GET_ARENA(HDRP(next))!=a))||
+       (prev!=NULL&&(GET_ALLOC(HDRP(prev))||GET_ARENA(HDRP(prev))!=a))){
+        printf("There is an allocated or foreign block linked to a free block.\n");
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+#if FIT_POLICY != FIT_TREE
+    int class=size_class(size);
+    if((next!=NULL&&PREV_FREE(next)!=bp)||
+       (prev!=NULL?NEXT_FREE(prev)!=bp:a->flist_heads[class]!=bp)||
+       !((a->flist_bitmap>>class)&1)){
+        printf("The free block is not linked into the list of class %d.\n",class);
+        printf("Error occurs at %p\n",HDRP(bp));
+        return -1;
+    }
+#endif
+#endif
+    return 0;
+}
+
+/*
+ *shadow_map returns a cleared bitmap with a bit for every DWORD of the heap, kept from one
+ *call to the next and mapped straight from the system, so that the checker neither uses the
+ *package nor shows up in memlib's accounting, or NULL if there is no memory for one.
+ */
+static unsigned long *shadow_map(void){
+    static unsigned long *shadow=NULL;
+    static size_t shadow_size=0;
+    size_t size=(mem_heapsize()/DWORD+63)/64*sizeof(unsigned long)+sizeof(unsigned long);
+    if(size>shadow_size){
+        if(shadow!=NULL)
+            munmap(shadow,shadow_size);
+        shadow_size=MAX(size,2*shadow_size);
+        shadow=mmap(NULL,shadow_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+        if(shadow==MAP_FAILED){
+            shadow=NULL;
+            shadow_size=0;
+            return NULL;
+        }
+        return shadow;
+    }
+    memset(shadow,0,size);
+    return shadow;
+}
+
+/*
+ *shadow_flip flips the bit of block bp in the bitmap shadow, and returns its old value.
+ */
+static int shadow_flip(unsigned long *shadow,void *bp){
+    size_t bit=((char *)bp-(char *)mem_heap_lo())/DWORD;
+    shadow[bit/64]^=1UL<<(bit%64);
+    return !((shadow[bit/64]>>(bit%64))&1);
+}
+
+#if FIT_POLICY == FIT_TREE
+/*
+ *tree_check checks the subtree t of arena a's tree in order, and returns the number of
+ *blocks in it, or (size_t)-1 if it is wrong. Each block must be a free block of a, come after
+ *the block prev points to, and not outrank its parent. prev is left pointing to the last
+ *block of t. No path may be longer than depth blocks, which stops the walk of a tree with a
+ *cycle. With a shadow bitmap, each block must be marked in it, and is unmarked.
+ */
+static size_t tree_check(arena_t *a, void *t, void **prev, size_t depth, unsigned long *shadow){
+    if(t==NULL)
+        return 0;
+    if(depth==0){
+        printf("The tree is deeper than it has free blocks.\n");
+        printf("Error occurs at %p\n",HDRP(t));
+        return (size_t)-1;
+    }
+    size_t left=tree_check(a,TREE_LEFT(t),prev,depth-1,shadow);
+    if(left==(size_t)-1)
+        return left;
+    if(GET_ALLOC(HDRP(t))||GET_ARENA(HDRP(t))!=a){
+        printf("There is a foreign or allocated block in the tree.\n");
+        printf("Error occurs at %p\n",HDRP(t));
+        return (size_t)-1;
+    }
+    if(*prev!=NULL&&!tree_less(*prev,t)){
+        printf("The tree is out of order.\n");
+        printf("Error occurs at %p\n",HDRP(t));
+        return (size_t)-1;
+    }
+    if((TREE_LEFT(t)!=NULL&&TREE_PRIO(TREE_LEFT(t))>TREE_PRIO(t))||
+       (TREE_RIGHT(t)!=NULL&&TREE_PRIO(TREE_RIGHT(t))>TREE_PRIO(t))){
+        printf("A block outranks its parent in the tree.\n");
+        printf("Error occurs at %p\n",HDRP(t));
+        return (size_t)-1;
+    }
+    if(shadow!=NULL&&!shadow_flip(shadow,t)){
+        printf("The tree holds a block that is not free in the heap.\n");
+        printf("Error occurs at %p\n",HDRP(t));
+        return (size_t)-1;
+    }
+    *prev=t;
+    size_t right=tree_check(a,TREE_RIGHT(t),prev,depth-1,shadow);
+    return right==(size_t)-1?right:left+1+right;
+}
+#endif
+
+/*
+ *print_block prints out the information of block bp.
  */
 static void print_block(void *bp){
     printf("--------------------------------------\n");
@@ -540,5 +2938,11 @@ static void print_block(void *bp){
     }
     else{printf("Free block\n");}
         printf("Size: %lu\n",((unsigned long) GET_SIZE(HDRP(bp)))>>4);
-    printf("The address of the footer is %p\n", FTRP(bp));
+    if(GET_PREV_ALLOC(HDRP(bp))){
+        printf("Previous block allocated\n");
+    }
+    else{printf("Previous block free\n");}
+    if(!GET_ALLOC(HDRP(bp))||!FOOTER_ELISION){
+        printf("The address of the footer is %p\n", FTRP(bp));
+    }
 }
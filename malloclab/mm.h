@@ -4,7 +4,16 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
-extern void mm_checkheap(int verbose);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern int mm_trim(size_t pad);
+extern int mm_checkheap(int verbose);
+extern void mm_check_sample(unsigned every, unsigned window);
+extern int mm_snapshot(int fd, unsigned id, unsigned op);
 
 #define ALIGNMENT 16
 
@@ -16,6 +25,32 @@ extern void mm_checkheap(int verbose);
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
+/* size classes reported by mm_stats, at most */
+#define MM_STATS_CLASSES 64
+
+/* The state of the heap and counts of events since mm_init (see mm_stats) */
+typedef struct {
+    size_t heap_bytes;    /* bytes in the heap */
+    size_t mapped_bytes;  /* bytes in mapped regions */
+    size_t live_bytes;    /* bytes of both that are neither free nor deferred */
+    size_t free_bytes;    /* bytes in free blocks */
+    size_t free_blocks;   /* number of free blocks */
+    size_t largest_free;  /* size of the largest free block */
+    size_t quick_bytes;   /* bytes in blocks whose coalescing is deferred */
+    int num_classes;      /* number of size classes */
+    size_t class_min[MM_STATS_CLASSES];   /* smallest block of each class */
+    size_t class_bytes[MM_STATS_CLASSES]; /* bytes in free blocks of each */
+    unsigned long splits;          /* blocks split to fit a request */
+    unsigned long coalesces;       /* free neighbors merged */
+    unsigned long extends;         /* times the heap was extended */
+    unsigned long fit_searches;    /* free list searches */
+    unsigned long fit_steps;       /* list nodes looked at by them */
+    unsigned long realloc_inplace; /* reallocations without copying */
+    unsigned long realloc_copies;  /* reallocations that copied */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
  * personal names and login IDs in a struct of this
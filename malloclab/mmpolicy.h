@@ -0,0 +1,86 @@
+/*
+ * mmpolicy.h - the placement, splitting, coalescing and growth strategies
+ *     mm.c is built with
+ *
+ * Every strategy is a macro that picks one of a few alternatives at build
+ * time, e.g. with -DFIT_POLICY=FIT_TREE, and otherwise defaults to the
+ * one mm.c is tuned for. mm.c selects the code of each alternative with
+ * #if, so the chosen strategies are inlined into the allocation paths,
+ * with neither indirect calls nor run-time tests of the policy. "make
+ * variants" builds an mdriver-<fit>-<place>-<coalesce>-<split>-<grow> for
+ * every combination listed in the Makefile, and "make sweep" runs them all.
+ */
+#ifndef __MMPOLICY_H_
+#define __MMPOLICY_H_
+
+//how free blocks are indexed: in segregated size class lists, in a single
+//list, in a best-fit tree, or in the same size classes but listed in compact
+//arrays of addresses and sizes outside the blocks, so that a search scans
+//memory sequentially instead of chasing a pointer into every block
+#define FIT_SEGLIST 0
+#define FIT_LIST 1
+#define FIT_TREE 2
+#define FIT_INDEX 3
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_SEGLIST
+#endif
+
+//which block of a list find_fit takes: the first that fits, or the smallest
+//(FIT_TREE always takes the smallest)
+#define PLACE_FIRST 0
+#define PLACE_BEST 1
+#ifndef PLACE_POLICY
+#define PLACE_POLICY PLACE_FIRST
+#endif
+
+//whether requests of at least CACHE_LINE bytes get payloads aligned to a
+//cache line, so that no such object straddles one more line than it must
+#ifndef LINE_ALIGN
+#define LINE_ALIGN 0
+#endif
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+//smallest remainder of a free block that place splits off as a block of its
+//own (a multiple of 16, at least MIN_BLOCK_SIZE); smaller ones stay with the
+//allocated block as internal fragmentation
+#ifndef SPLIT_MIN
+#define SPLIT_MIN 32
+#endif
+
+//whether freed blocks are coalesced right away, or wait on quick lists until
+//the free lists run dry; blocks of up to QUICK_MAX bytes wait
+#define COALESCE_IMMEDIATE 0
+#define COALESCE_DEFERRED 1
+#ifndef COALESCE_POLICY
+#define COALESCE_POLICY COALESCE_DEFERRED
+#endif
+#ifndef QUICK_MAX
+#if COALESCE_POLICY == COALESCE_DEFERRED
+#define QUICK_MAX 1024
+#else
+#define QUICK_MAX 0
+#endif
+#endif
+
+//how much the heap grows by when no free block fits: always at least
+//CHUNKSIZE bytes, or, adaptively, by only what the free block ending the heap
+//lacks, and otherwise by at least 1/2^GROW_SHIFT of the heap, between
+//CHUNKSIZE and GROW_MAX bytes
+#define GROW_FIXED 0
+#define GROW_ADAPTIVE 1
+#ifndef GROW_POLICY
+#define GROW_POLICY GROW_ADAPTIVE
+#endif
+#ifndef CHUNKSIZE
+#define CHUNKSIZE (1 << 12)
+#endif
+#ifndef GROW_SHIFT
+#define GROW_SHIFT 6
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX (1 << 20)
+#endif
+
+#endif /* __MMPOLICY_H_ */
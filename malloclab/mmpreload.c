@@ -0,0 +1,641 @@
+/*
+ * mmpreload.c - Run the mm package as the allocator of any process
+ *
+ * Built as libmm.so (see the Makefile), this defines malloc, free,
+ * realloc, calloc and the aligned allocation functions on top of
+ * mm_malloc, mm_free and mm_realloc, so that
+ *
+ *   LD_PRELOAD=./libmm.so <program>
+ *
+ * runs the program on mm.c. memlib is built with a MAX_HEAP large
+ * enough for real programs; it only reserves the address space, and
+ * pages are committed as the heap touches them.
+ *
+ * The package is initialized by the first call, which happens while the
+ * process is still being set up. Anything allocated while it is being
+ * initialized (whatever mem_init or mm_init end up calling) is carved
+ * out of a small static buffer, and never freed. Nothing in here calls
+ * the libc allocator, so it cannot recurse into itself.
+ *
+ * The aligned allocation functions use mm_memalign, and calloc uses
+ * mm_calloc, which only clears memory that may have been written before.
+ * malloc_usable_size is defined as well, as libc's would misread the
+ * package's headers. The package takes all of its locks around a fork,
+ * so that a child of a threaded process can allocate.
+ *
+ * Setting MM_CHECK=<n>[,<blocks>] turns on the package's sampled heap
+ * checking (see mm_check_sample): every n-th request of a thread checks
+ * a few blocks of the heap, and the process aborts if they are corrupt.
+ *
+ * Setting MM_TRACE=<file> records every request the process makes into
+ * <file> as a .rep trace that mdriver can replay; a %p in <file> is
+ * replaced by the process id, so that programs running others (which
+ * inherit MM_TRACE) get a trace per process. Pointers are numbered
+ * as they are handed out, reusing the numbers of freed ones. While
+ * recording, a single lock is held around each request and its record,
+ * so that the trace orders requests of different threads the way the
+ * allocator saw them. Records are buffered and written in large chunks,
+ * and the header is filled in when the process exits.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define BOOT_SIZE  (1 << 16) /* bytes of the static buffer used during init */
+#define REC_BUFSIZE (1 << 16) /* bytes of records buffered between writes */
+#define REC_HDRLEN  84       /* bytes of the fixed-width trace header */
+
+/* An entry of a pointer map, or an empty one if key is NULL */
+typedef struct {
+    void *key;
+    size_t val;
+} slot_t;
+
+/* A hash table keyed by pointers, with linear probing */
+typedef struct {
+    slot_t *slots;
+    size_t mask;     /* number of slots less one (a power of two less one) */
+    size_t count;    /* number of entries */
+} ptrmap_t;
+
+/* Initialization state */
+static int ready = 0;                   /* is the package initialized? */
+static __thread int initializing = 0;   /* is this thread initializing it? */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(ALIGNMENT)));
+static size_t boot_used = 0;
+
+/* Recording state (MM_TRACE) */
+static int recording = 0;
+static int rec_fd = -1;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static char rec_buf[REC_BUFSIZE];
+static size_t rec_len = 0;
+static ptrmap_t rec_ids;       /* live pointer -> its id */
+static unsigned *rec_free_ids; /* ids of freed pointers, for reuse */
+static size_t rec_num_free_ids, rec_max_free_ids;
+static unsigned rec_num_ids = 0;
+static unsigned long rec_num_ops = 0;
+
+/*********************
+ * Helper routines
+ ********************/
+
+/*
+ * os_alloc - Get size bytes of zeroed memory straight from the system
+ */
+static void *os_alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+/*
+ * map_slot - Return the slot of key in m, or the empty slot where it
+ *     would go
+ */
+static slot_t *map_slot(ptrmap_t *m, void *key)
+{
+    size_t i = (((size_t) key >> 4) * 0x9E3779B97F4A7C15UL) >> 20;
+
+    for (i &= m->mask; m->slots[i].key != NULL && m->slots[i].key != key;
+	 i = (i + 1) & m->mask)
+	;
+    return &m->slots[i];
+}
+
+/*
+ * map_get - Return the entry of key in m, or NULL
+ */
+static slot_t *map_get(ptrmap_t *m, void *key)
+{
+    slot_t *s;
+
+    if (m->count == 0)
+	return NULL;
+    s = map_slot(m, key);
+    return (s->key == NULL) ? NULL : s;
+}
+
+/*
+ * map_put - Add an entry for key to m, which must not have one; the
+ *     table doubles whenever it gets half full. Returns 0 if it could
+ *     not grow.
+ */
+static int map_put(ptrmap_t *m, void *key, size_t val)
+{
+    slot_t *s;
+    size_t i;
+
+    if (2*(m->count + 1) > m->mask + 1 || m->slots == NULL) {
+	ptrmap_t bigger = {NULL, m->slots ? 2*m->mask + 1 : 1023, 0};
+
+	if ((bigger.slots = os_alloc((bigger.mask + 1) * sizeof(slot_t))) == NULL)
+	    return 0;
+	for (i = 0; m->slots != NULL && i <= m->mask; i++)
+	    if (m->slots[i].key != NULL)
+		*map_slot(&bigger, m->slots[i].key) = m->slots[i];
+	if (m->slots != NULL)
+	    munmap(m->slots, (m->mask + 1) * sizeof(slot_t));
+	bigger.count = m->count;
+	*m = bigger;
+    }
+    s = map_slot(m, key);
+    s->key = key;
+    s->val = val;
+    m->count++;
+    return 1;
+}
+
+/*
+ * map_remove - Remove the entry s from m, moving back the entries after
+ *     it that would no longer be found
+ */
+static void map_remove(ptrmap_t *m, slot_t *s)
+{
+    size_t i = s - m->slots, j = i, home;
+
+    for (;;) {
+	m->slots[i].key = NULL;
+	do {
+	    j = (j + 1) & m->mask;
+	    if (m->slots[j].key == NULL) {
+		m->count--;
+		return;
+	    }
+	    home = ((((size_t) m->slots[j].key >> 4) * 0x9E3779B97F4A7C15UL)
+		    >> 20) & m->mask;
+	    /* entry j stays if its home lies cyclically in (i, j] */
+	} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+	m->slots[i] = m->slots[j];
+	i = j;
+    }
+}
+
+/*
+ * boot_alloc - Carve size bytes out of the static buffer, behind a word
+ *     recording the size
+ */
+static void *boot_alloc(size_t size)
+{
+    size_t need = ALIGN(size) + ALIGNMENT;
+    size_t start;
+    char *p;
+
+    /* Huge sizes would wrap around when aligned */
+    if (size > BOOT_SIZE)
+	return NULL;
+    start = __sync_fetch_and_add(&boot_used, need);
+    if (start + need > BOOT_SIZE)
+	return NULL;
+    p = boot_buf + start + ALIGNMENT;
+    *(size_t *)(p - sizeof(size_t)) = size;
+    return p;
+}
+
+/*
+ * in_boot - Return true if p came from boot_alloc
+ */
+static int in_boot(void *p)
+{
+    return (char *)p >= boot_buf && (char *)p < boot_buf + BOOT_SIZE;
+}
+
+/*
+ * rec_flush - Write out the buffered records
+ */
+static void rec_flush(void)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < rec_len && (n = write(rec_fd, rec_buf + done,
+					rec_len - done)) > 0)
+	done += n;
+    rec_len = 0;
+}
+
+/*
+ * rec_header - Write the .rep header for the requests recorded so far,
+ *     in fields of fixed width so that it can be rewritten in place
+ */
+static void rec_header(void)
+{
+    char hdr[REC_HDRLEN + 1];
+    unsigned long fields[4] = {0, rec_num_ids, rec_num_ops, 1};
+    int i, j;
+
+    /* Each field is right-aligned in 20 characters and a newline */
+    memset(hdr, ' ', REC_HDRLEN);
+    for (i = 0; i < 4; i++) {
+	unsigned long v = fields[i];
+	j = 21*i + 19;
+	hdr[j + 1] = '\n';
+	do {
+	    hdr[j--] = '0' + v % 10;
+	    v /= 10;
+	} while (v > 0);
+    }
+    if (pwrite(rec_fd, hdr, REC_HDRLEN, 0) != REC_HDRLEN)
+	recording = 0;
+}
+
+/*
+ * rec_op - Record one request. The caller holds rec_lock.
+ */
+static void rec_op(char type, unsigned id, size_t size)
+{
+    char line[48], digits[24];
+    int len = 0, n;
+
+    if (size > 0x7fffffff) /* sizes are ints in .rep files */
+	size = 0x7fffffff;
+    line[len++] = type;
+    for (n = 0; n < 2 - (type == 'f'); n++) {
+	unsigned long v = n ? size : id, k = 0;
+	line[len++] = ' ';
+	do {
+	    digits[k++] = '0' + v % 10;
+	    v /= 10;
+	} while (v > 0);
+	while (k > 0)
+	    line[len++] = digits[--k];
+    }
+    line[len++] = '\n';
+    if (rec_len + len > REC_BUFSIZE)
+	rec_flush();
+    memcpy(rec_buf + rec_len, line, len);
+    rec_len += len;
+    rec_num_ops++;
+}
+
+/*
+ * rec_alloc - Record that p was handed out with size bytes. The caller
+ *     holds rec_lock.
+ */
+static void rec_alloc(void *p, size_t size)
+{
+    unsigned id;
+
+    if (p == NULL)
+	return;
+    if (rec_num_free_ids > 0)
+	id = rec_free_ids[--rec_num_free_ids];
+    else
+	id = rec_num_ids++;
+    if (!map_put(&rec_ids, p, id)) {
+	recording = 0;
+	return;
+    }
+    rec_op('a', id, size);
+}
+
+/*
+ * rec_free - Record that p was freed, unless it was never recorded. The
+ *     caller holds rec_lock.
+ */
+static void rec_free(void *p)
+{
+    slot_t *s = map_get(&rec_ids, p);
+    unsigned *ids;
+
+    if (s == NULL)
+	return;
+    rec_op('f', (unsigned) s->val, 0);
+    if (rec_num_free_ids == rec_max_free_ids) {
+	size_t max = rec_max_free_ids ? 2*rec_max_free_ids : 4096;
+	if ((ids = os_alloc(max * sizeof(unsigned))) == NULL) {
+	    map_remove(&rec_ids, s);
+	    return;
+	}
+	if (rec_free_ids != NULL) {
+	    memcpy(ids, rec_free_ids, rec_max_free_ids * sizeof(unsigned));
+	    munmap(rec_free_ids, rec_max_free_ids * sizeof(unsigned));
+	}
+	rec_free_ids = ids;
+	rec_max_free_ids = max;
+    }
+    rec_free_ids[rec_num_free_ids++] = (unsigned) s->val;
+    map_remove(&rec_ids, s);
+}
+
+/*
+ * rec_realloc - Record that old, which may be NULL, was resized to size
+ *     bytes and is now p. The caller holds rec_lock.
+ */
+static void rec_realloc(void *old, void *p, size_t size)
+{
+    slot_t *s;
+    unsigned id;
+
+    if (old == NULL || (s = map_get(&rec_ids, old)) == NULL) {
+	rec_alloc(p, size);
+	return;
+    }
+    if (p == NULL) {
+	if (size == 0)
+	    rec_free(old);
+	return;
+    }
+    id = (unsigned) s->val;
+    map_remove(&rec_ids, s);
+    if (!map_put(&rec_ids, p, id)) {
+	recording = 0;
+	return;
+    }
+    rec_op('r', id, size);
+}
+
+/*
+ * finish_recording - Write out the rest of the trace at exit
+ */
+__attribute__((destructor))
+static void finish_recording(void)
+{
+    if (!recording)
+	return;
+    pthread_mutex_lock(&rec_lock);
+    rec_flush();
+    rec_header();
+    recording = 0;
+    close(rec_fd);
+    pthread_mutex_unlock(&rec_lock);
+}
+
+/*
+ * rec_prefork, rec_postfork_parent, rec_postfork_child - Keep a fork
+ *     from copying half-written records: the parent writes its buffer
+ *     out first, and the child stops recording into the parent's file
+ */
+static void rec_prefork(void)
+{
+    pthread_mutex_lock(&rec_lock);
+    if (recording)
+	rec_flush();
+}
+
+static void rec_postfork_parent(void)
+{
+    pthread_mutex_unlock(&rec_lock);
+}
+
+static void rec_postfork_child(void)
+{
+    if (recording)
+	close(rec_fd);
+    recording = 0;
+    pthread_mutex_unlock(&rec_lock);
+}
+
+/*
+ * trace_path - Expand each %p in the MM_TRACE template to the process id
+ *     into path, which holds size bytes. Returns 0 if it does not fit.
+ */
+static int trace_path(char *path, size_t size, const char *template)
+{
+    char digits[24];
+    size_t len = 0;
+    unsigned long pid;
+    int k;
+
+    for (; *template != '\0'; template++) {
+	if (template[0] == '%' && template[1] == 'p') {
+	    for (pid = getpid(), k = 0; k == 0 || pid > 0; pid /= 10)
+		digits[k++] = '0' + pid % 10;
+	    while (k > 0 && len < size)
+		path[len++] = digits[--k];
+	    template++;
+	} else if (len < size)
+	    path[len++] = *template;
+    }
+    if (len >= size)
+	return 0;
+    path[len] = '\0';
+    return 1;
+}
+
+/*
+ * init - Initialize memlib and the mm package, once, and start
+ *     sampled checking and recording if MM_CHECK and MM_TRACE are set
+ */
+static void init(void)
+{
+    char *template, path[4096], *check, *end;
+
+    pthread_mutex_lock(&init_lock);
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+	initializing = 1;
+	mem_init();
+	if (mm_init() < 0)
+	    abort();
+	if ((check = getenv("MM_CHECK")) != NULL && *check != '\0') {
+	    unsigned long every = strtoul(check, &end, 10);
+	    mm_check_sample(every, *end == ',' ? strtoul(end + 1, NULL, 10) : 0);
+	}
+	if ((template = getenv("MM_TRACE")) != NULL && *template != '\0' &&
+	    trace_path(path, sizeof(path), template) &&
+	    (rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+	    recording = 1;
+	    rec_header();
+	    lseek(rec_fd, REC_HDRLEN, SEEK_SET); /* records go after it */
+	    pthread_atfork(rec_prefork, rec_postfork_parent, rec_postfork_child);
+	}
+	initializing = 0;
+	__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&init_lock);
+}
+
+/*
+ * start - Make sure the package is initialized, and return 0 if the
+ *     caller must use boot_alloc instead because init is running
+ */
+static inline int start(void)
+{
+    if (__builtin_expect(__atomic_load_n(&ready, __ATOMIC_ACQUIRE), 1))
+	return 1;
+    if (initializing)
+	return 0;
+    init();
+    return 1;
+}
+
+/*
+ * nomem - Set errno to ENOMEM if the allocation p failed, as libc does,
+ *     and return p
+ */
+static inline void *nomem(void *p)
+{
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+/*********************************
+ * The libc allocation interface
+ ********************************/
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (!start())
+	return boot_alloc(size);
+    /* The mm package wants a positive size, and the trace records it */
+    if (size == 0)
+	size = 1;
+    if (!recording)
+	return nomem(mm_malloc(size));
+    pthread_mutex_lock(&rec_lock);
+    p = mm_malloc(size);
+    if (recording)
+	rec_alloc(p, size);
+    pthread_mutex_unlock(&rec_lock);
+    return nomem(p);
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || in_boot(ptr) || !start())
+	return;
+    if (!recording) {
+	mm_free(ptr);
+	return;
+    }
+    pthread_mutex_lock(&rec_lock);
+    mm_free(ptr);
+    if (recording)
+	rec_free(ptr);
+    pthread_mutex_unlock(&rec_lock);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    size_t old_size;
+
+    if (!start())
+	return boot_alloc(size);
+    if (ptr == NULL)
+	return malloc(size);
+    /* Blocks from boot_alloc are copied out */
+    if (in_boot(ptr)) {
+	old_size = *(size_t *)((char *)ptr - sizeof(size_t));
+	if ((p = malloc(size)) == NULL)
+	    return NULL;
+	memcpy(p, ptr, old_size < size ? old_size : size);
+	free(ptr);
+	return p;
+    }
+    /* Only a realloc to size 0 returns NULL on success */
+    if (!recording)
+	return size ? nomem(mm_realloc(ptr, size)) : mm_realloc(ptr, size);
+    pthread_mutex_lock(&rec_lock);
+    p = mm_realloc(ptr, size);
+    if (recording)
+	rec_realloc(ptr, p, size);
+    pthread_mutex_unlock(&rec_lock);
+    return size ? nomem(p) : p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t total = nmemb * size;
+    void *p;
+
+    if (size != 0 && total / size != nmemb) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (total == 0)
+	nmemb = size = total = 1;
+    /* boot_buf is zero, as it is never reused */
+    if (!start())
+	return boot_alloc(total);
+    if (!recording)
+	return nomem(mm_calloc(nmemb, size));
+    pthread_mutex_lock(&rec_lock);
+    p = mm_calloc(nmemb, size);
+    if (recording)
+	rec_alloc(p, total);
+    pthread_mutex_unlock(&rec_lock);
+    return nomem(p);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+	return EINVAL;
+    if (!start()) {
+	/* boot_buf blocks are only ALIGNMENT-aligned */
+	if (alignment > ALIGNMENT || (p = boot_alloc(size)) == NULL)
+	    return ENOMEM;
+	*memptr = p;
+	return 0;
+    }
+    if (size == 0)
+	size = 1;
+    if (!recording)
+	p = mm_memalign(alignment, size);
+    else {
+	pthread_mutex_lock(&rec_lock);
+	p = mm_memalign(alignment, size);
+	if (recording)
+	    rec_alloc(p, size);
+	pthread_mutex_unlock(&rec_lock);
+    }
+    if (p == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *p;
+    int err = posix_memalign(&p, alignment < sizeof(void *) ?
+			     sizeof(void *) : alignment, size);
+
+    if (err) {
+	errno = err;
+	return NULL;
+    }
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned_alloc(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+
+    return aligned_alloc(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (in_boot(ptr))
+	return *(size_t *)((char *)ptr - sizeof(size_t));
+    if (ptr == NULL || !start())
+	return 0;
+    return mm_usable_size(ptr);
+}
@@ -0,0 +1,354 @@
+/*
+ * mmsnap - Render the heap snapshots written by mm_snapshot
+ *
+ * usage: mmsnap [-c] [-n <index>] [-w <cols>] [-r <rows>] [-p <prefix>]
+ *               <file>
+ *
+ * For each snapshot in the file (or only the one numbered index, from
+ * 0), mmsnap prints a summary of the blocks of each kind, an occupancy
+ * map of the heap, and a histogram of the sizes of the free blocks.
+ *
+ * The map has rows lines of cols cells (64 by 24 by default), each
+ * covering an equal share of the heap. A cell shows the kind of block
+ * holding most of its bytes: '#' allocated, 's' slab, 'c' cached by the
+ * snapshotting thread, 'q' on a quick list and '.' free. A cell holding
+ * both free and used bytes shows '-' if most are free and '+' if not,
+ * so runs of '-' and '+' are where the heap fragments. Each line starts
+ * with the heap offset of its first cell.
+ *
+ * The histogram bins free blocks by powers of two, or with -c by their
+ * free list class, and shows the bytes in each bin as a bar.
+ *
+ * With -p, each snapshot is also written as a PPM image named
+ * <prefix><index>.ppm, PPM_WIDTH pixels wide, with a pixel per 16
+ * bytes or more, as the size of the heap requires. Each pixel blends
+ * the colors of the kinds of bytes it covers, and bytes outside every
+ * segment are black.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapfmt.h"
+
+#define PPM_WIDTH  512        /* width of -p images in pixels */
+#define PPM_PIXELS (1 << 20)  /* most pixels in an image */
+#define BAR_WIDTH   40        /* width of the longest histogram bar */
+#define NUM_BINS    64        /* bins of the free-size histogram */
+
+/* A block of a snapshot */
+typedef struct {
+    unsigned long offset;      /* of its header from the heap start */
+    unsigned long size;        /* in bytes */
+    int kind;                  /* SNAP_FREE, SNAP_ALLOC, ... */
+    int class;                 /* its free list class */
+} block_t;
+
+/* A snapshot read from the file */
+typedef struct {
+    snaphdr_t hdr;
+    block_t *blocks;
+    unsigned long num_blocks;
+    unsigned long capacity;    /* blocks the array has room for */
+} snapshot_t;
+
+/* Map characters and image colors of the block kinds, by SNAP_ kind */
+static const char kind_chars[SNAP_KINDS] = {'.', '#', 'q', 'c', 's'};
+static const char *kind_names[SNAP_KINDS] =
+    {"free", "allocated", "deferred", "cached", "slab"};
+static const unsigned char kind_colors[SNAP_KINDS][3] = {
+    {255, 255, 255}, /* free: white */
+    {40, 80, 200},   /* allocated: blue */
+    {240, 150, 30},  /* deferred: orange */
+    {230, 210, 40},  /* cached: yellow */
+    {40, 170, 70}    /* slab: green */
+};
+
+/*
+ * fail - Report a fatal error, formatted with arg, and exit
+ */
+static void fail(const char *msg, const char *arg)
+{
+    fprintf(stderr, msg, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * read_snapshot - Read the next snapshot of f into snap, reusing its
+ *     block array, and return 1, or return 0 at the end of the file
+ */
+static int read_snapshot(FILE *f, snapshot_t *snap, const char *path)
+{
+    snapseg_t seg;
+    snapblk_t blk;
+    unsigned long offset;
+    unsigned i;
+
+    if (fread(&snap->hdr, sizeof(snap->hdr), 1, f) != 1)
+	return 0;
+    if (memcmp(snap->hdr.magic, SNAP_MAGIC, SNAP_MAGIC_LEN) != 0)
+	fail("%s is not a heap snapshot", path);
+    snap->num_blocks = 0;
+    for (;;) {
+	if (fread(&seg, sizeof(seg), 1, f) != 1)
+	    fail("%s ends inside a snapshot", path);
+	if (seg.num_blocks == 0)
+	    return 1;
+	offset = seg.offset;
+	for (i = 0; i < seg.num_blocks; i++) {
+	    if (fread(&blk, sizeof(blk), 1, f) != 1)
+		fail("%s ends inside a snapshot", path);
+	    if (blk.kind >= SNAP_KINDS || blk.size == 0)
+		fail("%s has a bad block", path);
+	    if (snap->num_blocks == snap->capacity) {
+		snap->capacity = snap->capacity ? 2*snap->capacity : 1024;
+		snap->blocks = realloc(snap->blocks,
+				       snap->capacity * sizeof(block_t));
+		if (snap->blocks == NULL)
+		    fail("Out of memory reading %s", path);
+	    }
+	    snap->blocks[snap->num_blocks].offset = offset;
+	    snap->blocks[snap->num_blocks].size =
+		(unsigned long) blk.size * SNAP_UNIT;
+	    snap->blocks[snap->num_blocks].kind = blk.kind;
+	    snap->blocks[snap->num_blocks].class = blk.class;
+	    snap->num_blocks++;
+	    offset += (unsigned long) blk.size * SNAP_UNIT;
+	}
+    }
+}
+
+/*
+ * fill_cells - Split the heap of snap into num_cells cells of cell_bytes
+ *     each, and count the bytes of each kind in every cell into
+ *     cells[cell*SNAP_KINDS + kind]
+ */
+static void fill_cells(snapshot_t *snap, unsigned long *cells,
+		       unsigned long num_cells, unsigned long cell_bytes)
+{
+    unsigned long i, lo, hi, cell, end;
+    block_t *b;
+
+    memset(cells, 0, num_cells * SNAP_KINDS * sizeof(unsigned long));
+    for (i = 0; i < snap->num_blocks; i++) {
+	b = &snap->blocks[i];
+	for (lo = b->offset; lo < b->offset + b->size; lo = hi) {
+	    cell = lo / cell_bytes;
+	    if (cell >= num_cells)
+		break;
+	    end = (cell + 1) * cell_bytes;
+	    hi = (b->offset + b->size < end) ? b->offset + b->size : end;
+	    cells[cell*SNAP_KINDS + b->kind] += hi - lo;
+	}
+    }
+}
+
+/*
+ * print_summary - Print the blocks and bytes of each kind in snap
+ */
+static void print_summary(snapshot_t *snap, int index)
+{
+    unsigned long blocks[SNAP_KINDS] = {0}, bytes[SNAP_KINDS] = {0};
+    unsigned long i, largest = 0;
+    int kind;
+
+    for (i = 0; i < snap->num_blocks; i++) {
+	blocks[snap->blocks[i].kind]++;
+	bytes[snap->blocks[i].kind] += snap->blocks[i].size;
+	if (snap->blocks[i].kind == SNAP_FREE && snap->blocks[i].size > largest)
+	    largest = snap->blocks[i].size;
+    }
+    printf("snapshot %d: id %u, op %u: %lu heap bytes, %lu mapped bytes\n",
+	   index, snap->hdr.id, snap->hdr.op, snap->hdr.heap_bytes,
+	   snap->hdr.mapped_bytes);
+    for (kind = 0; kind < SNAP_KINDS; kind++)
+	if (blocks[kind] > 0)
+	    printf("  %-10s %8lu blocks %12lu bytes\n", kind_names[kind],
+		   blocks[kind], bytes[kind]);
+    printf("  largest free block %lu bytes, fragmentation %.4f\n", largest,
+	   bytes[SNAP_FREE] ? 1.0 - (double) largest / bytes[SNAP_FREE] : 0.0);
+}
+
+/*
+ * print_map - Print the occupancy map of snap, rows lines of cols cells
+ */
+static void print_map(snapshot_t *snap, int rows, int cols)
+{
+    unsigned long num_cells = (unsigned long) rows * cols;
+    unsigned long cell_bytes, *cells, *c, unused, used, most;
+    unsigned long i;
+    int kind, top;
+
+    cell_bytes = (snap->hdr.heap_bytes + num_cells - 1) / num_cells;
+    cell_bytes = (cell_bytes + SNAP_UNIT - 1) / SNAP_UNIT * SNAP_UNIT;
+    if (cell_bytes == 0)
+	return;
+    if ((cells = malloc(num_cells * SNAP_KINDS * sizeof(*cells))) == NULL)
+	fail("Out of memory for the map%s", "");
+    fill_cells(snap, cells, num_cells, cell_bytes);
+
+    printf("  map (%lu bytes per cell):\n", cell_bytes);
+    for (i = 0; i < num_cells; i++) {
+	if (i * cell_bytes >= snap->hdr.heap_bytes)
+	    break;
+	if (i % cols == 0)
+	    printf("  %10lx ", i * cell_bytes);
+	c = &cells[i * SNAP_KINDS];
+	unused = c[SNAP_FREE];
+	used = most = top = 0;
+	for (kind = 0; kind < SNAP_KINDS; kind++) {
+	    if (kind != SNAP_FREE)
+		used += c[kind];
+	    if (c[kind] > most) {
+		most = c[kind];
+		top = kind;
+	    }
+	}
+	if (most == 0)
+	    putchar(' ');
+	else if (unused > 0 && used > 0)
+	    putchar(unused > used ? '-' : '+');
+	else
+	    putchar(kind_chars[top]);
+	if (i % cols == (unsigned long) cols - 1)
+	    putchar('\n');
+    }
+    if (i % cols != 0)
+	putchar('\n');
+    free(cells);
+}
+
+/*
+ * print_histogram - Print the free blocks of snap binned by powers of
+ *     two, or by free list class if by_class is set
+ */
+static void print_histogram(snapshot_t *snap, int by_class)
+{
+    unsigned long counts[NUM_BINS] = {0}, bytes[NUM_BINS] = {0};
+    unsigned long i, size, most = 0;
+    int bin;
+
+    for (i = 0; i < snap->num_blocks; i++) {
+	if (snap->blocks[i].kind != SNAP_FREE)
+	    continue;
+	size = snap->blocks[i].size;
+	if (by_class)
+	    bin = snap->blocks[i].class % NUM_BINS;
+	else
+	    bin = 63 - __builtin_clzl(size);
+	counts[bin]++;
+	bytes[bin] += size;
+    }
+    for (bin = 0; bin < NUM_BINS; bin++)
+	if (bytes[bin] > most)
+	    most = bytes[bin];
+    printf("  free blocks by %s:\n", by_class ? "class" : "size");
+    for (bin = 0; bin < NUM_BINS; bin++) {
+	if (counts[bin] == 0)
+	    continue;
+	if (by_class)
+	    printf("  %10d ", bin);
+	else
+	    printf("  %10lu ", 1UL << bin);
+	printf("%8lu %12lu |%.*s\n", counts[bin], bytes[bin],
+	       (int) ((bytes[bin] * BAR_WIDTH + most - 1) / most),
+	       "########################################");
+    }
+}
+
+/*
+ * write_image - Write snap as a PPM image to <prefix><index>.ppm
+ */
+static void write_image(snapshot_t *snap, char *prefix, int index)
+{
+    char path[1024];
+    unsigned long num_cells, cell_bytes, height, i, *c, total;
+    unsigned char pixel[3];
+    unsigned long *cells;
+    FILE *f;
+    int kind, rgb;
+
+    cell_bytes = SNAP_UNIT;
+    while ((snap->hdr.heap_bytes + cell_bytes - 1) / cell_bytes > PPM_PIXELS)
+	cell_bytes *= 2;
+    height = (snap->hdr.heap_bytes / cell_bytes + PPM_WIDTH) / PPM_WIDTH;
+    num_cells = height * PPM_WIDTH;
+    if ((cells = malloc(num_cells * SNAP_KINDS * sizeof(*cells))) == NULL)
+	fail("Out of memory for the image%s", "");
+    fill_cells(snap, cells, num_cells, cell_bytes);
+
+    snprintf(path, sizeof(path), "%s%d.ppm", prefix, index);
+    if ((f = fopen(path, "wb")) == NULL)
+	fail("Could not create %s", path);
+    fprintf(f, "P6\n%d %lu\n255\n", PPM_WIDTH, height);
+    for (i = 0; i < num_cells; i++) {
+	c = &cells[i * SNAP_KINDS];
+	for (rgb = 0; rgb < 3; rgb++) {
+	    total = 0;
+	    for (kind = 0; kind < SNAP_KINDS; kind++)
+		total += c[kind] * kind_colors[kind][rgb];
+	    pixel[rgb] = (unsigned char) (total / cell_bytes);
+	}
+	fwrite(pixel, 1, 3, f);
+    }
+    if (fclose(f) != 0)
+	fail("Could not write %s", path);
+    free(cells);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c] [-n <index>] [-w <cols>] [-r <rows>] "
+	    "[-p <prefix>] <file>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    snapshot_t snap = {{{0}}, NULL, 0, 0};
+    int c, index, only = -1, by_class = 0, rows = 24, cols = 64;
+    char *prefix = NULL;
+    FILE *f;
+
+    while ((c = getopt(argc, argv, "cn:w:r:p:")) != EOF) {
+	switch (c) {
+	case 'c':
+	    by_class = 1;
+	    break;
+	case 'n':
+	    only = atoi(optarg);
+	    break;
+	case 'w':
+	    cols = atoi(optarg);
+	    break;
+	case 'r':
+	    rows = atoi(optarg);
+	    break;
+	case 'p':
+	    prefix = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1 || rows < 1 || cols < 1)
+	usage(argv[0]);
+    if ((f = fopen(argv[optind], "rb")) == NULL)
+	fail("Could not open %s", argv[optind]);
+
+    for (index = 0; read_snapshot(f, &snap, argv[optind]); index++) {
+	if (only >= 0 && index != only)
+	    continue;
+	print_summary(&snap, index);
+	print_map(&snap, rows, cols);
+	print_histogram(&snap, by_class);
+	if (prefix != NULL)
+	    write_image(&snap, prefix, index);
+	printf("\n");
+    }
+    fclose(f);
+    free(snap.blocks);
+    exit(0);
+}
@@ -0,0 +1,147 @@
+/*
+ * perfctr.c - Hardware event counters through Linux perf_event_open
+ *
+ * Every event gets a counter of its own rather than joining a group, so
+ * that an event the CPU (or a virtual machine) lacks costs only its own
+ * column. When there are more events than hardware counters, the kernel
+ * time-slices them; the enabled and running times read back with each
+ * count are used to scale it up to the whole interval. Elsewhere, or
+ * where perf_event_open is forbidden, no event is supported.
+ */
+#include <string.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+
+const char *perf_names[NUM_PERF_EVENTS] = {
+    "cyc", "ins", "L1Dmis", "LLCmis", "TLBmis", "brmis"
+};
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Cache events are encoded as cache | op << 8 | result << 16 */
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+/* Type and config of each event, in perf_names order */
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[NUM_PERF_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+				     PERF_COUNT_HW_CACHE_OP_READ,
+				     PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_LL,
+				     PERF_COUNT_HW_CACHE_OP_READ,
+				     PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+				     PERF_COUNT_HW_CACHE_OP_READ,
+				     PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/* File descriptor of each event's counter, or -1 */
+static int fds[NUM_PERF_EVENTS] = {-1, -1, -1, -1, -1, -1};
+
+/* 
+ * perf_open - Open a disabled counter for every supported event
+ */
+int perf_open(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < NUM_PERF_EVENTS; i++) {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    return n;
+}
+
+/* 
+ * perf_close - Close every open counter
+ */
+void perf_close(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_EVENTS; i++) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+	fds[i] = -1;
+    }
+}
+
+/* 
+ * perf_start - Zero and enable every open counter
+ */
+void perf_start(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_EVENTS; i++)
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/* 
+ * perf_stop - Disable every open counter and read back its count
+ */
+void perf_stop(double counts[NUM_PERF_EVENTS])
+{
+    unsigned long long val[3]; /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < NUM_PERF_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < NUM_PERF_EVENTS; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0 || read(fds[i], val, sizeof(val)) != sizeof(val))
+	    continue;
+	if (val[2] == 0) /* never got a hardware counter */
+	    continue;
+	counts[i] = (double) val[0] * val[1] / val[2];
+    }
+}
+
+#else
+
+int perf_open(void)
+{
+    return 0;
+}
+
+void perf_close(void)
+{
+}
+
+void perf_start(void)
+{
+}
+
+void perf_stop(double counts[NUM_PERF_EVENTS])
+{
+    int i;
+
+    for (i = 0; i < NUM_PERF_EVENTS; i++)
+	counts[i] = -1;
+}
+#endif
@@ -0,0 +1,25 @@
+/*
+ * perfctr.h - prototypes for the hardware event counters in perfctr.c,
+ *     used to explain where the cycles of a trace replay go
+ */
+
+/* Events counted, in the order of the values perf_stop() returns */
+enum {PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES,
+      PERF_DTLB_MISSES, PERF_BRANCH_MISSES, NUM_PERF_EVENTS};
+
+/* Short column names of the events */
+extern const char *perf_names[NUM_PERF_EVENTS];
+
+/* Open a counter for every event this machine supports (user-space
+   only, calling thread only), and return how many it does */
+int perf_open(void);
+
+/* Close the counters again */
+void perf_close(void);
+
+/* Reset the counters and start counting */
+void perf_start(void);
+
+/* Stop counting and store each event's count in counts, scaled up if
+   the kernel had to multiplex the counter, or -1 if it is unsupported */
+void perf_stop(double counts[NUM_PERF_EVENTS]);
@@ -0,0 +1,106 @@
+/*
+ * rep2bin - Convert a .rep trace file to the binary trace format
+ *     described in tracefmt.h
+ *
+ * usage: rep2bin <in.rep> <out>
+ *
+ * The requests are streamed from the input to the output one at a time,
+ * so traces of any length can be converted in constant memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracefmt.h"
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tracehdr_t hdr;
+    char type[2];
+    unsigned index, size, count;
+    unsigned char buf[1 + 3*MAX_VARINT_LEN], *p;
+    int num_ops = 0;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	fprintf(stderr, "Could not open %s\n", argv[1]);
+	exit(1);
+    }
+    if ((out = fopen(argv[2], "w")) == NULL) {
+	fprintf(stderr, "Could not create %s\n", argv[2]);
+	exit(1);
+    }
+
+    /* Copy the header */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids, 
+	       &hdr.num_ops, &hdr.weight) != 4) {
+	fprintf(stderr, "Bad header in %s\n", argv[1]);
+	exit(1);
+    }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    /* Pack each request */
+    while (fscanf(in, "%1s", type) == 1) {
+	p = buf;
+	*p++ = type[0];
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2) {
+		fprintf(stderr, "Bad request %d in %s\n", num_ops, argv[1]);
+		exit(1);
+	    }
+	    p = put_varint(p, index);
+	    p = put_varint(p, size);
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1) {
+		fprintf(stderr, "Bad request %d in %s\n", num_ops, argv[1]);
+		exit(1);
+	    }
+	    p = put_varint(p, index);
+	    break;
+	case 'A':
+	    if (fscanf(in, "%u %u %u", &index, &count, &size) != 3) {
+		fprintf(stderr, "Bad request %d in %s\n", num_ops, argv[1]);
+		exit(1);
+	    }
+	    p = put_varint(p, index);
+	    p = put_varint(p, count);
+	    p = put_varint(p, size);
+	    break;
+	case 'F':
+	    if (fscanf(in, "%u %u", &index, &count) != 2) {
+		fprintf(stderr, "Bad request %d in %s\n", num_ops, argv[1]);
+		exit(1);
+	    }
+	    p = put_varint(p, index);
+	    p = put_varint(p, count);
+	    break;
+	default:
+	    fprintf(stderr, "Bogus type character (%c) in %s\n", 
+		    type[0], argv[1]);
+	    exit(1);
+	}
+	fwrite(buf, 1, p - buf, out);
+	num_ops++;
+    }
+    fclose(in);
+
+    if (num_ops != hdr.num_ops) {
+	fprintf(stderr, "%s has %d requests but its header says %d\n", 
+		argv[1], num_ops, hdr.num_ops);
+	exit(1);
+    }
+    if (fclose(out) != 0) {
+	fprintf(stderr, "Could not write %s\n", argv[2]);
+	exit(1);
+    }
+    exit(0);
+}
@@ -0,0 +1,50 @@
+/*
+ * snapfmt.h - the binary heap snapshot format, written by mm_snapshot
+ *     and read by mmsnap
+ *
+ * A snapshot file is any number of snapshots back to back. Each one is
+ * a snaphdr_t, then every heap segment of every arena as a snapseg_t
+ * followed by one snapblk_t for each of its blocks, in address order,
+ * and finally a snapseg_t with no blocks. A segment's blocks are laid
+ * out contiguously from its offset, so a block's offset is that of the
+ * segment plus the sizes of the blocks before it. Offsets are from the
+ * start of the heap, and all fields are in host byte order. Mapped
+ * blocks lie outside the heap and are only counted in mapped_bytes.
+ */
+#ifndef __SNAPFMT_H_
+#define __SNAPFMT_H_
+
+#define SNAP_MAGIC "MMSNAP\001\000" /* first bytes of every snapshot */
+#define SNAP_MAGIC_LEN 8
+#define SNAP_UNIT 16                /* block sizes are in these units */
+
+/* What a block is being used for */
+#define SNAP_FREE     0 /* on a free list */
+#define SNAP_ALLOC    1 /* handed out */
+#define SNAP_DEFERRED 2 /* freed, but on a quick list */
+#define SNAP_CACHED   3 /* freed, but in the snapshotting thread's cache */
+#define SNAP_SLAB     4 /* holds a slab of small objects */
+#define SNAP_KINDS    5
+
+typedef struct {
+    char magic[SNAP_MAGIC_LEN]; /* SNAP_MAGIC */
+    unsigned id;                /* caller's labels, e.g. trace number */
+    unsigned op;                /* ... and request index */
+    unsigned long heap_bytes;   /* bytes in the heap */
+    unsigned long mapped_bytes; /* bytes in mapped blocks */
+} snaphdr_t;
+
+typedef struct {
+    unsigned long offset;       /* of the segment's first block header */
+    unsigned num_blocks;        /* blocks that follow, 0 at the end */
+    unsigned arena;             /* index of the arena owning them */
+} snapseg_t;
+
+typedef struct {
+    unsigned size;              /* block size in SNAP_UNITs */
+    unsigned char kind;         /* SNAP_FREE, SNAP_ALLOC, ... */
+    unsigned char class;        /* free list class of its size */
+    unsigned short pad;
+} snapblk_t;
+
+#endif /* __SNAPFMT_H_ */
@@ -0,0 +1,100 @@
+/*
+ * tracefmt.h - the binary trace format, read by mdriver and written by
+ *     rep2bin
+ *
+ * A binary trace holds the same requests as a .rep trace file. It starts
+ * with a tracehdr_t, whose fields are those of the four header lines of a
+ * .rep file, followed by num_ops packed requests. Each request is one type
+ * byte ('a', 'r', 'f', 'A' or 'F', as in .rep files), then the id as an
+ * unsigned LEB128 varint, then for the batch requests 'A' and 'F' the
+ * number of ids as another varint, then for 'a', 'r' and 'A' the byte size.
+ * A batch covers that many consecutive ids from the given one: 'A' allocates
+ * a block of the size for each of them with mm_malloc_batch (written
+ * "A <id> <count> <size>" in a .rep file), and 'F' frees them all with
+ * mm_free_batch ("F <id> <count>").
+ * Header fields are in host byte order. mdriver maps a binary trace into
+ * memory and decodes the requests in place while replaying them.
+ */
+#ifndef __TRACEFMT_H_
+#define __TRACEFMT_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_MAGIC "MMTRACE\001" /* first bytes of every binary trace */
+#define TRACE_MAGIC_LEN 8
+#define MAX_VARINT_LEN 5          /* bytes needed for any 32-bit value */
+
+typedef struct {
+    char magic[TRACE_MAGIC_LEN]; /* TRACE_MAGIC, without its NUL */
+    int sugg_heapsize;           /* suggested heap size (unused) */
+    int num_ids;                 /* number of alloc/realloc ids */
+    int num_ops;                 /* number of distinct requests */
+    int weight;                  /* weight for this trace (unused) */
+} tracehdr_t;
+
+/* 
+ * is_binary_trace - Return true if buf, of len bytes, begins with a
+ *     binary trace header
+ */
+static inline int is_binary_trace(const void *buf, size_t len)
+{
+    return len >= sizeof(tracehdr_t) && 
+	memcmp(buf, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0;
+}
+
+/* 
+ * put_varint - Encode v at p and return the byte just after it 
+ */
+static inline unsigned char *put_varint(unsigned char *p, unsigned v)
+{
+    while (v >= 0x80) {
+	*p++ = (unsigned char) (v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+/* 
+ * get_varint - Decode the varint at p into *v and return the byte just
+ *     after it, or NULL if it runs past end or is too long
+ */
+static inline const unsigned char *get_varint(const unsigned char *p, 
+					      const unsigned char *end, 
+					      unsigned *v)
+{
+    unsigned result = 0;
+    int shift;
+
+    for (shift = 0; shift < 7*MAX_VARINT_LEN && p < end; shift += 7) {
+	result |= (unsigned) (*p & 0x7F) << shift;
+	if ((*p++ & 0x80) == 0) {
+	    *v = result;
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+/* 
+ * read_varint - Decode the varint at the current position of f into *v
+ *     and return 1, or return 0 if f ends first or the varint is too long
+ */
+static inline int read_varint(FILE *f, unsigned *v)
+{
+    unsigned result = 0;
+    int shift, ch;
+
+    for (shift = 0; shift < 7*MAX_VARINT_LEN && (ch = getc(f)) != EOF; 
+	 shift += 7) {
+	result |= (unsigned) (ch & 0x7F) << shift;
+	if ((ch & 0x80) == 0) {
+	    *v = result;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+#endif /* __TRACEFMT_H_ */
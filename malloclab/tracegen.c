@@ -0,0 +1,435 @@
+/*
+ * tracegen - Generate a synthetic trace from a parametric workload model
+ *
+ * usage: tracegen [-b] [-s <seed>] <model> <out>
+ *
+ * The model file describes the workload as a sequence of phases, one
+ * directive per line, with '#' starting a comment:
+ *
+ *   phase <ops>                   start a phase of <ops> requests
+ *   size <lo> <hi> <weight>       sizes uniform in [lo, hi] bytes are
+ *                                 drawn with the given relative weight
+ *   lifetime fixed <n>            blocks live n requests,
+ *   lifetime exp <mean>           ... an exponentially distributed
+ *                                 number of requests,
+ *   lifetime pareto <min> <alpha> ... or a heavy-tailed one
+ *   realloc <prob> <factor> [max] each request is, with probability
+ *                                 prob, a realloc of a random live block
+ *                                 to factor times its size, up to max
+ *                                 bytes (default 1 MB)
+ *   drain                         free every live block ending the phase
+ *
+ * The size lines of a phase make up its size histogram. A phase without
+ * size lines, and a phase without a lifetime or realloc line, carries
+ * those over from the phase before it. Blocks outlive the phase they
+ * were allocated in unless it is drained, so long-lived data from one
+ * phase stays put while the next one churns. All blocks still live at
+ * the end are freed, in the order their lifetimes run out, so the trace
+ * is balanced. Ids of freed blocks are reused, which keeps the number of
+ * ids near the largest number of live blocks.
+ *
+ * The trace is written as a .rep file, or with -b in the binary format
+ * of tracefmt.h. Either way the requests are streamed out as they are
+ * generated and the header is patched at the end, so traces of millions
+ * of requests take memory only for the live blocks. The peak live size
+ * of the trace must fit the driver's heap (MAX_HEAP in config.h, or the
+ * size given to mdriver -m).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE     1024      /* max length of a model line */
+#define MAXBUCKETS    64      /* max number of size lines in a phase */
+#define MAXPHASES    256      /* max number of phases in a model */
+#define REALLOC_MAX (1 << 20) /* default size cap of realloc growth */
+
+/* One bar of a size histogram */
+typedef struct {
+    unsigned lo, hi;   /* sizes of the bar, inclusive */
+    double weight;     /* relative weight of the bar */
+} bucket_t;
+
+/* The parameters of one phase of the workload */
+typedef struct {
+    long ops;                       /* number of requests in the phase */
+    bucket_t buckets[MAXBUCKETS];   /* its size histogram ... */
+    int num_buckets;
+    double total_weight;            /* ... and the sum of its weights */
+    enum {FIXED, EXP, PARETO} lifetime; /* lifetime distribution ... */
+    double life_a, life_b;          /* ... and its parameters */
+    double realloc_prob;            /* chance of a realloc per request */
+    double realloc_factor;          /* size change of each realloc */
+    unsigned realloc_max;           /* largest size realloc grows to */
+    int drain;                      /* free everything at the end? */
+} phase_t;
+
+/* A live block, as an entry of the min-heap of blocks by death time */
+typedef struct {
+    long death;        /* request number at which the block is freed */
+    unsigned id;
+} death_t;
+
+/* The generator's state */
+static FILE *out;               /* the trace being written ... */
+static int binary;              /* ... in the binary format? */
+static long num_ops;            /* requests written so far */
+static unsigned num_ids;        /* ids handed out so far */
+static unsigned long long seed = 1; /* state of the random generator */
+
+static death_t *deaths;         /* min-heap of live blocks by death */
+static unsigned num_live;       /* number of live blocks */
+static unsigned *sizes;         /* current size of each live id */
+static unsigned *free_ids;      /* stack of ids free for reuse */
+static unsigned num_free_ids;
+static unsigned capacity;       /* ids the arrays have room for */
+
+/*
+ * fail - Report a fatal error, formatted with arg, and exit
+ */
+static void fail(const char *msg, const char *arg)
+{
+    fprintf(stderr, msg, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * rand_unit - Return a uniformly distributed double in (0, 1)
+ *     (xorshift64*)
+ */
+static double rand_unit(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return ((seed * 2685821657736338717ULL >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/*
+ * draw_size - Draw a size from the histogram of phase ph
+ */
+static unsigned draw_size(phase_t *ph)
+{
+    double u = rand_unit() * ph->total_weight;
+    bucket_t *b = ph->buckets;
+
+    while (u >= b->weight && b < ph->buckets + ph->num_buckets - 1) {
+	u -= b->weight;
+	b++;
+    }
+    return b->lo + (unsigned) (rand_unit() * (b->hi - b->lo + 1));
+}
+
+/*
+ * draw_lifetime - Draw a lifetime, in requests, for phase ph
+ */
+static long draw_lifetime(phase_t *ph)
+{
+    double life;
+
+    switch (ph->lifetime) {
+    case EXP:
+	life = -ph->life_a * log(rand_unit());
+	break;
+    case PARETO:
+	life = ph->life_a / pow(rand_unit(), 1.0 / ph->life_b);
+	break;
+    default:
+	life = ph->life_a;
+    }
+    return (life < 1) ? 1 : (life > 1e15) ? (long) 1e15 : (long) life;
+}
+
+/*
+ * emit - Append one request to the trace
+ */
+static void emit(char type, unsigned id, unsigned size)
+{
+    unsigned char buf[1 + 2*MAX_VARINT_LEN], *p = buf;
+
+    if (!binary) {
+	if (type == 'f')
+	    fprintf(out, "f %u\n", id);
+	else
+	    fprintf(out, "%c %u %u\n", type, id, size);
+    } else {
+	*p++ = type;
+	p = put_varint(p, id);
+	if (type != 'f')
+	    p = put_varint(p, size);
+	fwrite(buf, 1, p - buf, out);
+    }
+    num_ops++;
+}
+
+/*
+ * swap_deaths - Swap two entries of the death heap
+ */
+static void swap_deaths(unsigned i, unsigned j)
+{
+    death_t t = deaths[i];
+
+    deaths[i] = deaths[j];
+    deaths[j] = t;
+}
+
+/*
+ * sift_down - Restore the heap order below entry i
+ */
+static void sift_down(unsigned i)
+{
+    unsigned child;
+
+    while ((child = 2*i + 1) < num_live) {
+	if (child + 1 < num_live &&
+	    deaths[child + 1].death < deaths[child].death)
+	    child++;
+	if (deaths[i].death <= deaths[child].death)
+	    break;
+	swap_deaths(i, child);
+	i = child;
+    }
+}
+
+/*
+ * alloc_block - Allocate a new block of the given size that dies at
+ *     request death
+ */
+static void alloc_block(unsigned size, long death)
+{
+    unsigned id, i;
+
+    if (num_free_ids > 0)
+	id = free_ids[--num_free_ids];
+    else {
+	id = num_ids++;
+	if (num_ids > capacity) {
+	    capacity = capacity ? 2*capacity : 1024;
+	    deaths = realloc(deaths, capacity * sizeof(death_t));
+	    sizes = realloc(sizes, capacity * sizeof(unsigned));
+	    free_ids = realloc(free_ids, capacity * sizeof(unsigned));
+	    if (!deaths || !sizes || !free_ids)
+		fail("Out of memory in %s", "alloc_block");
+	}
+    }
+    sizes[id] = size;
+    emit('a', id, size);
+
+    /* Sift the block up from the bottom of the heap */
+    i = num_live++;
+    deaths[i].death = death;
+    deaths[i].id = id;
+    while (i > 0 && deaths[(i - 1) / 2].death > deaths[i].death) {
+	swap_deaths(i, (i - 1) / 2);
+	i = (i - 1) / 2;
+    }
+}
+
+/*
+ * free_first - Free the live block that dies first
+ */
+static void free_first(void)
+{
+    unsigned id = deaths[0].id;
+
+    emit('f', id, 0);
+    free_ids[num_free_ids++] = id;
+    swap_deaths(0, --num_live);
+    sift_down(0);
+}
+
+/*
+ * realloc_block - Resize a random live block according to phase ph
+ */
+static void realloc_block(phase_t *ph)
+{
+    unsigned id = deaths[(unsigned) (rand_unit() * num_live)].id;
+    double size = sizes[id] * ph->realloc_factor;
+
+    if (size > ph->realloc_max)
+	size = ph->realloc_max;
+    if (size < 1)
+	size = 1;
+    sizes[id] = (unsigned) size;
+    emit('r', id, sizes[id]);
+}
+
+/*
+ * read_model - Parse the model file at path into phases and return
+ *     their number
+ */
+static int read_model(const char *path, phase_t *phases)
+{
+    FILE *f;
+    char line[MAXLINE], where[MAXLINE], kind[MAXLINE];
+    phase_t *ph = NULL;
+    int n = 0, new_sizes = 0, linenum = 0;
+    unsigned lo, hi, max;
+    double a, b;
+    char *p;
+
+    if ((f = fopen(path, "r")) == NULL)
+	fail("Could not open %s", path);
+    while (fgets(line, MAXLINE, f) != NULL) {
+	linenum++;
+	sprintf(where, "%d", linenum);
+	if ((p = strchr(line, '#')) != NULL)
+	    *p = '\0';
+	if (sscanf(line, "%s", kind) != 1)
+	    continue;
+	if (!strcmp(kind, "phase")) {
+	    if (n == MAXPHASES)
+		fail("Too many phases at line %s", where);
+	    ph = &phases[n];
+	    if (n > 0) {
+		/* Carry everything over from the phase before */
+		*ph = phases[n - 1];
+		ph->drain = 0;
+	    } else {
+		memset(ph, 0, sizeof(*ph));
+		ph->lifetime = FIXED;
+		ph->life_a = 1;
+		ph->realloc_factor = 1;
+		ph->realloc_max = REALLOC_MAX;
+	    }
+	    if (sscanf(line, "%*s %ld", &ph->ops) != 1 || ph->ops < 0)
+		fail("Bad phase at line %s", where);
+	    new_sizes = 0;
+	    n++;
+	    continue;
+	}
+	if (ph == NULL)
+	    fail("Directive before the first phase at line %s", where);
+	if (!strcmp(kind, "size")) {
+	    if (!new_sizes) {
+		ph->num_buckets = 0;
+		ph->total_weight = 0;
+		new_sizes = 1;
+	    }
+	    if (ph->num_buckets == MAXBUCKETS)
+		fail("Too many sizes at line %s", where);
+	    if (sscanf(line, "%*s %u %u %lf", &lo, &hi, &a) != 3 ||
+		lo < 1 || hi < lo || a < 0)
+		fail("Bad size at line %s", where);
+	    ph->buckets[ph->num_buckets].lo = lo;
+	    ph->buckets[ph->num_buckets].hi = hi;
+	    ph->buckets[ph->num_buckets].weight = a;
+	    ph->num_buckets++;
+	    ph->total_weight += a;
+	} else if (!strcmp(kind, "lifetime")) {
+	    b = 0;
+	    if (sscanf(line, "%*s %s %lf %lf", kind, &a, &b) < 2 || a <= 0)
+		fail("Bad lifetime at line %s", where);
+	    if (!strcmp(kind, "fixed"))
+		ph->lifetime = FIXED;
+	    else if (!strcmp(kind, "exp"))
+		ph->lifetime = EXP;
+	    else if (!strcmp(kind, "pareto") && b > 0)
+		ph->lifetime = PARETO;
+	    else
+		fail("Bad lifetime at line %s", where);
+	    ph->life_a = a;
+	    ph->life_b = b;
+	} else if (!strcmp(kind, "realloc")) {
+	    max = REALLOC_MAX;
+	    if (sscanf(line, "%*s %lf %lf %u", &a, &b, &max) < 2 ||
+		a < 0 || a > 1 || b <= 0)
+		fail("Bad realloc at line %s", where);
+	    ph->realloc_prob = a;
+	    ph->realloc_factor = b;
+	    ph->realloc_max = max;
+	} else if (!strcmp(kind, "drain"))
+	    ph->drain = 1;
+	else
+	    fail("Unknown directive at line %s", where);
+    }
+    fclose(f);
+    for (int i = 0; i < n; i++)
+	if (phases[i].ops > 0 && phases[i].num_buckets == 0)
+	    fail("A phase of %s has no sizes", path);
+    return n;
+}
+
+/*
+ * write_header - Write (or rewrite) the header at the start of the trace
+ */
+static void write_header(void)
+{
+    tracehdr_t hdr;
+
+    rewind(out);
+    if (!binary)
+	/* Fixed-width fields, so that the final header fits over the first */
+	fprintf(out, "%20d\n%20u\n%20ld\n%20d\n", 0, num_ids, num_ops, 1);
+    else {
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	hdr.num_ids = num_ids;
+	hdr.num_ops = num_ops;
+	hdr.weight = 1;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static phase_t phases[MAXPHASES];
+    phase_t *ph;
+    int c, i, num_phases;
+    long n;
+
+    while ((c = getopt(argc, argv, "bs:")) != EOF) {
+	switch (c) {
+	case 'b':
+	    binary = 1;
+	    break;
+	case 's':
+	    seed = strtoull(optarg, NULL, 0);
+	    if (seed == 0) /* xorshift never leaves 0 */
+		seed = 1;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-b] [-s <seed>] <model> <out>\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+    if (argc - optind != 2) {
+	fprintf(stderr, "usage: %s [-b] [-s <seed>] <model> <out>\n", argv[0]);
+	exit(1);
+    }
+    num_phases = read_model(argv[optind], phases);
+    if ((out = fopen(argv[optind + 1], "w")) == NULL)
+	fail("Could not create %s", argv[optind + 1]);
+    write_header();
+
+    /* Each request frees a block whose time has come, or else is a
+       realloc or an alloc as the phase's odds decide */
+    for (i = 0; i < num_phases; i++) {
+	ph = &phases[i];
+	for (n = 0; n < ph->ops; n++) {
+	    if (num_live > 0 && deaths[0].death <= num_ops)
+		free_first();
+	    else if (num_live > 0 && rand_unit() < ph->realloc_prob)
+		realloc_block(ph);
+	    else
+		alloc_block(draw_size(ph), num_ops + draw_lifetime(ph));
+	}
+	if (ph->drain)
+	    while (num_live > 0)
+		free_first();
+    }
+    while (num_live > 0)
+	free_first();
+
+    write_header();
+    if (fclose(out) != 0)
+	fail("Could not write %s", argv[optind + 1]);
+    fprintf(stderr, "%ld requests, %u ids\n", num_ops, num_ids);
+    exit(0);
+}